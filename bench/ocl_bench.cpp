@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2011 by Radford Ray Juang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Benchmarks of the ray::opencl wrappers, independent of MATLAB.
+ *
+ * Usage: ocl_bench [-p platform] [-d device] [-k cl_dir] [-o file] [-r reps] [-quick]
+ *
+ *   -p, -d   zero-based platform and device index (default 0, 0)
+ *   -k       directory with the matlab_kernels_*.cl files (default cl)
+ *   -o       write the results to file instead of stdout
+ *   -r       repetitions per measurement (default 20); the median is reported
+ *   -quick   smaller transfer sizes and arrays, e.g. for CI on a CPU device
+ *
+ * Results are written as JSON: the device, then one entry per measurement
+ * with the benchmark, the case (size or kernel name), the value and its unit.
+ * Any OpenCL implementation works, including CPU ICDs such as POCL.
+ */
+#include <ray/opencl/opencl.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace ray::opencl;
+
+typedef struct _BenchResult {
+    std::string benchmark;
+    std::string name;       //Case: transfer size, kernel name, ...
+    double      value;
+    std::string unit;
+} BenchResult;
+
+static std::vector<BenchResult> g_results;
+
+static void report(const std::string &benchmark, const std::string &name, double value, const char *unit) {
+    BenchResult r;
+    r.benchmark = benchmark;
+    r.name = name;
+    r.value = value;
+    r.unit = unit;
+    g_results.push_back(r);
+
+    std::cerr << benchmark << " " << name << ": " << value << " " << unit << std::endl;
+}
+
+static double median(std::vector<double> v) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+static std::string size_name(size_t bytes) {
+    std::ostringstream s;
+    if (bytes >= (1 << 20))     s << (bytes >> 20) << "MB";
+    else if (bytes >= (1 << 10)) s << (bytes >> 10) << "KB";
+    else                         s << bytes << "B";
+    return s.str();
+}
+
+//Seconds between two OCLProfiler::host_time() values
+static double seconds(cl_ulong start, cl_ulong end) {
+    return (end - start) * 1e-9;
+}
+
+static std::string escape(const std::string &text) {
+    std::string s;
+    for (size_t i=0; i<text.size(); ++i) {
+        char c = text[i];
+        if ((c == '"') || (c == '\\')) s += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) c = ' ';
+        s += c;
+    }
+    return s;
+}
+
+static void write_json(std::ostream &out, const std::string &device, const std::string &version) {
+    out.precision(10);
+    out << "{\n  \"device\": \"" << escape(device) << "\",\n"
+        << "  \"driver_version\": \"" << escape(version) << "\",\n"
+        << "  \"results\": [";
+    for (size_t i=0; i<g_results.size(); ++i) {
+        const BenchResult &r = g_results[i];
+        out << ((i > 0) ? ",\n" : "\n")
+            << "    {\"benchmark\": \"" << escape(r.benchmark) << "\", \"case\": \"" << escape(r.name)
+            << "\", \"value\": " << r.value << ", \"unit\": \"" << r.unit << "\"}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+/********************************
+ * BENCHMARKS                   *
+ ********************************/
+
+//Blocking host to device and device to host copies of increasing size
+static void bench_bandwidth(OCLContext &context, OCLCommandQueue &queue, size_t max_bytes, int reps) {
+    std::vector<char> host(max_bytes, 1);
+    OCLBuffer buffer(context, CL_MEM_READ_WRITE, max_bytes);
+
+    for (size_t bytes = 4096; bytes <= max_bytes; bytes *= 4) {
+        std::vector<double> up, down;
+        for (int r=0; r<reps; ++r) {
+            cl_ulong t0 = OCLProfiler::host_time();
+            queue.enqueue_buffer_copy(buffer.id(), &host[0], bytes, 0, CL_TRUE);
+            cl_ulong t1 = OCLProfiler::host_time();
+            queue.enqueue_buffer_copy(&host[0], buffer.id(), bytes, 0, CL_TRUE);
+            cl_ulong t2 = OCLProfiler::host_time();
+
+            up.push_back(seconds(t0, t1));
+            down.push_back(seconds(t1, t2));
+        }
+        report("host_to_device", size_name(bytes), bytes / median(up) * 1e-9, "GB/s");
+        report("device_to_host", size_name(bytes), bytes / median(down) * 1e-9, "GB/s");
+    }
+}
+
+//Time from enqueueing an empty kernel to its completion, and the cost of
+//enqueueing one when many are queued back to back
+static void bench_launch(OCLKernel &empty, OCLCommandQueue &queue, int reps) {
+    empty.set_ndims(1);
+    empty.set_global_size(1);
+    empty.set_local_size(1);
+
+    queue.enqueue_ndrange_kernel(empty);
+    queue.finish();
+
+    std::vector<double> latency;
+    for (int r=0; r<reps; ++r) {
+        cl_ulong t0 = OCLProfiler::host_time();
+        queue.enqueue_ndrange_kernel(empty);
+        queue.finish();
+        latency.push_back(seconds(t0, OCLProfiler::host_time()));
+    }
+    report("launch_latency", "empty_kernel", median(latency) * 1e6, "us");
+
+    const int batch = 100;
+    std::vector<double> enqueue;
+    for (int r=0; r<reps; ++r) {
+        cl_ulong t0 = OCLProfiler::host_time();
+        for (int i=0; i<batch; ++i) queue.enqueue_ndrange_kernel(empty);
+        cl_ulong t1 = OCLProfiler::host_time();
+        queue.finish();
+        enqueue.push_back(seconds(t0, t1) / batch);
+    }
+    report("launch_enqueue", "empty_kernel", median(enqueue) * 1e6, "us");
+}
+
+//Cost of one clSetKernelArg call, for a buffer and for a scalar argument
+static void bench_set_arg(OCLKernel &kernel, cl_mem buffer, int reps) {
+    const int calls = 10000;
+    cl_int n = 0;
+
+    std::vector<double> mem_arg, scalar_arg;
+    for (int r=0; r<reps; ++r) {
+        cl_ulong t0 = OCLProfiler::host_time();
+        for (int i=0; i<calls; ++i) kernel[0] = &buffer;
+        cl_ulong t1 = OCLProfiler::host_time();
+        for (int i=0; i<calls; ++i) kernel[3] = &n;
+        cl_ulong t2 = OCLProfiler::host_time();
+
+        mem_arg.push_back(seconds(t0, t1) / calls);
+        scalar_arg.push_back(seconds(t1, t2) / calls);
+    }
+    report("set_kernel_arg", "buffer", median(mem_arg) * 1e9, "ns");
+    report("set_kernel_arg", "int", median(scalar_arg) * 1e9, "ns");
+}
+
+//OCLProgram::build of a file without the binary cache, and from the cache
+static void bench_build(OCLContext &context, cl_device_id device, const std::string &file, const std::string &cache_dir) {
+    std::vector<double> cold;
+    for (int r=0; r<3; ++r) {
+        OCLProgram program(context);
+        program.add_source(file.c_str());
+        cl_ulong t0 = OCLProfiler::host_time();
+        program.build(device);
+        cold.push_back(seconds(t0, OCLProfiler::host_time()));
+    }
+    report("program_build", "cold", median(cold) * 1e3, "ms");
+
+    if (cache_dir.empty()) return;
+
+    //The first build fills the cache
+    std::vector<double> cached;
+    for (int r=0; r<4; ++r) {
+        OCLProgram program(context);
+        program.set_cache_dir(cache_dir.c_str());
+        program.add_source(file.c_str());
+        cl_ulong t0 = OCLProfiler::host_time();
+        program.build(device);
+        double t = seconds(t0, OCLProfiler::host_time());
+        if ((r > 0) && program.m_from_cache) cached.push_back(t);
+    }
+    if (!cached.empty()) report("program_build", "cached", median(cached) * 1e3, "ms");
+}
+
+//Bandwidth of every elementwise kernel of a matlab_kernels_*.cl file, from
+//the bytes each kernel reads and writes and the device execution time
+static void bench_elementwise(OCLContext &context, OCLCommandQueue &queue, cl_device_id device,
+    const std::string &file, size_t num_elems, int reps)
+{
+    OCLProgram program(context);
+    program.add_source(file.c_str());
+    program.build(device);
+    for (size_t i=0; i < program.m_build_status.size(); ++i) {
+        if (program.m_build_status[i].status == CL_BUILD_ERROR) {
+            std::cerr << file << ": build failed, skipped" << std::endl << program.m_build_status[i].log << std::endl;
+            return;
+        }
+    }
+
+    std::vector<cl_kernel> ids = program.get_kernels();
+    if (ids.empty()) return;
+
+    //Element size from the type prefix of the kernel names
+    std::vector<char> name(256, 0);
+    clGetKernelInfo(ids[0], CL_KERNEL_FUNCTION_NAME, name.size() - 1, &name[0], NULL);
+    size_t elem_size = (strncmp(&name[0], "double_", 7) == 0) ? 8 : 4;
+
+    size_t bytes = num_elems * elem_size;
+    std::vector<char> host(bytes, 0);
+    OCLBuffer out(context, CL_MEM_READ_WRITE, bytes);
+    OCLBuffer x(context, CL_MEM_READ_WRITE, bytes);
+    OCLBuffer y(context, CL_MEM_READ_WRITE, bytes);
+    queue.enqueue_buffer_copy(x.id(), &host[0], bytes, 0, CL_TRUE);
+    queue.enqueue_buffer_copy(y.id(), &host[0], bytes, 0, CL_TRUE);
+
+    cl_int n = (cl_int) num_elems;
+    cl_float wf = 2.0f;
+    cl_double wd = 2.0;
+    cl_mem out_id = out.id(), x_id = x.id(), y_id = y.id();
+
+    for (size_t i=0; i<ids.size(); ++i) {
+        OCLKernel kernel(ids[i]);
+        std::string fn = kernel.m_function_name;
+
+        //Argument layout from the name, as in clobject: <type>_scalar_<op>
+        //takes (out, w, x, N), <type>_<op>_scalar (out, x, w, N)
+        bool scalar_first = (fn.find("_scalar_") != std::string::npos) && (fn.find("_scalar_") == fn.find('_'));
+        bool scalar_second = !scalar_first && (fn.find("_scalar") != std::string::npos);
+        int arrays_read = (kernel.m_num_args == 3 || scalar_first || scalar_second) ? 1 : 2;
+
+        size_t width = 1;
+        if (fn.find("_v4") != std::string::npos) width = 4;
+        if (fn.find("_v8") != std::string::npos) width = 8;
+
+        kernel[0] = &out_id;
+        if (kernel.m_num_args == 3) {
+            kernel[1] = &x_id;
+        } else if (scalar_first) {
+            if (elem_size == 8) kernel[1] = &wd; else kernel[1] = &wf;
+            kernel[2] = &x_id;
+        } else if (scalar_second) {
+            kernel[1] = &x_id;
+            if (elem_size == 8) kernel[2] = &wd; else kernel[2] = &wf;
+        } else {
+            kernel[1] = &x_id;
+            kernel[2] = &y_id;
+        }
+        kernel[kernel.m_num_args - 1] = &n;
+        kernel.auto_size(device, num_elems / width);
+
+        std::vector<double> t;
+        for (int r=0; r<reps; ++r) {
+            OCLEvent evt;
+            queue.enqueue_ndrange_kernel(kernel, &evt);
+            evt.wait();
+            OCLEventProfile p = evt.get_times();
+            t.push_back((p.time_end - p.time_start) * 1e-9);
+        }
+        report("elementwise", fn, (arrays_read + 1) * bytes / median(t) * 1e-9, "GB/s");
+    }
+}
+
+/********************************
+ * MAIN                         *
+ ********************************/
+static std::string temp_dir() {
+    const char *vars[] = {"TMPDIR", "TEMP", "TMP"};
+    for (size_t i=0; i<sizeof(vars)/sizeof(vars[0]); ++i) {
+        const char *dir = getenv(vars[i]);
+        if (dir && *dir) return dir;
+    }
+#if defined(_WIN32)
+    return "";
+#else
+    return "/tmp";
+#endif
+}
+
+static bool file_exists(const std::string &path) {
+    std::ifstream f(path.c_str());
+    return f.is_open();
+}
+
+int main(int argc, char *argv[]) {
+    size_t platform_idx = 0, device_idx = 0;
+    std::string cl_dir = "cl";
+    std::string out_file;
+    int reps = 20;
+    bool quick = false;
+
+    for (int i=1; i<argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if ((arg == "-p") && has_value)         platform_idx = atoi(argv[++i]);
+        else if ((arg == "-d") && has_value)    device_idx = atoi(argv[++i]);
+        else if ((arg == "-k") && has_value)    cl_dir = argv[++i];
+        else if ((arg == "-o") && has_value)    out_file = argv[++i];
+        else if ((arg == "-r") && has_value)    reps = atoi(argv[++i]);
+        else if (arg == "-quick")               quick = true;
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-p platform] [-d device] [-k cl_dir] [-o file] [-r reps] [-quick]" << std::endl;
+            return 2;
+        }
+    }
+    if (reps < 1) reps = 1;
+
+    try {
+        std::vector<cl_platform_id> platforms = OCLPlatform::get_platform_ids();
+        if (platform_idx >= platforms.size()) {
+            std::cerr << "No platform " << platform_idx << std::endl;
+            return 1;
+        }
+        OCLPlatform platform(platforms[platform_idx]);
+
+        std::vector<cl_device_id> devices = platform.get_device_ids();
+        if (device_idx >= devices.size()) {
+            std::cerr << "No device " << device_idx << " on platform " << platform_idx << std::endl;
+            return 1;
+        }
+        cl_device_id device = devices[device_idx];
+        OCLDevice d(device);
+        std::cerr << "Device: " << d.m_properties.name << std::endl;
+
+        OCLContext context(platform);
+        context += device;
+        context.create();
+        OCLCommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+        size_t max_alloc = (size_t) d.m_properties.max_mem_alloc_size;
+        size_t max_bytes = quick ? (1 << 20) : (64 << 20);
+        while (max_bytes > max_alloc) max_bytes /= 4;
+        size_t num_elems = quick ? (1 << 18) : (1 << 24);
+        while (num_elems * 8 > max_alloc) num_elems /= 2;
+        bool fp64 = (d.m_properties.extensions.find("cl_khr_fp64") != std::string::npos) ||
+                    (d.m_properties.extensions.find("cl_amd_fp64") != std::string::npos);
+
+        bench_bandwidth(context, queue, max_bytes, reps);
+
+        OCLProgram program(context);
+        program.add_source(std::string(
+            "__kernel void bench_empty() { }\n"
+            "__kernel void bench_args(__global float *out, __global const float *x, float w, int N) { }\n"));
+        program.build(device);
+        OCLKernel empty(program, "bench_empty");
+        OCLKernel args(program, "bench_args");
+        OCLBuffer buffer(context, CL_MEM_READ_WRITE, 1024);
+
+        bench_launch(empty, queue, reps);
+        bench_set_arg(args, buffer.id(), reps);
+
+        const char *files[] = {"matlab_kernels_float.cl", "matlab_kernels_double.cl"};
+        for (size_t i=0; i<sizeof(files)/sizeof(files[0]); ++i) {
+            std::string path = cl_dir + "/" + files[i];
+            if (!file_exists(path)) {
+                std::cerr << path << ": not found, skipped" << std::endl;
+                continue;
+            }
+            if ((i == 1) && !fp64) {
+                std::cerr << path << ": no double precision on this device, skipped" << std::endl;
+                continue;
+            }
+            if (i == 0) bench_build(context, device, path, temp_dir());
+            bench_elementwise(context, queue, device, path, num_elems, reps);
+        }
+
+        if (out_file.empty()) {
+            write_json(std::cout, d.m_properties.name, d.m_properties.driver_version);
+        } else {
+            std::ofstream out(out_file.c_str(), std::ios_base::out | std::ios_base::trunc);
+            write_json(out, d.m_properties.name, d.m_properties.driver_version);
+            if (!out.good()) {
+                std::cerr << "Could not write " << out_file << std::endl;
+                return 1;
+            }
+        }
+    } catch(const OCLError &err) {
+        std::cerr << "Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* Elementwise kernels for double arrays: the double_* counterparts of the
+ * single_* kernels in matlab_kernels_float.cl, with the same names,
+ * arguments and vector variants (double_<op>_v4, double_<op>_v8).
+ *
+ * Double precision is optional in OpenCL 1.x, so the kernels are only
+ * compiled for devices with cl_khr_fp64 (or the older cl_amd_fp64). On other
+ * devices the file builds to nothing and the kernels do not exist;
+ * clobject checks the device's extensions before using them.
+ *
+ * The file can be added to the same program as matlab_kernels_float.cl.
+ */
+
+#if defined(cl_khr_fp64)
+#  pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#  define DOUBLE_KERNELS
+#elif defined(cl_amd_fp64)
+#  pragma OPENCL EXTENSION cl_amd_fp64 : enable
+#  define DOUBLE_KERNELS
+#endif
+
+#ifdef DOUBLE_KERNELS
+
+#define DOUBLE_BINARY(name, expr) \
+__kernel void double_##name(__global double *out, __global const double *x, __global const double *y, int N) { \
+  for (int id = get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    double b = y[id]; \
+    out[id] = expr; \
+  } \
+}
+
+#define DOUBLE_SCALAR(name, expr) \
+__kernel void double_##name(__global double *out, double w, __global const double *x, int N) { \
+  for (int id = get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    out[id] = expr; \
+  } \
+}
+
+#define DOUBLE_VECTOR_SCALAR(name, expr) \
+__kernel void double_##name(__global double *out, __global const double *x, double w, int N) { \
+  for (int id = get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    out[id] = expr; \
+  } \
+}
+
+#define DOUBLE_UNARY(name, expr) \
+__kernel void double_##name(__global double *out, __global const double *x, int N) { \
+  for (int id = get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    out[id] = expr; \
+  } \
+}
+
+/* Vector variants, see the single_<op>_v<W> kernels */
+#define DOUBLE_BINARY_V(name, W, expr) \
+__kernel void double_##name##_v##W(__global double *out, __global const double *x, __global const double *y, int N) { \
+  int nvec = N / W; \
+  int id; \
+  for (id = get_global_id(0); id < nvec; id += get_global_size(0)) { \
+    double##W a = vload##W(id, x); \
+    double##W b = vload##W(id, y); \
+    vstore##W(expr, id, out); \
+  } \
+  for (id = nvec*W + get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    double b = y[id]; \
+    out[id] = expr; \
+  } \
+}
+
+#define DOUBLE_SCALAR_V(name, W, expr) \
+__kernel void double_##name##_v##W(__global double *out, double w, __global const double *x, int N) { \
+  int nvec = N / W; \
+  int id; \
+  for (id = get_global_id(0); id < nvec; id += get_global_size(0)) { \
+    double##W a = vload##W(id, x); \
+    vstore##W(expr, id, out); \
+  } \
+  for (id = nvec*W + get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    out[id] = expr; \
+  } \
+}
+
+#define DOUBLE_VECTOR_SCALAR_V(name, W, expr) \
+__kernel void double_##name##_v##W(__global double *out, __global const double *x, double w, int N) { \
+  int nvec = N / W; \
+  int id; \
+  for (id = get_global_id(0); id < nvec; id += get_global_size(0)) { \
+    double##W a = vload##W(id, x); \
+    vstore##W(expr, id, out); \
+  } \
+  for (id = nvec*W + get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    out[id] = expr; \
+  } \
+}
+
+#define DOUBLE_UNARY_V(name, W, expr) \
+__kernel void double_##name##_v##W(__global double *out, __global const double *x, int N) { \
+  int nvec = N / W; \
+  int id; \
+  for (id = get_global_id(0); id < nvec; id += get_global_size(0)) { \
+    double##W a = vload##W(id, x); \
+    vstore##W(expr, id, out); \
+  } \
+  for (id = nvec*W + get_global_id(0); id < N; id += get_global_size(0)) { \
+    double a = x[id]; \
+    out[id] = expr; \
+  } \
+}
+
+/* Same list of operations as matlab_kernels_float.cl */
+#define DOUBLE_KERNELS_V(W, BINARY, SCALAR, VECTOR_SCALAR, UNARY) \
+  BINARY(add, W, a + b) \
+  BINARY(minus, W, a - b) \
+  BINARY(divide, W, a / b) \
+  BINARY(times, W, a * b) \
+  SCALAR(scalar_times, W, w * a) \
+  SCALAR(scalar_add, W, w + a) \
+  SCALAR(scalar_minus, W, w - a) \
+  SCALAR(scalar_divide, W, w / a) \
+  VECTOR_SCALAR(times_scalar, W, w * a) \
+  VECTOR_SCALAR(add_scalar, W, w + a) \
+  VECTOR_SCALAR(minus_scalar, W, a - w) \
+  VECTOR_SCALAR(divide_scalar, W, a / w) \
+  UNARY(exponential, W, exp(a))
+
+/* The scalar kernels take no width; these drop it */
+#define DOUBLE_BINARY_1(name, W, expr) DOUBLE_BINARY(name, expr)
+#define DOUBLE_SCALAR_1(name, W, expr) DOUBLE_SCALAR(name, expr)
+#define DOUBLE_VECTOR_SCALAR_1(name, W, expr) DOUBLE_VECTOR_SCALAR(name, expr)
+#define DOUBLE_UNARY_1(name, W, expr) DOUBLE_UNARY(name, expr)
+
+DOUBLE_KERNELS_V(1, DOUBLE_BINARY_1, DOUBLE_SCALAR_1, DOUBLE_VECTOR_SCALAR_1, DOUBLE_UNARY_1)
+DOUBLE_KERNELS_V(4, DOUBLE_BINARY_V, DOUBLE_SCALAR_V, DOUBLE_VECTOR_SCALAR_V, DOUBLE_UNARY_V)
+DOUBLE_KERNELS_V(8, DOUBLE_BINARY_V, DOUBLE_SCALAR_V, DOUBLE_VECTOR_SCALAR_V, DOUBLE_UNARY_V)
+
+#endif
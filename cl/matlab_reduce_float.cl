@@ -0,0 +1,68 @@
+/* Reductions over all elements of a float array.
+ *
+ * Each kernel reduces its input to one value per work-group: work-items
+ * first accumulate a strided range of the input in a register, then the
+ * work-group combines the values in local memory as a binary tree. The
+ * local size must be a power of two and scratch must hold one float per
+ * work-item.
+ *
+ * Large arrays are reduced in two passes (see clobject.sum): the first
+ * writes one partial result per work-group, the second reduces the partials
+ * with a single work-group.
+ */
+
+#define SINGLE_REDUCE(name, init, load, combine, finish) \
+__kernel void single_reduce_##name(__global float *out, __global const float *x, __local float *scratch, int N) { \
+  float acc = init; \
+  for (int id = get_global_id(0); id < N; id += get_global_size(0)) { \
+    float a = acc; \
+    float b = load; \
+    acc = combine; \
+  } \
+  \
+  int lid = get_local_id(0); \
+  scratch[lid] = acc; \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  \
+  for (int s = get_local_size(0)/2; s > 0; s >>= 1) { \
+    if (lid < s) { \
+      float a = scratch[lid]; \
+      float b = scratch[lid + s]; \
+      scratch[lid] = combine; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  \
+  if (lid == 0) { \
+    float a = scratch[0]; \
+    out[get_group_id(0)] = finish; \
+  } \
+}
+
+SINGLE_REDUCE(sum,      0.0f,      x[id],         a + b,      a)
+SINGLE_REDUCE(max,      -INFINITY, x[id],         fmax(a, b), a)
+SINGLE_REDUCE(min,      INFINITY,  x[id],         fmin(a, b), a)
+SINGLE_REDUCE(sumsq,    0.0f,      x[id] * x[id], a + b,      a)
+
+/* Final pass of norm: sum of the partial sums of squares, then sqrt. Only
+ * correct when run as a single work-group.
+ */
+SINGLE_REDUCE(sum_sqrt, 0.0f,      x[id],         a + b,      sqrt(a))
+
+__kernel void single_reduce_dot(__global float *out, __global const float *x, __global const float *y, __local float *scratch, int N) {
+  float acc = 0.0f;
+  for (int id = get_global_id(0); id < N; id += get_global_size(0)) {
+    acc += x[id] * y[id];
+  }
+
+  int lid = get_local_id(0);
+  scratch[lid] = acc;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int s = get_local_size(0)/2; s > 0; s >>= 1) {
+    if (lid < s) scratch[lid] += scratch[lid + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0) out[get_group_id(0)] = scratch[0];
+}
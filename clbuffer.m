@@ -19,6 +19,9 @@
 %   bufA.set(values)
 %
 % It is important to note that the get/set operations are blocking.
+% Non-blocking variants return a clevent that is waited on later:
+%   ev = bufA.get_async();
+%   values = ev.wait();
 %
 % Finally, to free a buffer:
 %   clear bufA;
@@ -26,6 +29,8 @@
 % See also: clbuffer/clbuffer
 %           clbuffer/get
 %           clbuffer/set
+%           clbuffer/get_async
+%           clbuffer/set_async
 %           clbuffer/delete
 %
 % Author: Radford Ray Juang
@@ -71,6 +76,11 @@ classdef clbuffer < handle
         %   mode :  can be 'ro' (read-only), 
         %                  'wo' (write-only),
         %                  'rw' (read-write)
+        %           append 'h' (e.g. 'rwh') to place the buffer in 
+        %           host-accessible memory. get/set then map the buffer
+        %           instead of copying it, which avoids the copy entirely
+        %           on CPU and integrated devices (see the device property
+        %           host_unified_memory).
         %   type :  can be 'int64', 'uint64', 'double', 
         %                  'int32', 'uint32', 'single',
         %                  'int16', 'uint16', 
@@ -131,10 +141,13 @@ classdef clbuffer < handle
         % memory. This call is blocking and returns with the values of the
         % buffer in the device.
         %
+            persistent cmd;
+            if isempty(cmd), cmd = opencl.command('get_buffer'); end
+
             data = [];
 
             if self.id >= 0, 
-                data = openclcmd('get_buffer', self.device-1, self.id, self.num_elems, self.type);            
+                data = openclcmd(cmd, self.device-1, self.id, self.num_elems, self.type);            
             end
         end
         
@@ -149,14 +162,52 @@ classdef clbuffer < handle
         % it will be converted to whichever type was specified when the buffer
         % was created)
         %
+            persistent cmd;
+            if isempty(cmd), cmd = opencl.command('set_buffer'); end
+
             if self.id < 0,
                 return;
             end
 
             data = feval(self.type, data);
-            openclcmd('set_buffer', self.device-1, self.id, data);
+            openclcmd(cmd, self.device-1, self.id, data);
         end
         
+        function ev = get_async(self, dims)
+        % ev = obj.get_async()
+        % ev = obj.get_async(dims)
+        %
+        % Starts copying the buffer from device memory to host memory and
+        % returns immediately with a clevent. The values are returned by 
+        % ev.wait(), reshaped to dims if given.
+        %
+            if nargin < 2,
+                dims = [];
+            end
+
+            id = -1;
+            if self.id >= 0,
+                id = openclcmd('get_buffer_async', self.device-1, self.id, self.num_elems, self.type);
+            end
+            ev = clevent(id, dims);
+        end
+
+        function ev = set_async(self, data)
+        % ev = obj.set_async(data)
+        %
+        % Starts copying data from host memory to device memory and returns
+        % immediately with a clevent. data is copied before returning, so it 
+        % can be reused right away. Kernels enqueued afterwards on the same
+        % device see the new values.
+        %
+            id = -1;
+            if self.id >= 0,
+                data = feval(self.type, data);
+                id = openclcmd('set_buffer_async', self.device-1, self.id, data);
+            end
+            ev = clevent(id);
+        end
+
         function delete(self)
         % delete(obj)
         % 
@@ -0,0 +1,248 @@
+% cldist is an array split between several devices of the OpenCL context.
+% Each device holds a contiguous slice of the elements (in MATLAB column
+% order) as a clobject. The elementwise operators run on every slice, each
+% on its own device queue, so all devices work at the same time. get()
+% gathers the slices back into one array.
+%
+% For example, with two GPUs and a CPU device:
+%   ocl = opencl();
+%   ocl.initialize(1, [1 2 3]);
+%   ocl.addfile('cl/matlab_kernels_float.cl');
+%   ocl.build();
+%
+%   a = cldist(single(rand(4000)));   % Split between devices 1, 2 and 3
+%   b = cldist(single(rand(4000)));
+%   c = exp(a.*b + 1);                % Runs on all three devices
+%   z = c.get();
+%
+% Unless weights are given, each device gets a share proportional to its
+% compute units times its clock frequency. Both operands of a binary
+% operator must be split the same way. This holds for cldist objects of
+% the same size created with the same devices and weights, and for the
+% results of operators on them.
+%
+% See cldist/cldist
+%     cldist/get
+%     cldist/sum
+%     cldist/map
+
+% Copyright (C) 2011 by Radford Ray Juang
+%
+% Permission is hereby granted, free of charge, to any person obtaining a copy
+% of this software and associated documentation files (the "Software"), to deal
+% in the Software without restriction, including without limitation the rights
+% to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+% copies of the Software, and to permit persons to whom the Software is
+% furnished to do so, subject to the following conditions:
+%
+% The above copyright notice and this permission notice shall be included in
+% all copies or substantial portions of the Software.
+%
+% THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+% IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+% FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+% AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+% LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+% OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+% THE SOFTWARE.
+classdef (InferiorClasses = {?clobject, ?clfloat, ?clexpr}) cldist < handle
+    properties (GetAccess = public, SetAccess = protected)
+        parts = {};       % clobject (or clexpr) holding each slice
+        devices = [];     % Device of each slice
+        counts = [];      % Number of elements in each slice
+        dims = [];        % Dimension of the whole array
+        datatype = [];
+    end
+
+    methods
+        function this = cldist(data, devices, weights)
+        % obj = cldist(data)
+        % obj = cldist(data, devices)
+        % obj = cldist(data, devices, weights)
+        %
+        % Split data between devices and copy each slice to its device.
+        % devices are indices as for clobject and default to all devices
+        % passed to opencl.initialize. weights sets the relative share of
+        % each device. Devices whose share rounds to zero elements are
+        % left out.
+        %
+            if nargin < 1,
+                % Empty object, see cldist.map
+                return;
+            end
+
+            info = openclcmd('context_devices');
+            if nargin < 2 || isempty(devices),
+                devices = 1:numel(info);
+            end
+
+            if nargin < 3 || isempty(weights),
+                weights = [info(devices).compute_units] .* [info(devices).clock_frequency];
+            end
+
+            if numel(weights) ~= numel(devices),
+                error('cldist: one weight per device is required');
+            end
+
+            counts = cldist.partition(numel(data), weights);
+            used = counts > 0;
+
+            this.dims = size(data);
+            this.datatype = class(data);
+            this.devices = devices(used);
+            this.counts = counts(used);
+            this.parts = cell(1, numel(this.devices));
+
+            first = 0;
+            for k=1:numel(this.parts),
+                this.parts{k} = clobject(data(first+1:first+this.counts(k)), this.devices(k));
+                first = first + this.counts(k);
+            end
+        end
+
+        function result = plus(obj1, obj2)
+            result = cldist.map(@plus, obj1, obj2);
+        end
+
+        function result = minus(obj1, obj2)
+            result = cldist.map(@minus, obj1, obj2);
+        end
+
+        function result = times(obj1, obj2)
+            result = cldist.map(@times, obj1, obj2);
+        end
+
+        function result = rdivide(obj1, obj2)
+            result = cldist.map(@rdivide, obj1, obj2);
+        end
+
+        function result = exp(obj1)
+            result = cldist.map(@exp, obj1);
+        end
+
+        function data = get(this)
+        % data = obj.get()
+        %
+        % Copy all slices to host memory and return them as one array. The
+        % copies from the different devices run at the same time.
+        %
+            events = cell(size(this.parts));
+            for k=1:numel(this.parts),
+                events{k} = this.parts{k}.get_async();
+            end
+
+            data = zeros(this.dims, this.datatype);
+            first = 0;
+            for k=1:numel(events),
+                data(first+1:first+this.counts(k)) = events{k}.wait();
+                first = first + this.counts(k);
+            end
+        end
+
+        function result = sum(this)
+        % s = sum(obj)
+        %
+        % Sum of all elements. Each device reduces its own slice, then the
+        % partial results are combined on the host. Requires
+        % cl/matlab_reduce_float.cl.
+        %
+            result = sum(this.reduce(@sum));
+        end
+
+        function result = max(this)
+        % m = max(obj)
+        %
+        % Largest element. See cldist/sum.
+        %
+            result = max(this.reduce(@max));
+        end
+
+        function result = min(this)
+        % m = min(obj)
+        %
+        % Smallest element. See cldist/sum.
+        %
+            result = min(this.reduce(@min));
+        end
+    end
+
+    methods (Static)
+        function result = map(op, varargin)
+        % result = cldist.map(op, arg1, ...)
+        %
+        % Applies op to matching slices of the cldist arguments and returns
+        % the results as a cldist split the same way. Other arguments, such
+        % as scalars, are passed unchanged to every call. op is queued on
+        % every device before any result is waited on.
+        %
+            ref = [];
+            for i=1:numel(varargin),
+                arg = varargin{i};
+                if isa(arg, 'cldist'),
+                    if isempty(ref),
+                        ref = arg;
+                    elseif ~isequal(ref.devices, arg.devices) || ~isequal(ref.counts, arg.counts),
+                        error('cldist: operands must be split between the same devices in the same way');
+                    end
+                elseif isa(arg, 'clobject') || isa(arg, 'clexpr'),
+                    error('cldist: operands must be cldist objects or scalars');
+                end
+            end
+
+            result = cldist();
+            result.dims = ref.dims;
+            result.datatype = ref.datatype;
+            result.devices = ref.devices;
+            result.counts = ref.counts;
+            result.parts = cell(size(ref.parts));
+
+            args = varargin;
+            for k=1:numel(ref.parts),
+                for i=1:numel(varargin),
+                    if isa(varargin{i}, 'cldist'),
+                        args{i} = varargin{i}.parts{k};
+                    end
+                end
+                result.parts{k} = op(args{:});
+            end
+        end
+
+        function counts = partition(n, weights)
+        % counts = cldist.partition(n, weights)
+        %
+        % Number of elements of each slice when n elements are split in
+        % proportion to weights. Slice boundaries are multiples of 8
+        % elements, so every slice but the last fits the float8 kernels
+        % without a scalar tail.
+        %
+            align = 8;
+            edges = round(cumsum(weights(:)') / sum(weights) * n / align) * align;
+            edges = min(edges, n);
+            edges(end) = n;
+            counts = diff([0, edges]);
+        end
+    end
+
+    methods (Access = protected)
+        function partial = reduce(this, op)
+        % partial = obj.reduce(op)
+        %
+        % op(slice, 'device') for every slice, collected on the host once
+        % all devices have been started.
+        %
+            results = cell(size(this.parts));
+            for k=1:numel(this.parts),
+                part = this.parts{k};
+                if isa(part, 'clexpr'),
+                    part = part.eval();
+                end
+                results{k} = op(part, 'device');
+            end
+
+            partial = zeros(1, numel(results), 'single');
+            for k=1:numel(results),
+                partial(k) = results{k}.get();
+            end
+        end
+    end
+end
@@ -0,0 +1,92 @@
+% clevent is a handle to a pending non-blocking transfer started by 
+% clbuffer/set_async, clbuffer/get_async or clobject/get_async.
+%
+% The transfer runs in the background while MATLAB continues. To wait for
+% it to complete:
+%   ev = bufA.get_async();
+%   % ... other work ...
+%   values = ev.wait();
+%
+% wait() only waits on this transfer, not on the whole device queue. For an
+% upload, wait() returns true. For a download, it returns the data.
+%
+% See also: clevent/wait
+%           clbuffer/set_async
+%           clbuffer/get_async
+
+%
+% Copyright (C) 2011 by Radford Ray Juang
+% 
+% Permission is hereby granted, free of charge, to any person obtaining a copy
+% of this software and associated documentation files (the "Software"), to deal
+% in the Software without restriction, including without limitation the rights
+% to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+% copies of the Software, and to permit persons to whom the Software is
+% furnished to do so, subject to the following conditions:
+% 
+% The above copyright notice and this permission notice shall be included in
+% all copies or substantial portions of the Software.
+% 
+% THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+% IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+% FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+% AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+% LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+% OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+% THE SOFTWARE.
+%
+classdef clevent < handle
+    properties(GetAccess = public, SetAccess = protected)
+        id = -1;
+        dims = [];
+    end
+
+    methods
+        function self = clevent(id, dims)
+        %  clevent(id)
+        %  clevent(id, dims)
+        %
+        %  Wrap the event id returned by openclcmd('set_buffer_async', ...)
+        %  or openclcmd('get_buffer_async', ...). If dims is given, the data
+        %  returned by wait() is reshaped to dims.
+        %
+            if nargin < 2,
+                dims = [];
+            end
+
+            self.id = id;
+            self.dims = dims;
+        end
+
+        function data = wait(self)
+        % data = obj.wait()
+        %
+        % Blocks until the transfer is complete. Returns the downloaded data
+        % for get_async transfers, true for set_async transfers. An event can
+        % only be waited on once; further calls return [].
+        %
+            data = [];
+            if self.id < 0,
+                return;
+            end
+
+            data = openclcmd('wait_event', self.id);
+            self.id = -1;
+
+            if ~isempty(self.dims),
+                data = reshape(data, self.dims);
+            end
+        end
+
+        function delete(self)
+        % delete(obj)
+        %
+        % Waits for the transfer if it is still pending and frees the event.
+        %
+            if self.id >= 0,
+                openclcmd('wait_event', self.id);
+                self.id = -1;
+            end
+        end
+    end
+end
@@ -0,0 +1,284 @@
+% clexpr is an unevaluated elementwise expression of clobjects. Instead of
+% launching one kernel per operator and storing every intermediate result in
+% device memory, the operators build an expression tree. When the result is
+% needed, the tree is turned into a single OpenCL kernel that reads each
+% input once and writes the output once.
+%
+% For example:
+%   a = clobject(single(rand(1000)));
+%   b = clobject(single(rand(1000)));
+%   c = clobject(single(rand(1000)));
+%
+%   e = exp(clexpr(a).*b + c);   % No kernel is run yet
+%   z = e.get();                 % One fused kernel computes z
+%
+% Alternatively, clobject.lazy(true) makes the clobject operators return
+% clexpr objects directly.
+%
+% The fused kernel is built the first time an expression of that shape is
+% evaluated and reused afterwards; scalars are passed as kernel arguments,
+% so exp(x + 1) and exp(x + 2) share a kernel. Only 'single' data is
+% supported.
+%
+% See clexpr/clexpr
+%     clexpr/eval
+%     clexpr/get
+%     clobject/lazy
+
+% Copyright (C) 2011 by Radford Ray Juang
+%
+% Permission is hereby granted, free of charge, to any person obtaining a copy
+% of this software and associated documentation files (the "Software"), to deal
+% in the Software without restriction, including without limitation the rights
+% to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+% copies of the Software, and to permit persons to whom the Software is
+% furnished to do so, subject to the following conditions:
+%
+% The above copyright notice and this permission notice shall be included in
+% all copies or substantial portions of the Software.
+%
+% THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+% IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+% FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+% AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+% LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+% OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+% THE SOFTWARE.
+classdef (InferiorClasses = {?clobject, ?clfloat}) clexpr < handle
+    properties (GetAccess = public, SetAccess = protected)
+        op = '';          % Operator of this node ('' for a leaf)
+        args = {};        % Operands: clexpr, clobject or numeric scalars
+        dims = [];        % Dimension of the result
+        device_id = [];   % Device the expression is evaluated on
+        datatype = 'single';
+        value = [];       % clobject holding the result once evaluated
+    end
+
+    methods
+        function this = clexpr(obj)
+        % e = clexpr(obj)
+        %
+        % Wrap the clobject obj so that operators on it are deferred.
+        %
+            if nargin < 1,
+                % Empty node, see clexpr.node
+                return;
+            end
+
+            if ~isa(obj, 'clobject'),
+                error('clexpr: argument must be a clobject');
+            end
+
+            if ~strcmp(obj.datatype, 'single'),
+                error('clexpr: only single data is supported');
+            end
+
+            this.dims = obj.dims;
+            this.device_id = obj.device_id;
+            this.value = obj;
+        end
+
+        function result = plus(obj1, obj2)
+            result = clexpr.node('+', obj1, obj2);
+        end
+
+        function result = minus(obj1, obj2)
+            result = clexpr.node('-', obj1, obj2);
+        end
+
+        function result = times(obj1, obj2)
+            result = clexpr.node('*', obj1, obj2);
+        end
+
+        function result = rdivide(obj1, obj2)
+            result = clexpr.node('/', obj1, obj2);
+        end
+
+        function result = exp(obj1)
+            result = clexpr.node('exp', obj1);
+        end
+
+        function result = eval(this)
+        % result = obj.eval()
+        %
+        % Evaluate the expression on the device and return the result as a
+        % clobject. The result is kept, so evaluating again (or using the
+        % expression in a larger one) does not recompute it.
+        %
+            if isempty(this.value),
+                [code, buffers, scalars] = this.emit(this, {}, {});
+
+                % Kernel signature: out, buffers, scalars, N
+                params = '__global float *out';
+                for k=1:numel(buffers),
+                    params = sprintf('%s, __global const float *x%d', params, k-1);
+                end
+                for k=1:numel(scalars),
+                    params = sprintf('%s, float w%d', params, k-1);
+                end
+
+                % Kernels are looked up by name on the device, so each
+                % expression shape gets its own
+                name = clexpr.kernel_name([params, ';', code]);
+                source = sprintf([ ...
+                    '__kernel void %s(%s, int N) {\n', ...
+                    '  for (int id = get_global_id(0); id < N; id += get_global_size(0)) {\n', ...
+                    '    out[id] = %s;\n', ...
+                    '  }\n', ...
+                    '}\n'], name, params, code);
+
+                result = clobject(zeros(this.dims, 'single'), this.device_id);
+                kernel = clexpr.kernel_cache(source, name, this.device_id);
+                kernel(result, buffers{:}, scalars{:}, uint32(prod(this.dims)));
+
+                % Operands are no longer needed
+                this.value = result;
+                this.op = '';
+                this.args = {};
+            end
+
+            result = this.value;
+        end
+
+        function data = get(this)
+        % data = obj.get()
+        %
+        % Evaluate the expression and copy the result to host memory.
+        %
+            data = this.eval().get();
+        end
+
+        function ev = get_async(this)
+        % ev = obj.get_async()
+        %
+        % Evaluate the expression and start copying the result to host
+        % memory without waiting. The data is returned by ev.wait().
+        %
+            ev = this.eval().get_async();
+        end
+    end
+
+    methods (Static)
+        function this = node(op, varargin)
+        % e = clexpr.node(op, arg1, ...)
+        %
+        % Deferred op applied to the arguments, which may be clexpr, clobject
+        % or numeric scalars. Used by the clexpr and clobject operators.
+        %
+            this = clexpr();
+            this.op = op;
+            this.args = varargin;
+
+            for k=1:numel(varargin),
+                arg = varargin{k};
+                if isa(arg, 'clexpr') || isa(arg, 'clobject'),
+                    if ~strcmp(arg.datatype, 'single'),
+                        error('clexpr: only single data is supported');
+                    end
+
+                    if isempty(this.dims),
+                        this.dims = arg.dims;
+                        this.device_id = arg.device_id;
+                    elseif ~isequal(this.dims, arg.dims),
+                        error('clexpr: matrix dimensions must agree');
+                    elseif this.device_id ~= arg.device_id,
+                        error('clexpr: operands must be on the same device');
+                    end
+                elseif ~isnumeric(arg) || ~isscalar(arg),
+                    error('clexpr: operands must be clobject, clexpr or scalars');
+                end
+            end
+        end
+
+        function name = kernel_name(text)
+        % name = clexpr.kernel_name(text)
+        %
+        % Kernel name 'clexpr_<hash>' for the normalized expression text
+        % (parameter list and body). The hash is 64 bits, made of the djb2
+        % and sdbm string hashes, so distinct shapes do not share a name.
+        %
+            h1 = 5381;
+            h2 = 0;
+            for c = double(text),
+                h1 = mod(h1 * 33 + c, 4294967296);
+                h2 = mod(c + h2 * 65599, 4294967296);
+            end
+            name = sprintf('clexpr_%08x%08x', h1, h2);
+        end
+
+        function kernel = kernel_cache(source, name, deviceid)
+        % kernel = clexpr.kernel_cache(source, name, deviceid)
+        % clexpr.kernel_cache()
+        %
+        % Returns the clkernel name built from the fused kernel source on
+        % deviceid, creating it on first use. Called without arguments,
+        % releases all cached kernels. This is done by opencl.initialize.
+        %
+            persistent cache;
+
+            kernel = [];
+            if nargin < 1,
+                cache = [];
+                return;
+            end
+
+            if isempty(cache),
+                cache = containers.Map();
+            end
+
+            key = sprintf('%d:%s', deviceid, source);
+            if isKey(cache, key),
+                kernel = cache(key);
+            else
+                kernel = clkernel.from_source(source, name, deviceid);
+                cache(key) = kernel;
+            end
+        end
+    end
+
+    methods (Access = protected)
+        function [code, buffers, scalars] = emit(this, arg, buffers, scalars)
+        % [code, buffers, scalars] = obj.emit(arg, buffers, scalars)
+        %
+        % OpenCL C expression for arg. Buffers and scalars referenced by the
+        % expression are appended to buffers and scalars; a buffer used
+        % more than once is passed once.
+        %
+            if isa(arg, 'clexpr') && ~isempty(arg.value),
+                arg = arg.value;
+            end
+
+            if isa(arg, 'clobject'),
+                k = 0;
+                for i=1:numel(buffers),
+                    if buffers{i} == arg,
+                        k = i;
+                        break;
+                    end
+                end
+
+                if k == 0,
+                    buffers{end+1} = arg;
+                    k = numel(buffers);
+                end
+                code = sprintf('x%d[id]', k-1);
+
+            elseif isa(arg, 'clexpr'),
+                operands = cell(1, numel(arg.args));
+                for i=1:numel(arg.args),
+                    [operands{i}, buffers, scalars] = this.emit(arg.args{i}, buffers, scalars);
+                end
+
+                if numel(operands) == 1,
+                    code = sprintf('%s(%s)', arg.op, operands{1});
+                else
+                    code = sprintf('(%s %s %s)', operands{1}, arg.op, operands{2});
+                end
+
+            else
+                scalars{end+1} = single(arg);
+                code = sprintf('w%d', numel(scalars)-1);
+            end
+        end
+    end
+end
@@ -30,6 +30,9 @@
 % See clkernel/clkernel 
 %     clkernel/subsref
 %     clkernel/execute
+%     clkernel/autotune
+%     clkernel/from_source
+%     clkernel/delete
 %
 % Author:Radford Ray Juang
 %
@@ -57,6 +60,7 @@ classdef clkernel < handle
     properties 
         device = 1
         id = [];        
+        vector_width = 1    % Elements handled per work-item and iteration
     end
     
     methods 
@@ -85,7 +89,11 @@ classdef clkernel < handle
         % Or you can just divide the data into 256 blocks:
         %    global_work_size = [256,0,0]
         %
-        % If this is unspecified, the default is to divide into 128 blocks
+        % If this is unspecified (or all zeros), the work size is picked 
+        % when the kernel is executed, from the device's compute units and
+        % work-group limits and the largest buffer passed to the kernel.
+        % The kernel then runs as a 1-D range with at least one work-item
+        % per element of that buffer.
         %
         % local_work_size specifies the number of local work groups to 
         % divide each global compute unit into. Think of this as like threads
@@ -97,7 +105,8 @@ classdef clkernel < handle
         % possible for multiple threads within each global compute unit to
         % execute at a time.
         %
-        % Again, if this is unspecified, the default is 128.
+        % Again, if this is unspecified, the default is 128. It is ignored
+        % when global_work_size is picked automatically.
         %
         % target_device is the index of the device to execute the kernel on.
         % If you initialized one device, you can safely ignore this parameter. 
@@ -127,6 +136,11 @@ classdef clkernel < handle
         % NOTE: kernel execution is non-blocking. So, the function will 
         % return regardless of if kernel execution is completed.
         %
+            if nargin < 1,
+                % Empty kernel, see clkernel.from_source
+                return;
+            end
+
             if nargin < 2,
                 global_dim = [];                
             end
@@ -143,9 +157,10 @@ classdef clkernel < handle
                 target_device = 1;
             end
            
-            % Automatically pick a size (this is a bad idea in general)
+            % Zero global dims: size picked by execute_kernel at launch
             if isempty(global_dim),
-                global_dim = [128, 0,0];
+                global_dim = [0,0,0];
+                local_dim = [0,0,0];
             end
             if isempty(local_dim),
                 local_dim = [128,0,0];
@@ -213,7 +228,116 @@ classdef clkernel < handle
             %
             % Non-constant arguments must be of type clbuffer or clobject
             %
-             for i=1:numel(varargin) 
+            persistent cmd;
+            if isempty(cmd), cmd = opencl.command('submit_batch'); end
+            openclcmd(cmd, self.commands(varargin{:}));
+        end        
+
+        function cmds = commands(self, varargin)
+            % cmds = obj.commands(arg1, arg2, ...)
+            %
+            % Returns the commands that execute runs for these arguments
+            % (setting each argument, then launching the kernel) without
+            % running them. The commands of several kernels can be joined
+            % and run with a single call, which saves the per-call overhead
+            % when launching many small kernels:
+            %
+            %   c = [k1.commands(x, y, z, n), k2.commands(z, w, n)];
+            %   clkernel.submit(c);
+            %
+            % Arguments are captured when the commands are created.
+            %
+            [cmds, nitems] = self.set_args(varargin{:});
+            cmds{end+1} = {'launch', self.device-1, self.id, nitems};
+        end
+
+        function tiles = schedule(self, varargin)
+            % tiles = obj.schedule(arg1, arg2, ...)
+            % tiles = obj.schedule('tile_size', n, arg1, arg2, ...)
+            %
+            % Runs the kernel on all devices of the context at once. The 
+            % work-items are split into tiles of n work-items (default 
+            % 65536) and each device takes the next tile when it finishes 
+            % one, so faster devices do more of the work. Unlike execute, 
+            % this waits for the kernel to finish.
+            %
+            % The kernel must index its data with get_global_id(0) and skip
+            % indices past the end. Grid-stride kernels, which loop over
+            % get_global_size(0) like those in cl/matlab_kernels_float.cl,
+            % are not suitable.
+            %
+            % Returns the number of tiles each device ran.
+            %
+            tile_size = 65536;
+            if numel(varargin) > 1 && ischar(varargin{1}) && strcmp(varargin{1}, 'tile_size'),
+                tile_size = varargin{2};
+                varargin(1:2) = [];
+            end
+
+            persistent cmd;
+            if isempty(cmd), cmd = opencl.command('schedule_kernel'); end
+
+            [cmds, nitems] = self.set_args(varargin{:});
+            clkernel.submit(cmds);
+            tiles = openclcmd(cmd, self.id, nitems, tile_size);
+        end
+
+        function cfg = autotune(self, varargin)
+            % cfg = obj.autotune(arg1, arg2, ...)
+            % cfg = obj.autotune('grid_stride', arg1, arg2, ...)
+            %
+            % Runs the kernel with the provided arguments over a sweep of 
+            % work-group sizes, timing each on the device, and remembers the 
+            % fastest for this kernel, device and problem size (see 
+            % opencl.set_tuning_file). Kernels created without a 
+            % global_work_size use the result from then on.
+            %
+            % The kernel is run several times, so only tune kernels whose
+            % output does not depend on their previous output (e.g. z=x+y,
+            % not x=x+1). Pass 'grid_stride' first if the kernel loops over
+            % its range like the kernels in cl/matlab_kernels_float.cl; 
+            % smaller global sizes are then tried as well.
+            %
+            % Returns [local_size, global_size] of the fastest run. A 
+            % global_size of 0 means enough work-items to cover the data.
+            %
+            grid_stride = false;
+            if ~isempty(varargin) && ischar(varargin{1}) && strcmp(varargin{1}, 'grid_stride'),
+                grid_stride = true;
+                varargin(1) = [];
+            end
+
+            [cmds, nitems] = self.set_args(varargin{:});
+            openclcmd('submit_batch', cmds);
+            cfg = openclcmd('autotune', self.device-1, self.id, nitems, grid_stride);
+        end
+
+        function delete(self)
+            % delete(obj)
+            %
+            % Release the kernel. Kernels with the same name and work sizes
+            % share one device kernel object, which is freed when the last
+            % clkernel referencing it is deleted.
+            %
+            if ~isempty(self.id) && self.id >= 0,
+                openclcmd('destroy_kernel', self.id);
+            end
+            self.id = -1;
+        end
+    end
+
+    methods (Access = protected)
+        function [cmds, nitems] = set_args(self, varargin)
+            % [cmds, nitems] = obj.set_args(arg1, arg2, ...)
+            %
+            % Commands for openclcmd('submit_batch') that set the kernel
+            % arguments. Also returns the number of elements of the largest
+            % buffer argument divided by vector_width, used to size 
+            % automatic launches.
+            %
+            cmds = cell(1, numel(varargin));
+            nitems = 0;
+            for i=1:numel(varargin) 
                 argnum = i-1;
                 argval = varargin{i};
 
@@ -233,12 +357,16 @@ classdef clkernel < handle
                     if bufferid < 0,
                         %Local variable type:                        
                         nbytes = argval.num_bytes;
+                    else
+                        nitems = max(nitems, double(argval.num_elems));
                     end
                 elseif isa(argval, 'clobject'),
                     bufferid = argval.buffer.id;
                     if bufferid < 0,
                         %Local variable type:                        
                         nbytes = argval.num_bytes;
+                    else
+                        nitems = max(nitems, prod(argval.dims));
                     end                    
                 elseif strcmp(S.class, 'double') || ...
                        strcmp(S.class, 'single') || ...
@@ -256,12 +384,44 @@ classdef clkernel < handle
                     error('Invalid type');
                 end 
                 
-                openclcmd('set_kernel_args', kernelid, argnum, bufferid, data, int32(nbytes));
+                cmds{i} = {'arg', kernelid, argnum, bufferid, data, int32(nbytes)};
                 %fprintf(1, 'set_kernel_args: kernelid = %d, argnum = %d, buffer=%d, data=%g, sz=%d\n', ...
                 %    kernelid, argnum, bufferid, data, nbytes);
             end % for i
-            
-            openclcmd('execute_kernel', self.device-1, self.id);
-        end        
+
+            nitems = ceil(nitems / self.vector_width);
+        end
+    end
+
+    methods (Static)
+        function self = from_source(source, kernelname, target_device)
+            % obj = clkernel.from_source(source, kernel_name)
+            % obj = clkernel.from_source(source, kernel_name, target_device)
+            %
+            % Creates a kernel from OpenCL source text instead of the files 
+            % added with opencl.addfile. The source is built into its own 
+            % program the first time it is seen (using the binary cache of
+            % opencl.build). The work size is picked when the kernel is 
+            % executed, as for clkernel(kernel_name).
+            %
+            if nargin < 3 || isempty(target_device),
+                target_device = 1;
+            end
+
+            self = clkernel();
+            self.device = target_device;
+            self.id = openclcmd('compile_kernel', source, kernelname);
+        end
+
+        function submit(cmds)
+            % clkernel.submit(cmds)
+            %
+            % Runs the commands returned by clkernel.commands in one call.
+            % Like execute, this does not wait for the kernels to finish.
+            %
+            persistent cmd;
+            if isempty(cmd), cmd = opencl.command('submit_batch'); end
+            openclcmd(cmd, cmds);
+        end
     end
 end
@@ -10,7 +10,17 @@
 % See clobject/clobject
 %     clobject/set
 %     clobject/get
+%     clobject/get_async
 %     clobject/delete
+%     clobject/lazy
+%     clobject/sum
+%     clobject/max
+%     clobject/min
+%     clobject/dot
+%     clobject/norm
+%     clobject/mtimes
+%     clobject/axpy
+%     clobject/scal
 
 % Copyright (C) 2011 by Radford Ray Juang
 % 
@@ -55,6 +65,11 @@ classdef clobject < handle
         % representation for the data. device is the index of the device where
         % the data is stored. If unspecified, it defaults to 1.
         %
+            if nargin < 1,
+                % Empty object, see clobject.allocate
+                return;
+            end
+
             this.dims = size(data);
             if nargin < 2,
                 deviceid = [];
@@ -86,6 +101,15 @@ classdef clobject < handle
             data = reshape(data, this.dims);
         end
 
+        function ev = get_async(this)
+        % ev = obj.get_async()
+        %
+        % Start copying device memory in obj to host memory without waiting.
+        % The data is returned by ev.wait().
+        %
+            ev = this.buffer.get_async(this.dims);
+        end
+
         function set(this, data)
         % obj.set(data)
         % 
@@ -121,6 +145,11 @@ classdef clobject < handle
         end
 
         function result = plus(obj1, obj2)            
+            if clobject.lazy(),
+                result = clexpr.node('+', obj1, obj2);
+                return;
+            end
+
             kernelname = 'add';            
             if isobject(obj1),
                 N = uint32(prod(obj1.dims));
@@ -129,7 +158,7 @@ classdef clobject < handle
                 datatype = obj1.datatype;
                 result = obj1.allocate_samesize();
             else
-                obj1 = single(obj1);
+                obj1 = clobject.scalar_operand(obj1, obj2.datatype);
                 N = uint32(prod(obj2.dims));
                 prefix = '_scalar_';
                 deviceid = obj2.device_id;
@@ -140,16 +169,21 @@ classdef clobject < handle
             if isobject(obj2),                
                 suffix = '';
             else
-                obj2 = single(obj2);
+                obj2 = clobject.scalar_operand(obj2, datatype);
                 suffix = '_scalar';
             end
             
             kernelname = [datatype, prefix, kernelname, suffix];            
-            kernel = clkernel(kernelname, [], [], deviceid);         
+            kernel = clobject.kernel_cache(kernelname, deviceid, true);
             kernel(result, obj1, obj2, N);
         end
 
         function result = minus(obj1, obj2)            
+            if clobject.lazy(),
+                result = clexpr.node('-', obj1, obj2);
+                return;
+            end
+
             kernelname = 'minus';            
             if isobject(obj1),
                 N = uint32(prod(obj1.dims));
@@ -158,7 +192,7 @@ classdef clobject < handle
                 datatype = obj1.datatype;
                 result = obj1.allocate_samesize();
             else
-                obj1 = single(obj1);
+                obj1 = clobject.scalar_operand(obj1, obj2.datatype);
                 N = uint32(prod(obj2.dims));
                 prefix = '_scalar_';
                 deviceid = obj2.device_id;
@@ -169,16 +203,21 @@ classdef clobject < handle
             if isobject(obj2),                
                 suffix = '';
             else
-                obj2 = single(obj2);
+                obj2 = clobject.scalar_operand(obj2, datatype);
                 suffix = '_scalar';
             end
             
             kernelname = [datatype, prefix, kernelname, suffix];            
-            kernel = clkernel(kernelname, [], [], deviceid);         
+            kernel = clobject.kernel_cache(kernelname, deviceid, true);
             kernel(result, obj1, obj2, N);
         end
 
         function result = times(obj1, obj2)            
+            if clobject.lazy(),
+                result = clexpr.node('*', obj1, obj2);
+                return;
+            end
+
             kernelname = 'times';            
             if isobject(obj1),
                 N = uint32(prod(obj1.dims));
@@ -187,7 +226,7 @@ classdef clobject < handle
                 datatype = obj1.datatype;
                 result = obj1.allocate_samesize();
             else
-                obj1 = single(obj1);
+                obj1 = clobject.scalar_operand(obj1, obj2.datatype);
                 N = uint32(prod(obj2.dims));
                 prefix = '_scalar_';
                 deviceid = obj2.device_id;
@@ -198,16 +237,21 @@ classdef clobject < handle
             if isobject(obj2),                
                 suffix = '';
             else
-                obj2 = single(obj2);
+                obj2 = clobject.scalar_operand(obj2, datatype);
                 suffix = '_scalar';
             end
             
             kernelname = [datatype, prefix, kernelname, suffix];            
-            kernel = clkernel(kernelname, [], [], deviceid);         
+            kernel = clobject.kernel_cache(kernelname, deviceid, true);
             kernel(result, obj1, obj2, N);
         end
         
         function result = rdivide(obj1, obj2)
+            if clobject.lazy(),
+                result = clexpr.node('/', obj1, obj2);
+                return;
+            end
+
             kernelname = 'divide';            
             if isobject(obj1),
                 N = uint32(prod(obj1.dims));
@@ -216,7 +260,7 @@ classdef clobject < handle
                 datatype = obj1.datatype;
                 result = obj1.allocate_samesize();
             else
-                obj1 = single(obj1);
+                obj1 = clobject.scalar_operand(obj1, obj2.datatype);
                 N = uint32(prod(obj2.dims));
                 prefix = '_scalar_';
                 deviceid = obj2.device_id;
@@ -227,16 +271,21 @@ classdef clobject < handle
             if isobject(obj2),                
                 suffix = '';
             else
-                obj2 = single(obj2);
+                obj2 = clobject.scalar_operand(obj2, datatype);
                 suffix = '_scalar';
             end
             
             kernelname = [datatype, prefix, kernelname, suffix];            
-            kernel = clkernel(kernelname, [], [], deviceid);         
+            kernel = clobject.kernel_cache(kernelname, deviceid, true);
             kernel(result, obj1, obj2, N);
         end
         
         function result = exp(obj1)
+            if clobject.lazy(),
+                result = clexpr.node('exp', obj1);
+                return;
+            end
+
             kernelname = 'exponential';            
 
             N = uint32(prod(obj1.dims));
@@ -246,8 +295,341 @@ classdef clobject < handle
             result = obj1.allocate_samesize();    
  
             kernelname = [datatype, prefix, kernelname];
-            kernel = clkernel(kernelname, [], [], deviceid);
+            kernel = clobject.kernel_cache(kernelname, deviceid, true);
             kernel(result, obj1, N);
         end
+
+        function result = sum(this, where)
+        % s = sum(obj)
+        % s = sum(obj, 'device')
+        %
+        % Sum of all elements of obj, computed on the device. Returns a 
+        % scalar, or with 'device' a 1x1 clobject that stays in device 
+        % memory. Requires cl/matlab_reduce_float.cl.
+        %
+            if nargin < 2, where = ''; end
+            result = this.reduce('sum', 'sum', {this}, where);
+        end
+
+        function result = max(this, where)
+        % m = max(obj)
+        % m = max(obj, 'device')
+        %
+        % Largest element of obj. See clobject/sum.
+        %
+            if nargin < 2, where = ''; end
+            result = this.reduce('max', 'max', {this}, where);
+        end
+
+        function result = min(this, where)
+        % m = min(obj)
+        % m = min(obj, 'device')
+        %
+        % Smallest element of obj. See clobject/sum.
+        %
+            if nargin < 2, where = ''; end
+            result = this.reduce('min', 'min', {this}, where);
+        end
+
+        function result = dot(this, obj2, where)
+        % d = dot(obj1, obj2)
+        % d = dot(obj1, obj2, 'device')
+        %
+        % Dot product of obj1(:) and obj2(:), which must have the same 
+        % number of elements. See clobject/sum.
+        %
+            if nargin < 3, where = ''; end
+            if ~isa(obj2, 'clobject') || prod(obj2.dims) ~= prod(this.dims),
+                error('dot: arguments must be clobjects with the same number of elements');
+            end
+            result = this.reduce('dot', 'sum', {this, obj2}, where);
+        end
+
+        function result = norm(this, where)
+        % n = norm(obj)
+        % n = norm(obj, 'device')
+        %
+        % 2-norm of obj(:). See clobject/sum.
+        %
+            if nargin < 2, where = ''; end
+            result = this.reduce('sumsq', 'sum_sqrt', {this}, where);
+        end
+
+        function result = mtimes(obj1, obj2)
+        % C = A * B
+        %
+        % Matrix product of 2-D single clobjects, computed on the device with
+        % the tiled SGEMM kernel (SGEMV if B is a column vector). If A or B is
+        % a scalar, this is the same as A .* B.
+        %
+            if ~isobject(obj1) || ~isobject(obj2),
+                result = times(obj1, obj2);
+                return;
+            end
+
+            if numel(obj1.dims) > 2 || numel(obj2.dims) > 2,
+                error('mtimes: arguments must be 2-D');
+            end
+
+            if ~strcmp(obj1.datatype, 'single') || ~strcmp(obj2.datatype, 'single'),
+                error('mtimes: only single data is supported');
+            end
+
+            if obj1.dims(2) ~= obj2.dims(1),
+                error('mtimes: inner matrix dimensions must agree');
+            end
+
+            if obj1.device_id ~= obj2.device_id,
+                error('mtimes: arguments must be on the same device');
+            end
+
+            M = obj1.dims(1);
+            K = obj1.dims(2);
+            N = obj2.dims(2);
+            deviceid = obj1.device_id;
+            result = clobject.allocate([M, N], 'single', deviceid);
+
+            if N == 1,
+                openclcmd('blas_gemv', deviceid-1, obj1.buffer.id, obj2.buffer.id, ...
+                    result.buffer.id, M, K);
+            else
+                openclcmd('blas_gemm', deviceid-1, obj1.buffer.id, obj2.buffer.id, ...
+                    result.buffer.id, M, N, K);
+            end
+        end
+
+        function axpy(this, alpha, x)
+        % y.axpy(alpha, x)
+        %
+        % y = alpha*x + y in place, where x is a single clobject with the 
+        % same number of elements as y.
+        %
+            if ~isa(x, 'clobject') || prod(x.dims) ~= prod(this.dims),
+                error('axpy: x must be a clobject with the same number of elements');
+            end
+            openclcmd('blas_axpy', this.device_id-1, prod(this.dims), double(alpha), ...
+                x.buffer.id, this.buffer.id);
+        end
+
+        function scal(this, alpha)
+        % x.scal(alpha)
+        %
+        % x = alpha*x in place.
+        %
+            openclcmd('blas_scal', this.device_id-1, prod(this.dims), double(alpha), ...
+                this.buffer.id);
+        end
+    end
+
+    methods (Access = protected)
+        function result = reduce(this, first_pass, second_pass, inputs, where)
+        % result = obj.reduce(first_pass, second_pass, inputs, where)
+        %
+        % Runs single_reduce_<first_pass> over inputs with up to num_groups
+        % work-groups, each writing one partial result, then reduces the 
+        % partials with one work-group of single_reduce_<second_pass>.
+        %
+            local_size = 128;   % Power of two, within every device's limit
+            num_groups = 64;    % Partial results of the first pass
+
+            if ~strcmp(this.datatype, 'single'),
+                error('Reductions are only supported for single data');
+            end
+
+            N = prod(this.dims);
+            num_groups = max(1, min(num_groups, ceil(N / local_size)));
+
+            scratch = clbuffer('rw', 'local', 4*local_size, this.device_id);
+            result = clobject(zeros(1, 1, 'single'), this.device_id);
+
+            kernel = clobject.kernel_cache(['single_reduce_', first_pass], this.device_id, ...
+                false, [num_groups*local_size, local_size]);
+
+            if num_groups == 1 && strcmp(first_pass, second_pass),
+                kernel(result, inputs{:}, scratch, uint32(N));
+            else
+                partial = clbuffer('rw', 'single', num_groups, this.device_id);
+                kernel(partial, inputs{:}, scratch, uint32(N));
+
+                kernel = clobject.kernel_cache(['single_reduce_', second_pass], this.device_id, ...
+                    false, [local_size, local_size]);
+                kernel(result, partial, scratch, uint32(num_groups));
+            end
+
+            if ~strcmp(where, 'device'),
+                result = result.get();
+            end
+        end
+    end
+
+    methods (Static)
+        function obj = allocate(dims, datatype, deviceid)
+        % obj = clobject.allocate(dims, datatype, deviceid)
+        %
+        % clobject of size dims whose device memory is not initialized. Used
+        % for results that are completely overwritten by a kernel.
+        %
+            obj = clobject();
+            obj.dims = dims;
+            obj.datatype = datatype;
+            obj.device_id = deviceid;
+            obj.buffer = clbuffer('rw', datatype, prod(dims), deviceid);
+        end
+
+        function enabled = lazy(enable)
+        % enabled = clobject.lazy()
+        % clobject.lazy(enable)
+        %
+        % If enabled, the arithmetic operators of clobject do not run a 
+        % kernel but return a clexpr. Chains of operators are then fused
+        % into one kernel when the result is needed (clexpr/get or 
+        % clexpr/eval). Disabled by default.
+        %
+            persistent state;
+
+            if isempty(state),
+                state = false;
+            end
+
+            if nargin > 0,
+                state = logical(enable);
+            end
+            enabled = state;
+        end
+
+        function value = scalar_operand(value, datatype)
+        % value = clobject.scalar_operand(value, datatype)
+        %
+        % Scalar operand of a datatype elementwise kernel. Integer results
+        % with a scalar are computed in the scalar's precision and rounded,
+        % as in MATLAB: 8 and 16 bit kernels take it as single and 32 bit
+        % ones as double. double cannot hold every 64 bit integer, so
+        % int64 and uint64 kernels take it in their own type, and the scalar
+        % must be an integer in the range of that type.
+        %
+            switch datatype,
+                case {'int8', 'uint8', 'int16', 'uint16'},
+                    value = single(value);
+                case {'int32', 'uint32'},
+                    value = double(value);
+                case {'int64', 'uint64'},
+                    if ~isinteger(value) && (value ~= round(value) || ...
+                       value < double(intmin(datatype)) || value >= 2^(63 + strcmp(datatype, 'uint64'))),
+                        error('clobject: %s operators only take integer scalars within range', datatype);
+                    end
+                    value = cast(value, datatype);
+                otherwise,
+                    value = cast(value, datatype);
+            end
+        end
+
+        function kernel = kernel_cache(kernelname, deviceid, vectorize, work_size)
+        % kernel = clobject.kernel_cache(kernelname, deviceid)
+        % kernel = clobject.kernel_cache(kernelname, deviceid, vectorize)
+        % kernel = clobject.kernel_cache(kernelname, deviceid, false, [global, local])
+        % clobject.kernel_cache()
+        %
+        % Returns the clkernel used by the elementwise operators for 
+        % kernelname on deviceid, creating it on first use. Keeping the 
+        % kernel alive avoids creating and releasing a device kernel on every
+        % operator call.
+        %
+        % If vectorize is true, the float4 or float8 variant of the kernel
+        % (kernelname_v4, kernelname_v8 in cl/matlab_kernels_float.cl) is
+        % used when the device prefers vectors of that width.
+        %
+        % double_* kernels (cl/matlab_kernels_double.cl or 
+        % opencl.add_elementwise) are only built for devices with double
+        % precision support, as are the int32 and uint32 scalar kernels,
+        % which compute in double. Asking for one on another device is an
+        % error.
+        %
+        % work_size fixes the global and local work size of a 1-D launch
+        % instead of picking it when the kernel is executed.
+        %
+        % Called without arguments, releases all cached kernels. This is 
+        % done by opencl.initialize and opencl.build.
+        %
+            persistent cache;
+            persistent widths;
+            persistent fp64;
+
+            kernel = [];
+            if nargin < 1,
+                cache = [];
+                widths = [];
+                fp64 = [];
+                return;
+            end
+
+            if nargin < 3,
+                vectorize = false;
+            end
+
+            if nargin < 4,
+                work_size = [];
+            end
+
+            if isempty(cache),
+                cache = containers.Map();
+            end
+
+            type = strtok(kernelname, '_');
+            if strcmp(type, 'double') || (any(strcmp(type, {'int32', 'uint32'})) && ...
+                                          ~isempty(strfind(kernelname, '_scalar'))),
+                if isempty(fp64),
+                    info = openclcmd('context_devices');
+                    fp64 = false(1, numel(info));
+                    for k=1:numel(info),
+                        ext = [' ', info(k).extensions, ' '];
+                        fp64(k) = ~isempty(strfind(ext, ' cl_khr_fp64 ')) || ...
+                                  ~isempty(strfind(ext, ' cl_amd_fp64 '));
+                    end
+                end
+
+                if ~fp64(deviceid),
+                    error('clobject: device %d does not support double precision (cl_khr_fp64)', deviceid);
+                end
+            end
+
+            width = 1;
+            if vectorize,
+                if isempty(widths),
+                    widths = containers.Map();
+                end
+
+                width_key = sprintf('%s:%d', type, deviceid);
+                if ~isKey(widths, width_key),
+                    widths(width_key) = openclcmd('vector_width', deviceid-1, type);
+                end
+
+                if widths(width_key) >= 8,
+                    width = 8;
+                elseif widths(width_key) >= 4,
+                    width = 4;
+                end
+            end
+
+            if width > 1,
+                kernelname = sprintf('%s_v%d', kernelname, width);
+            end
+
+            key = sprintf('%s:%d', kernelname, deviceid);
+            global_dim = [];
+            local_dim = [];
+            if ~isempty(work_size),
+                key = sprintf('%s:%d,%d', key, work_size(1), work_size(2));
+                global_dim = [work_size(1), 0, 0];
+                local_dim = [work_size(2), 0, 0];
+            end
+
+            if isKey(cache, key),
+                kernel = cache(key);
+            else
+                kernel = clkernel(kernelname, global_dim, local_dim, deviceid);
+                kernel.vector_width = width;
+                cache(key) = kernel;
+            end
+        end
     end
 end
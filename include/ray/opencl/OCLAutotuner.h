@@ -0,0 +1,240 @@
+#ifndef _RAY_OPENCL_OCLAUTOTUNER_H_
+#define _RAY_OPENCL_OCLAUTOTUNER_H_
+
+/*
+ * OpenCL work-group autotuner
+ *
+ * Times a kernel over a sweep of launch geometries on a profiling queue
+ * and remembers the fastest one per (kernel name, device, problem-size
+ * bucket). Buckets are powers of two of the number of work-items, so a
+ * result carries over to problems of similar size.
+ *
+ * Tuning runs the kernel several times with its current arguments, so it
+ * must only be used on kernels that can be re-run safely (e.g. out = x+y,
+ * not x = x+1).
+ *
+ * Results can be saved to and loaded from a tab separated text file:
+ *   kernel <TAB> device <TAB> bucket <TAB> local size <TAB> global size
+ * A global size of 0 means "enough work-groups to cover the problem".
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+namespace ray { namespace opencl {
+
+typedef struct _OCLAutotuneEntry {
+	size_t		local_size;
+	size_t		global_size;		//0 to cover the problem size
+} OCLAutotuneEntry;
+
+class OCLAutotuner {
+public:
+	cl_context									m_context;
+	std::string									m_path;			//Table file, empty if not persisted
+	std::map<std::string, OCLAutotuneEntry>		m_table;
+	std::map<cl_device_id, std::string>			m_device_names;
+	cl_uint										m_repeats;		//Timed runs per configuration
+
+public:
+	OCLAutotuner(cl_context context) : m_context(context), m_repeats(3) { }
+	OCLAutotuner(OCLContext &context) : m_context(context.id()), m_repeats(3) { }
+	OCLAutotuner(OCLContext *context) : m_context(context->id()), m_repeats(3) { }
+
+	//Use path to persist results and load the entries it already holds
+	inline void set_file(const char *path) {
+		m_path = path ? path : "";
+		if (!m_path.empty()) load();
+	}
+
+	inline void load() {
+		std::ifstream file(m_path.c_str());
+		if (!file.is_open()) return;
+
+		std::string line;
+		while (std::getline(file, line)) {
+			std::vector<std::string> f;
+			size_t start = 0, end = 0;
+			while ((end = line.find('\t', start)) != std::string::npos) {
+				f.push_back(line.substr(start, end - start));
+				start = end + 1;
+			}
+			f.push_back(line.substr(start));
+			if (f.size() < 5) continue;
+
+			OCLAutotuneEntry e;
+			e.local_size = (size_t) strtoul(f[3].c_str(), 0, 10);
+			e.global_size = (size_t) strtoul(f[4].c_str(), 0, 10);
+			if (e.local_size == 0) continue;
+
+			m_table[f[0] + '\t' + f[1] + '\t' + f[2]] = e;
+		}
+	}
+
+	//Best effort, like the program binary cache
+	inline void save() {
+		if (m_path.empty()) return;
+
+		std::string tmp_path = m_path + ".tmp";
+		{
+			std::ofstream file(tmp_path.c_str(), std::ios_base::out | std::ios_base::trunc);
+			if (!file.is_open()) return;
+
+			std::map<std::string, OCLAutotuneEntry>::iterator it;
+			for (it = m_table.begin(); it != m_table.end(); ++it) {
+				file << it->first << '\t' << it->second.local_size << '\t' << it->second.global_size << '\n';
+			}
+			if (!file.good()) return;
+		}
+		std::remove(m_path.c_str());
+		std::rename(tmp_path.c_str(), m_path.c_str());
+	}
+
+	inline void clear() {
+		m_table.clear();
+	}
+
+	//Set the launch geometry of kernel from the table. Returns false if
+	//there is no entry for this kernel, device and problem size.
+	inline bool apply(OCLKernel &kernel, cl_device_id device, size_t num_items) {
+		std::map<std::string, OCLAutotuneEntry>::iterator it = m_table.find(key(kernel, device, num_items));
+		if (it == m_table.end()) return false;
+
+		set_geometry(kernel, it->second, num_items);
+		return true;
+	}
+
+	//Time the kernel over candidate geometries on device and store the
+	//fastest. Work-group sizes are swept in powers of two from the preferred
+	//multiple up to the kernel limit. For kernels that loop over their
+	//range (grid_stride), smaller global sizes are tried as well.
+	inline OCLAutotuneEntry tune(OCLKernel &kernel, cl_device_id device, size_t num_items, bool grid_stride) {
+		OCLKernel_WorkgroupInfo w = kernel.get_workgroup_info(device);
+		cl_uint compute_units = 1;
+		ocl_get_info(device, CL_DEVICE_MAX_COMPUTE_UNITS, compute_units, cl_uint, clGetDeviceInfo);
+
+		std::vector<size_t> locals;
+		if (w.compile_work_group_size[0] > 0) {
+			locals.push_back(w.compile_work_group_size[0]);
+		} else {
+			size_t l = (w.preferred_work_group_size_multiple > 0) ? w.preferred_work_group_size_multiple : 1;
+			for (; l <= w.work_group_size; l *= 2) locals.push_back(l);
+			if (locals.empty()) locals.push_back(1);
+		}
+
+		OCLCommandQueue queue(m_context, device, CL_QUEUE_PROFILING_ENABLE);
+
+		OCLAutotuneEntry best;
+		best.local_size = 0;
+		best.global_size = 0;
+		cl_ulong best_time = 0;
+
+		for (size_t i=0; i<locals.size(); ++i) {
+			std::vector<size_t> globals;
+			globals.push_back(0);
+
+			if (grid_stride) {
+				size_t cover = ((num_items + locals[i] - 1) / locals[i]) * locals[i];
+				for (size_t k=1; k<=32; k*=2) {
+					size_t g = compute_units * locals[i] * k;
+					if (g < cover) globals.push_back(g);
+				}
+			}
+
+			for (size_t j=0; j<globals.size(); ++j) {
+				OCLAutotuneEntry e;
+				e.local_size = locals[i];
+				e.global_size = globals[j];
+
+				cl_ulong t = 0;
+				try {
+					t = measure(queue, kernel, e, num_items);
+				} catch (OCLError &) {
+					//Configuration rejected by the device (e.g. out of resources)
+					continue;
+				}
+
+				if ((best.local_size == 0) || (t < best_time)) {
+					best = e;
+					best_time = t;
+				}
+			}
+		}
+
+		if (best.local_size > 0) {
+			m_table[key(kernel, device, num_items)] = best;
+			set_geometry(kernel, best, num_items);
+		}
+		return best;
+	}
+
+	//Problem-size bucket: floor(log2(num_items))
+	inline static unsigned int bucket(size_t num_items) {
+		unsigned int b = 0;
+		while (num_items > 1) { num_items >>= 1; ++b; }
+		return b;
+	}
+
+protected:
+	inline std::string key(OCLKernel &kernel, cl_device_id device, size_t num_items) {
+		std::ostringstream k;
+		k << kernel.m_function_name << '\t' << device_name(device) << '\t' << bucket(num_items);
+		return k.str();
+	}
+
+	inline std::string device_name(cl_device_id device) {
+		std::map<cl_device_id, std::string>::iterator it = m_device_names.find(device);
+		if (it != m_device_names.end()) return it->second;
+
+		std::string name, driver;
+		ocl_get_info_string(device, CL_DEVICE_NAME,	   name,   std::string, clGetDeviceInfo);
+		ocl_get_info_string(device, CL_DRIVER_VERSION, driver, std::string, clGetDeviceInfo);
+
+		//Keep the table parseable
+		name += " " + driver;
+		for (size_t i=0; i<name.size(); ++i) {
+			if ((name[i] == '\t') || (name[i] == '\n') || (name[i] == '\r')) name[i] = ' ';
+		}
+		m_device_names[device] = name;
+		return name;
+	}
+
+	inline void set_geometry(OCLKernel &kernel, const OCLAutotuneEntry &e, size_t num_items) {
+		size_t global = e.global_size;
+		if (global == 0) global = ((num_items + e.local_size - 1) / e.local_size) * e.local_size;
+		if (global == 0) global = e.local_size;
+
+		kernel.set_ndims(1);
+		kernel.set_local_size(e.local_size, 0, 0);
+		kernel.set_global_size(global, 0, 0);
+	}
+
+	//Best device time (ns) of m_repeats runs, after one warm-up run
+	inline cl_ulong measure(OCLCommandQueue &queue, OCLKernel &kernel, const OCLAutotuneEntry &e, size_t num_items) {
+		set_geometry(kernel, e, num_items);
+
+		queue.enqueue_ndrange_kernel(kernel);
+		queue.finish();
+
+		cl_ulong best = 0;
+		for (cl_uint r=0; r<m_repeats; ++r) {
+			OCLEvent evt;
+			queue.enqueue_ndrange_kernel(kernel, &evt);
+			evt.wait();
+
+			cl_ulong t = evt.get_time_end() - evt.get_time_start();
+			if ((r == 0) || (t < best)) best = t;
+		}
+		return best;
+	}
+};
+
+}}
+#endif
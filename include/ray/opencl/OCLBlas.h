@@ -0,0 +1,296 @@
+#ifndef _RAY_OPENCL_OCLBLAS_H_
+#define _RAY_OPENCL_OCLBLAS_H_
+
+/*
+ * OpenCL single precision BLAS kernels for one device
+ *
+ * Provides SGEMM, SGEMV, SAXPY and SSCAL on column-major (MATLAB order)
+ * matrices held in device buffers. The kernels are built into their own
+ * program when the object is created.
+ *
+ * SGEMM is tiled: each work-group copies a TS x TS tile of A and of B into
+ * local memory and each work-item accumulates WPT elements of a column of
+ * C in registers. TS and WPT are picked from the device's local memory size
+ * and work-group limits; matrices of any size are handled by padding the
+ * edge tiles with zeros.
+ *
+ * Matrices are passed as raw cl_mem, which out-of-order queues do not
+ * track, so on those queues each kernel is enclosed in barriers.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <string>
+#include <sstream>
+
+namespace ray { namespace opencl {
+
+class OCLBlas {
+public:
+	cl_context			m_context;
+	cl_device_id		m_device;
+	OCLProgram		   *m_program;
+	OCLKernel		   *m_gemm;
+	OCLKernel		   *m_gemv;
+	OCLKernel		   *m_axpy;
+	OCLKernel		   *m_scal;
+
+	size_t				m_tile;				//TS: tile width of SGEMM
+	size_t				m_work_per_item;	//WPT: elements of C computed per work-item
+	size_t				m_gemv_local;		//Work-group size of SGEMV
+
+public:
+	OCLBlas(OCLContext &context, cl_device_id device, const char *cache_dir = NULL) :
+		m_context(context.id()), m_device(device)
+	{
+		create(cache_dir);
+	}
+
+	OCLBlas(OCLContext *context, cl_device_id device, const char *cache_dir = NULL) :
+		m_context(context->id()), m_device(device)
+	{
+		create(cache_dir);
+	}
+
+	~OCLBlas() { release_kernels(); }
+
+	//C = alpha*A*B + beta*C, A is M x K, B is K x N and C is M x N
+	inline void gemm(OCLCommandQueue &queue, cl_mem A, cl_mem B, cl_mem C,
+		cl_int M, cl_int N, cl_int K, cl_float alpha = 1.0f, cl_float beta = 0.0f)
+	{
+		if ((M <= 0) || (N <= 0)) return;
+
+		OCLKernel &k = *m_gemm;
+		k[0] = &M;
+		k[1] = &N;
+		k[2] = &K;
+		k[3] = &alpha;
+		k[4] = &A;
+		k[5] = &B;
+		k[6] = &beta;
+		k[7] = &C;
+
+		size_t items = m_tile / m_work_per_item;
+		k.set_ndims(2);
+		k.set_local_size(m_tile, items);
+		k.set_global_size(round_up(M, m_tile), round_up(N, m_tile) / m_work_per_item);
+		enqueue(queue, k);
+	}
+
+	//y = alpha*A*x + beta*y, A is M x N
+	inline void gemv(OCLCommandQueue &queue, cl_mem A, cl_mem x, cl_mem y,
+		cl_int M, cl_int N, cl_float alpha = 1.0f, cl_float beta = 0.0f)
+	{
+		if (M <= 0) return;
+
+		OCLKernel &k = *m_gemv;
+		k[0] = &M;
+		k[1] = &N;
+		k[2] = &alpha;
+		k[3] = &A;
+		k[4] = &x;
+		k[5] = &beta;
+		k[6] = &y;
+		k.set(7, m_gemv_local * sizeof(cl_float));
+
+		k.set_ndims(1);
+		k.set_local_size(m_gemv_local);
+		k.set_global_size(round_up(M, m_gemv_local));
+		enqueue(queue, k);
+	}
+
+	//y = alpha*x + y
+	inline void axpy(OCLCommandQueue &queue, cl_int n, cl_float alpha, cl_mem x, cl_mem y) {
+		if (n <= 0) return;
+
+		OCLKernel &k = *m_axpy;
+		k[0] = &n;
+		k[1] = &alpha;
+		k[2] = &x;
+		k[3] = &y;
+		k.auto_size(m_device, n);
+		enqueue(queue, k);
+	}
+
+	//x = alpha*x
+	inline void scal(OCLCommandQueue &queue, cl_int n, cl_float alpha, cl_mem x) {
+		if (n <= 0) return;
+
+		OCLKernel &k = *m_scal;
+		k[0] = &n;
+		k[1] = &alpha;
+		k[2] = &x;
+		k.auto_size(m_device, n);
+		enqueue(queue, k);
+	}
+
+	inline static const char *source() {
+		return
+		"__kernel void blas_sgemm(const int M, const int N, const int K, const float alpha,\n"
+		"    __global const float *A, __global const float *B, const float beta, __global float *C) {\n"
+		"  const int RTS = TS / WPT;\n"
+		"  const int row = get_local_id(0);\n"
+		"  const int col = get_local_id(1);\n"
+		"  const int global_row = TS*get_group_id(0) + row;\n"
+		"  const int global_col = TS*get_group_id(1) + col;\n"
+		"\n"
+		"  __local float Asub[TS][TS];\n"
+		"  __local float Bsub[TS][TS];\n"
+		"\n"
+		"  float acc[WPT];\n"
+		"  for (int w=0; w<WPT; w++) acc[w] = 0.0f;\n"
+		"\n"
+		"  const int num_tiles = (K + TS - 1) / TS;\n"
+		"  for (int t=0; t<num_tiles; t++) {\n"
+		"    for (int w=0; w<WPT; w++) {\n"
+		"      const int ak = TS*t + col + w*RTS;\n"
+		"      const int bk = TS*t + row;\n"
+		"      const int bn = global_col + w*RTS;\n"
+		"      Asub[col + w*RTS][row] = ((global_row < M) && (ak < K)) ? A[ak*M + global_row] : 0.0f;\n"
+		"      Bsub[col + w*RTS][row] = ((bk < K) && (bn < N)) ? B[bn*K + bk] : 0.0f;\n"
+		"    }\n"
+		"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+		"\n"
+		"    for (int k=0; k<TS; k++) {\n"
+		"      const float a = Asub[k][row];\n"
+		"      for (int w=0; w<WPT; w++) acc[w] += a * Bsub[col + w*RTS][k];\n"
+		"    }\n"
+		"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+		"  }\n"
+		"\n"
+		"  for (int w=0; w<WPT; w++) {\n"
+		"    const int n = global_col + w*RTS;\n"
+		"    if ((global_row < M) && (n < N)) {\n"
+		"      const int idx = n*M + global_row;\n"
+		"      C[idx] = (beta == 0.0f) ? alpha*acc[w] : alpha*acc[w] + beta*C[idx];\n"
+		"    }\n"
+		"  }\n"
+		"}\n"
+		"\n"
+		"__kernel void blas_sgemv(const int M, const int N, const float alpha, __global const float *A,\n"
+		"    __global const float *x, const float beta, __global float *y, __local float *xs) {\n"
+		"  const int row = get_global_id(0);\n"
+		"  const int lid = get_local_id(0);\n"
+		"  const int ls = get_local_size(0);\n"
+		"\n"
+		"  float acc = 0.0f;\n"
+		"  for (int j0=0; j0<N; j0+=ls) {\n"
+		"    if (j0 + lid < N) xs[lid] = x[j0 + lid];\n"
+		"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+		"\n"
+		"    const int jn = min(ls, N - j0);\n"
+		"    if (row < M) {\n"
+		"      for (int j=0; j<jn; j++) acc += A[(j0 + j)*M + row] * xs[j];\n"
+		"    }\n"
+		"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+		"  }\n"
+		"\n"
+		"  if (row < M) y[row] = (beta == 0.0f) ? alpha*acc : alpha*acc + beta*y[row];\n"
+		"}\n"
+		"\n"
+		"__kernel void blas_saxpy(const int n, const float alpha, __global const float *x, __global float *y) {\n"
+		"  for (int i = get_global_id(0); i < n; i += get_global_size(0)) y[i] += alpha * x[i];\n"
+		"}\n"
+		"\n"
+		"__kernel void blas_sscal(const int n, const float alpha, __global float *x) {\n"
+		"  for (int i = get_global_id(0); i < n; i += get_global_size(0)) x[i] *= alpha;\n"
+		"}\n";
+	}
+
+protected:
+	inline static void enqueue(OCLCommandQueue &queue, OCLKernel &k) {
+		if (queue.out_of_order()) queue.enqueue_barrier();
+		queue.enqueue_ndrange_kernel(k);
+		if (queue.out_of_order()) queue.enqueue_barrier();
+	}
+
+	inline static size_t round_up(size_t n, size_t multiple) {
+		return ((n + multiple - 1) / multiple) * multiple;
+	}
+
+	//Largest SGEMM tile whose two local tiles fit in half of the local memory
+	//(leaving room for other work-groups on the same compute unit) and whose
+	//work-group fits the device limits. The tile is reduced further if the
+	//compiled kernel cannot run that many work-items per group.
+	inline void create(const char *cache_dir) {
+		m_program = 0;
+		m_gemm = m_gemv = m_axpy = m_scal = 0;
+
+		static const size_t candidates[][2] = { {64, 8}, {32, 8}, {16, 4}, {8, 2}, {4, 1} };
+		static const size_t num_candidates = sizeof(candidates) / sizeof(candidates[0]);
+
+		OCLDevice d(m_device);
+		size_t max_group = d.m_properties.max_work_group_size;
+		size_t max_x = max_group, max_y = max_group;
+		if (d.m_properties.max_work_item_sizes.size() > 1) {
+			max_x = d.m_properties.max_work_item_sizes[0];
+			max_y = d.m_properties.max_work_item_sizes[1];
+		}
+
+		size_t i = 0;
+		for (; i < num_candidates - 1; ++i) {
+			size_t ts = candidates[i][0], items = ts / candidates[i][1];
+			if ((2 * ts * ts * sizeof(cl_float) <= d.m_properties.local_mem_size / 2) &&
+				(ts * items <= max_group) && (ts <= max_x) && (items <= max_y)) break;
+		}
+
+		for (; i < num_candidates; ++i) {
+			m_tile = candidates[i][0];
+			m_work_per_item = candidates[i][1];
+			build(cache_dir);
+
+			OCLKernel_WorkgroupInfo w = m_gemm->get_workgroup_info(m_device);
+			if ((w.work_group_size >= m_tile * (m_tile / m_work_per_item)) || (i == num_candidates - 1)) break;
+		}
+
+		OCLKernel_WorkgroupInfo w = m_gemv->get_workgroup_info(m_device);
+		m_gemv_local = (w.work_group_size < 128) ? w.work_group_size : 128;
+		if (m_gemv_local < 1) m_gemv_local = 1;
+
+		m_axpy->set_global_offset(0, 0, 0);
+		m_scal->set_global_offset(0, 0, 0);
+		m_gemm->set_global_offset(0, 0, 0);
+		m_gemv->set_global_offset(0, 0, 0);
+	}
+
+	inline void build(const char *cache_dir) {
+		release_kernels();
+
+		std::ostringstream options;
+		options << "-DTS=" << m_tile << " -DWPT=" << m_work_per_item;
+
+		m_program = new OCLProgram(m_context);
+		m_program->set_cache_dir(cache_dir);
+		m_program->add_source(std::string(source()));
+		m_program->build(m_device, options.str().c_str());
+
+		std::string err_msg;
+		for (size_t i=0; i < m_program->m_build_status.size(); ++i) {
+			if (m_program->m_build_status[i].status == CL_BUILD_ERROR) {
+				err_msg += m_program->m_build_status[i].log;
+			}
+		}
+		if (!err_msg.empty()) {
+			release_kernels();
+			throw OCLError(CL_BUILD_ERROR, err_msg.c_str());
+		}
+
+		m_gemm = new OCLKernel(*m_program, "blas_sgemm");
+		m_gemv = new OCLKernel(*m_program, "blas_sgemv");
+		m_axpy = new OCLKernel(*m_program, "blas_saxpy");
+		m_scal = new OCLKernel(*m_program, "blas_sscal");
+	}
+
+	inline void release_kernels() {
+		delete m_gemm;
+		delete m_gemv;
+		delete m_axpy;
+		delete m_scal;
+		delete m_program;
+		m_gemm = m_gemv = m_axpy = m_scal = 0;
+		m_program = 0;
+	}
+};
+
+}}
+#endif
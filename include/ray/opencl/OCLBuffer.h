@@ -6,6 +6,15 @@
  * 
  * A Buffer in OpenCL is responsible for holding kernel code and
  * any data necessary
+ *
+ * For out-of-order command queues, the buffer also remembers the last
+ * command that wrote it and the commands that read it since. A command
+ * reading the buffer waits for the writer; a command writing it waits for
+ * the writer and the readers (see OCLCommandQueue).
+ *
+ * Kernels remember the OCLBuffers set as their arguments (see
+ * OCLKernelArgs). The buffer keeps track of those argument lists and
+ * clears its entries in them when it is destroyed.
  *  
  * Author: Radford Ray Juang 
  * Date:  5.7.2010
@@ -14,6 +23,8 @@
 
 #include <ray/opencl/opencl.h>
 
+#include <vector>
+
 namespace ray { namespace opencl {
 
 class OCLBuffer : public OCLObject<cl_mem> { 
@@ -27,36 +38,42 @@ public:
 	cl_uint				m_map_count;	//Contains the map count
 	cl_uint				m_refcount;			//Contains the reference count
 
+	cl_event			m_last_write;	//Last command writing the buffer (0 if none), retained
+	std::vector<cl_event> m_reads;		//Commands reading it since m_last_write, retained
+
+	std::vector<std::vector<OCLBuffer *> *> m_bound;	//Kernel argument lists holding the buffer
+
 public:
 
 	//Create object and create determine buffer size and flags later
 	OCLBuffer(cl_context context, cl_mem_flags flags = 0) : 
 		m_context(context), m_flags(flags), 
 		m_host_ptr(0), m_size(0), m_map_count(0), m_refcount(0),
-		m_type(CL_MEM_OBJECT_BUFFER)
+		m_type(CL_MEM_OBJECT_BUFFER), m_last_write(0)
 	{ }		
 
 	OCLBuffer(OCLContext &context, cl_mem_flags flags = 0) : 
 		m_context(context.id()), m_flags(flags), 
 		m_host_ptr(0), m_size(0), m_map_count(0), m_refcount(0),
-		m_type(CL_MEM_OBJECT_BUFFER)
+		m_type(CL_MEM_OBJECT_BUFFER), m_last_write(0)
 	{ }		
 
 	OCLBuffer(OCLContext *context, cl_mem_flags flags = 0) : 
 		m_context(context->id()), m_flags(flags), 
 		m_host_ptr(0), m_size(0), m_map_count(0), m_refcount(0),
-		m_type(CL_MEM_OBJECT_BUFFER)
+		m_type(CL_MEM_OBJECT_BUFFER), m_last_write(0)
 	{ }		
 
-    OCLBuffer() { }
+    OCLBuffer() : m_last_write(0) { }
 
-	OCLBuffer(cl_mem id) : OCLObject<cl_mem>(id) { query_info(); }
+	OCLBuffer(cl_mem id) : OCLObject<cl_mem>(id), m_last_write(0) { query_info(); }
 
 	OCLBuffer(cl_context context, cl_mem_flags flags, size_t num_bytes, void *host_ptr = 0) :		
 		m_context(context),
 		m_flags(flags), 
 		m_size(num_bytes),
-		m_host_ptr(host_ptr)
+		m_host_ptr(host_ptr),
+		m_last_write(0)
 	{
 		m_id = 0;
 		create();		
@@ -66,7 +83,8 @@ public:
 		m_context(context.id()),
 		m_flags(flags), 
 		m_size(num_bytes),
-		m_host_ptr(host_ptr)
+		m_host_ptr(host_ptr),
+		m_last_write(0)
 	{
 		m_id = 0;
 		create();		
@@ -76,7 +94,8 @@ public:
 		m_context(context->id()),
 		m_flags(flags), 
 		m_size(num_bytes),
-		m_host_ptr(host_ptr)
+		m_host_ptr(host_ptr),
+		m_last_write(0)
 	{
 		m_id = 0;
 		create();		
@@ -96,7 +115,88 @@ public:
 		query_info();
 	}
 
+	~OCLBuffer() {
+		//Kernels must not be left pointing at the destroyed wrapper
+		for (size_t i=0; i<m_bound.size(); ++i) {
+			std::vector<OCLBuffer *> &args = *m_bound[i];
+			for (size_t j=0; j<args.size(); ++j) {
+				if (args[j] == this) args[j] = 0;
+			}
+		}
+		clear_access();
+	}
+
+	//Record that the kernel argument list args holds the buffer, or no
+	//longer does
+	inline void bind(std::vector<OCLBuffer *> *args) {
+		for (size_t i=0; i<m_bound.size(); ++i) {
+			if (m_bound[i] == args) return;
+		}
+		m_bound.push_back(args);
+	}
+
+	inline void unbind(std::vector<OCLBuffer *> *args) {
+		for (size_t i=0; i<m_bound.size(); ++i) {
+			if (m_bound[i] == args) {
+				m_bound.erase(m_bound.begin() + i);
+				return;
+			}
+		}
+	}
+
+	//Append the commands a new command on the buffer has to wait for: the 
+	//last writer, and for writes also the readers since then
+	inline void dependencies(std::vector<cl_event> &wait_list, bool write) const {
+		if (m_last_write) wait_list.push_back(m_last_write);
+		if (write) wait_list.insert(wait_list.end(), m_reads.begin(), m_reads.end());
+	}
+
+	//Record command evt as accessing the buffer. A write replaces the
+	//writer and the readers.
+	inline void record_access(cl_event evt, bool write) {
+		ocl_check(clRetainEvent(evt), "clRetainEvent");
+		if (write) {
+			clear_access();
+			m_last_write = evt;
+		} else {
+			if (m_reads.size() >= 16) prune_reads();
+			m_reads.push_back(evt);
+		}
+	}
+
+	//Block until the commands a new access would have to wait for complete
+	inline void wait_access(bool write) {
+		std::vector<cl_event> wait_list;
+		dependencies(wait_list, write);
+		if (!wait_list.empty()) {
+			ocl_check(clWaitForEvents((cl_uint) wait_list.size(), &wait_list[0]), "clWaitForEvents");
+		}
+	}
+
+	inline void clear_access() {
+		if (m_last_write) clReleaseEvent(m_last_write);
+		m_last_write = 0;
+		for (size_t i=0; i<m_reads.size(); ++i) clReleaseEvent(m_reads[i]);
+		m_reads.clear();
+	}
+
 protected:
+	//Drop readers that have completed (or failed), so buffers that are only read do not
+	//collect events
+	inline void prune_reads() {
+		size_t kept = 0;
+		for (size_t i=0; i<m_reads.size(); ++i) {
+			cl_int status = CL_QUEUED;
+			clGetEventInfo(m_reads[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+			if (status <= CL_COMPLETE) {
+				clReleaseEvent(m_reads[i]);
+			} else {
+				m_reads[kept++] = m_reads[i];
+			}
+		}
+		m_reads.resize(kept);
+	}
+
 	inline void query_info() {
 		ocl_get_info(m_id, CL_MEM_TYPE,				m_type,			cl_mem_object_type, clGetMemObjectInfo);
 		ocl_get_info(m_id, CL_MEM_FLAGS,			m_flags,		cl_mem_flags,		clGetMemObjectInfo);
@@ -0,0 +1,199 @@
+#ifndef _RAY_OPENCL_OCLBUFFERPOOL_H_
+#define _RAY_OPENCL_OCLBUFFERPOOL_H_
+
+/*
+ * OpenCL Buffer pool for recycling device memory
+ *
+ * Creating and releasing device buffers is expensive compared to short
+ * kernels. The pool keeps released buffers, grouped by memory flags and
+ * size class, and hands them back out on the next matching request.
+ * The total number of bytes held by idle buffers is capped by a
+ * high-water mark; buffers released above the mark are freed.
+ *
+ * Buffers returned by acquire() may be larger than requested (rounded up
+ * to the size class) and their contents are undefined.
+ *
+ * A released buffer may still be used by commands already enqueued. When
+ * the queues are registered with add_queue(), release() enqueues a marker
+ * on each of them and a buffer is only handed out again once its markers
+ * have completed: buffers whose markers are done are preferred, otherwise
+ * acquire() waits for them.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <map>
+#include <vector>
+#include <utility>
+
+namespace ray { namespace opencl {
+
+class OCLBufferPool {
+public:
+	typedef std::pair<size_t, cl_mem_flags>		pool_key;	//(size class, flags)
+
+	typedef struct _Idle {
+		OCLBuffer				   *buffer;
+		std::vector<cl_event>		fences;		//Markers enqueued on release
+	} Idle;
+
+	typedef std::vector<Idle>					pool_list;
+
+	cl_context							m_context;
+	size_t								m_high_water;		//Maximum bytes held by idle buffers
+	size_t								m_pooled_bytes;		//Bytes currently held by idle buffers
+	std::map<pool_key, pool_list>		m_free;				//Idle buffers by size class and flags
+	std::vector<OCLCommandQueue *>		m_queues;			//Queues released buffers may still be in use on
+
+public:
+	OCLBufferPool(cl_context context, size_t high_water = 256*1024*1024) :
+		m_context(context), m_high_water(high_water), m_pooled_bytes(0) { }
+
+	OCLBufferPool(OCLContext &context, size_t high_water = 256*1024*1024) :
+		m_context(context.id()), m_high_water(high_water), m_pooled_bytes(0) { }
+
+	OCLBufferPool(OCLContext *context, size_t high_water = 256*1024*1024) :
+		m_context(context->id()), m_high_water(high_water), m_pooled_bytes(0) { }
+
+	~OCLBufferPool() { clear(); }
+
+	//Fence released buffers against the commands enqueued on queue. The
+	//queue must outlive the pool or be removed with clear_queues().
+	inline void add_queue(OCLCommandQueue *queue) {
+		m_queues.push_back(queue);
+	}
+
+	inline void clear_queues() {
+		m_queues.clear();
+	}
+
+	inline OCLBuffer *acquire(cl_mem_flags flags, size_t num_bytes) {
+		size_t sz = bucket_size(num_bytes);
+
+		std::map<pool_key, pool_list>::iterator it = m_free.find(pool_key(sz, flags));
+		if ((it != m_free.end()) && !it->second.empty()) {
+			pool_list &list = it->second;
+
+			//Prefer a buffer no command uses any more, else wait for the oldest
+			size_t idx = list.size();
+			while ((idx > 0) && !completed(list[idx - 1].fences)) --idx;
+			if (idx == 0) {
+				idx = 1;
+				std::vector<cl_event> &fences = list[0].fences;
+				if (!fences.empty()) ocl_check(clWaitForEvents((cl_uint) fences.size(), &fences[0]), "clWaitForEvents");
+			}
+
+			Idle idle = list[idx - 1];
+			list.erase(list.begin() + (idx - 1));
+			m_pooled_bytes -= sz;
+
+			release_fences(idle.fences);
+			idle.buffer->clear_access();
+			return idle.buffer;
+		}
+
+		try {
+			return new OCLBuffer(m_context, flags, sz);
+		} catch (OCLError &err) {
+			if (err.m_code != CL_MEM_OBJECT_ALLOCATION_FAILURE || m_free.empty()) throw;
+		}
+
+		//Out of device memory: give back everything we hold and try once more
+		clear();
+		return new OCLBuffer(m_context, flags, sz);
+	}
+
+	inline void release(OCLBuffer *b) {
+		if (!b) return;
+
+		//Buffers wrapping host memory cannot be handed to another owner
+		if ((b->m_flags & CL_MEM_USE_HOST_PTR) || (b->m_size > m_high_water)) {
+			delete b;
+			return;
+		}
+
+		Idle idle;
+		idle.buffer = b;
+		try {
+			for (size_t i=0; i<m_queues.size(); ++i) {
+				cl_event e = 0;
+				m_queues[i]->enqueue_marker(&e);
+				idle.fences.push_back(e);
+			}
+		} catch (...) {
+			//OpenCL frees the memory once the commands using it are done
+			release_fences(idle.fences);
+			delete b;
+			throw;
+		}
+
+		//Released buffers are pushed at the back: the front holds the oldest
+		m_free[pool_key(b->m_size, b->m_flags)].push_back(idle);
+		m_pooled_bytes += b->m_size;
+		trim(m_high_water);
+	}
+
+	inline void set_high_water(size_t num_bytes) {
+		m_high_water = num_bytes;
+		trim(m_high_water);
+	}
+
+	//Free idle buffers, largest first, until at most num_bytes are held.
+	//Commands still using them keep the memory alive until they complete.
+	inline void trim(size_t num_bytes) {
+		while ((m_pooled_bytes > num_bytes) && !m_free.empty()) {
+			std::map<pool_key, pool_list>::iterator it = m_free.end();
+			--it;
+
+			if (it->second.empty()) {
+				m_free.erase(it);
+				continue;
+			}
+
+			Idle &idle = it->second.back();
+			release_fences(idle.fences);
+			delete idle.buffer;
+			it->second.pop_back();
+			m_pooled_bytes -= it->first.first;
+		}
+	}
+
+	inline void clear() {
+		trim(0);
+		m_free.clear();
+	}
+
+	//Size classes: four per power of two above 256 bytes, so at most 25% of a
+	//block is slack.
+	inline static size_t bucket_size(size_t num_bytes) {
+		if (num_bytes <= 256) return 256;
+
+		size_t p = 256;
+		while (p <= num_bytes/2) p *= 2;
+
+		size_t step = p / 4;
+		return ((num_bytes + step - 1) / step) * step;
+	}
+
+protected:
+	inline static bool completed(const std::vector<cl_event> &fences) {
+		for (size_t i=0; i<fences.size(); ++i) {
+			cl_int status = CL_QUEUED;
+			clGetEventInfo(fences[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+			if (status > CL_COMPLETE) return false;
+		}
+		return true;
+	}
+
+	inline static void release_fences(std::vector<cl_event> &fences) {
+		for (size_t i=0; i<fences.size(); ++i) clReleaseEvent(fences[i]);
+		fences.clear();
+	}
+
+private:
+	OCLBufferPool(const OCLBufferPool &);
+	OCLBufferPool &operator=(const OCLBufferPool &);
+};
+
+}}
+#endif
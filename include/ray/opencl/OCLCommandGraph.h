@@ -0,0 +1,365 @@
+#ifndef _RAY_OPENCL_OCLCOMMANDGRAPH_H_
+#define _RAY_OPENCL_OCLCOMMANDGRAPH_H_
+
+/*
+ * Recorded sequence of commands that can be replayed with one call
+ *
+ * Commands enqueued on a queue between begin_recording(&graph) and
+ * end_recording() are stored in the graph instead of being run: kernel
+ * launches (with their arguments and work sizes at the time of the call),
+ * OCLBuffer reads, writes and copies, and barriers. replay() enqueues them
+ * all again. Each recorded launch gets its own cl_kernel with its arguments
+ * already set, so a replay makes no clSetKernelArg calls and none of the
+ * checks done when the commands were first enqueued.
+ *
+ * Nodes are numbered in the order they were recorded. Between replays,
+ * set_arg, set_host_ptr and set_global_size change the arguments, host
+ * memory and work size of a node.
+ *
+ * Reads and writes use the host memory passed when they were recorded and
+ * do not block: the memory must stay valid, and reads are only complete
+ * once the queue has finished. Buffers used by the graph are retained
+ * until it is cleared.
+ *
+ * On out-of-order queues, each node waits for the earlier nodes that access
+ * the same buffers, and the replay as a whole is fenced by barriers from
+ * the other commands on the queue. Buffers passed to kernels as raw cl_mem
+ * are not tracked and should only be used with in-order queues.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <vector>
+
+namespace ray { namespace opencl {
+
+class OCLCommandGraph : public OCLCommandRecorder {
+public:
+	enum { KERNEL, READ, WRITE, COPY, BARRIER };
+
+	typedef struct _Node {
+		int						type;
+		cl_kernel				kernel;			//Private copy of the kernel, arguments set
+		cl_uint					num_dims;
+		size_t					global_size[3];
+		size_t					local_size[3];
+		std::vector<cl_mem>		arg_buffers;	//OCLBuffer of each kernel argument (0 for others)
+		std::vector<bool>		arg_writes;		//True if the kernel writes arg_buffers[i]
+
+		cl_mem					dst;			//Buffers of transfers
+		cl_mem					src;
+		void				   *host;			//Host memory of reads and writes
+		size_t					num_bytes;
+		size_t					dst_offset;
+		size_t					src_offset;
+
+		std::vector<size_t>		deps;			//Earlier nodes to wait for on out-of-order queues
+	} Node;
+
+	std::vector<Node *>			m_nodes;
+
+protected:
+	std::vector<cl_mem>			m_retained;		//Buffers retained by the graph
+
+public:
+	OCLCommandGraph() { }
+
+	~OCLCommandGraph() {
+		clear();
+	}
+
+	inline size_t size() const {
+		return m_nodes.size();
+	}
+
+	inline void clear() {
+		for (size_t i=0; i<m_nodes.size(); ++i) {
+			if (m_nodes[i]->kernel) clReleaseKernel(m_nodes[i]->kernel);
+			delete m_nodes[i];
+		}
+		m_nodes.clear();
+
+		for (size_t i=0; i<m_retained.size(); ++i) clReleaseMemObject(m_retained[i]);
+		m_retained.clear();
+	}
+
+	//Enqueue all nodes on queue
+	inline void replay(OCLCommandQueue &queue) {
+		cl_command_queue q = queue.id();
+
+		if (!queue.out_of_order()) {
+			for (size_t i=0; i<m_nodes.size(); ++i) enqueue(q, *m_nodes[i], 0, NULL, NULL);
+			return;
+		}
+
+		std::vector<cl_event> events(m_nodes.size(), (cl_event) 0);
+		std::vector<cl_event> waits;
+		try {
+			ocl_check_fast(clEnqueueBarrier(q), "clEnqueueBarrier");
+			for (size_t i=0; i<m_nodes.size(); ++i) {
+				waits.clear();
+				for (size_t j=0; j<m_nodes[i]->deps.size(); ++j) waits.push_back(events[m_nodes[i]->deps[j]]);
+				enqueue(q, *m_nodes[i], (cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], &events[i]);
+			}
+			ocl_check_fast(clEnqueueBarrier(q), "clEnqueueBarrier");
+		} catch (...) {
+			release_events(events);
+			throw;
+		}
+		release_events(events);
+	}
+
+	/********************************
+	 * PATCHING                     *
+	 ********************************/
+
+	//Argument idx of kernel node node: size bytes at value (0 for local memory)
+	inline void set_arg(size_t node, cl_uint idx, size_t size, const void *value) {
+		Node &n = kernel_node(node);
+		ocl_check(clSetKernelArg(n.kernel, idx, size, value), "clSetKernelArg");
+		if ((idx < n.arg_buffers.size()) && n.arg_buffers[idx]) {
+			release(n.arg_buffers[idx]);
+			n.arg_buffers[idx] = 0;
+		}
+		link();
+	}
+
+	inline void set_arg(size_t node, cl_uint idx, OCLBuffer &buffer) {
+		Node &n = kernel_node(node);
+		ocl_check(clSetKernelArg(n.kernel, idx, sizeof(cl_mem), buffer.ptr()), "clSetKernelArg");
+		if (n.arg_buffers.size() <= idx) {
+			n.arg_buffers.resize(idx + 1, (cl_mem) 0);
+			n.arg_writes.resize(idx + 1, false);
+		}
+		cl_mem old = n.arg_buffers[idx];
+		n.arg_buffers[idx] = retain(buffer.id());
+		n.arg_writes[idx] = OCLKernel::writes(buffer);
+		if (old) release(old);
+		link();
+	}
+
+	inline void set_global_size(size_t node, size_t x1, size_t x2=0, size_t x3=0) {
+		Node &n = kernel_node(node);
+		n.global_size[0] = x1;
+		n.global_size[1] = x2;
+		n.global_size[2] = x3;
+	}
+
+	//Host memory of a read or write node
+	inline void set_host_ptr(size_t node, void *host) {
+		if ((node >= m_nodes.size()) || ((m_nodes[node]->type != READ) && (m_nodes[node]->type != WRITE))) {
+			throw OCLError(CL_INVALID_VALUE, "OCLCommandGraph: not a read or write node");
+		}
+		m_nodes[node]->host = host;
+	}
+
+	/********************************
+	 * RECORDING                    *
+	 ********************************/
+
+	inline void record_kernel(OCLKernel &kernel) {
+		cl_uint num_args = 0;
+		ocl_check(clGetKernelInfo(kernel.id(), CL_KERNEL_NUM_ARGS, sizeof(num_args), &num_args, NULL), "clGetKernelInfo");
+
+		OCLKernelArgs &args = kernel.m_args;
+		for (cl_uint i=0; i<num_args; ++i) {
+			if ((i >= args.sizes.size()) || (args.sizes[i] == 0)) {
+				throw OCLError(CL_INVALID_KERNEL_ARGS, "OCLCommandGraph: kernel arguments must be set through OCLKernel to be recorded");
+			}
+		}
+
+		cl_int errcode = CL_SUCCESS;
+		cl_kernel k = clCreateKernel(kernel.m_program, kernel.m_function_name.c_str(), &errcode);
+		ocl_check(errcode, "clCreateKernel");
+
+		Node *n = new_node(KERNEL);
+		n->kernel = k;
+		n->num_dims = kernel.m_num_dims;
+		for (int d=0; d<3; ++d) {
+			n->global_size[d] = kernel.m_global_group_size[d];
+			n->local_size[d] = kernel.m_local_group_size[d];
+		}
+		n->arg_buffers.assign(num_args, (cl_mem) 0);
+		n->arg_writes.assign(num_args, false);
+
+		for (cl_uint i=0; i<num_args; ++i) {
+			const void *value = args.values[i].empty() ? NULL : &args.values[i][0];
+			ocl_check(clSetKernelArg(k, i, args.sizes[i], value), "clSetKernelArg");
+
+			if (args.buffers[i]) {
+				n->arg_buffers[i] = retain(args.buffers[i]->id());
+				n->arg_writes[i] = OCLKernel::writes(*args.buffers[i]);
+			}
+		}
+		add(n);
+	}
+
+	inline void record_read(void *dst, OCLBuffer &src, size_t num_bytes, size_t buff_byte_offset) {
+		Node *n = new_node(READ);
+		n->host = dst;
+		n->src = retain(src.id());
+		n->num_bytes = num_bytes;
+		n->src_offset = buff_byte_offset;
+		add(n);
+	}
+
+	inline void record_write(OCLBuffer &dst, const void *src, size_t num_bytes, size_t buff_byte_offset) {
+		Node *n = new_node(WRITE);
+		n->host = const_cast<void *>(src);
+		n->dst = retain(dst.id());
+		n->num_bytes = num_bytes;
+		n->dst_offset = buff_byte_offset;
+		add(n);
+	}
+
+	inline void record_copy(OCLBuffer &dst, OCLBuffer &src, size_t num_bytes, size_t dst_byte_offset, size_t src_byte_offset) {
+		Node *n = new_node(COPY);
+		n->dst = retain(dst.id());
+		n->src = retain(src.id());
+		n->num_bytes = num_bytes;
+		n->dst_offset = dst_byte_offset;
+		n->src_offset = src_byte_offset;
+		add(n);
+	}
+
+	inline void record_barrier() {
+		add(new_node(BARRIER));
+	}
+
+protected:
+	inline static void enqueue(cl_command_queue q, Node &n, cl_uint num_waits, const cl_event *waits, cl_event *evt) {
+		switch (n.type) {
+			case KERNEL:
+				ocl_check_fast(
+					clEnqueueNDRangeKernel(q, n.kernel, n.num_dims, NULL, n.global_size, n.local_size, num_waits, waits, evt),
+					"clEnqueueNDRangeKernel"
+				);
+				break;
+			case READ:
+				ocl_check_fast(
+					clEnqueueReadBuffer(q, n.src, CL_FALSE, n.src_offset, n.num_bytes, n.host, num_waits, waits, evt),
+					"clEnqueueReadBuffer"
+				);
+				break;
+			case WRITE:
+				ocl_check_fast(
+					clEnqueueWriteBuffer(q, n.dst, CL_FALSE, n.dst_offset, n.num_bytes, n.host, num_waits, waits, evt),
+					"clEnqueueWriteBuffer"
+				);
+				break;
+			case COPY:
+				ocl_check_fast(
+					clEnqueueCopyBuffer(q, n.src, n.dst, n.src_offset, n.dst_offset, n.num_bytes, num_waits, waits, evt),
+					"clEnqueueCopyBuffer"
+				);
+				break;
+			default:
+				//A marker completes once all earlier commands have, which
+				//is the barrier on out-of-order queues
+				if (evt) {
+					ocl_check_fast(clEnqueueMarker(q, evt), "clEnqueueMarker");
+				} else {
+					ocl_check_fast(clEnqueueBarrier(q), "clEnqueueBarrier");
+				}
+				break;
+		}
+	}
+
+	inline static void release_events(std::vector<cl_event> &events) {
+		for (size_t i=0; i<events.size(); ++i) {
+			if (events[i]) clReleaseEvent(events[i]);
+		}
+	}
+
+	inline static Node *new_node(int type) {
+		Node *n = new Node;
+		n->type = type;
+		n->kernel = 0;
+		n->num_dims = 0;
+		for (int d=0; d<3; ++d) n->global_size[d] = n->local_size[d] = 0;
+		n->dst = n->src = 0;
+		n->host = 0;
+		n->num_bytes = n->dst_offset = n->src_offset = 0;
+		return n;
+	}
+
+	inline Node &kernel_node(size_t node) {
+		if ((node >= m_nodes.size()) || (m_nodes[node]->type != KERNEL)) {
+			throw OCLError(CL_INVALID_VALUE, "OCLCommandGraph: not a kernel node");
+		}
+		return *m_nodes[node];
+	}
+
+	inline cl_mem retain(cl_mem mem) {
+		ocl_check(clRetainMemObject(mem), "clRetainMemObject");
+		m_retained.push_back(mem);
+		return mem;
+	}
+
+	//Drop one reference taken by retain()
+	inline void release(cl_mem mem) {
+		for (size_t i=0; i<m_retained.size(); ++i) {
+			if (m_retained[i] == mem) {
+				m_retained.erase(m_retained.begin() + i);
+				clReleaseMemObject(mem);
+				return;
+			}
+		}
+	}
+
+	inline void add(Node *n) {
+		m_nodes.push_back(n);
+		link(m_nodes.size() - 1);
+	}
+
+	//Recompute the dependencies of all nodes
+	inline void link() {
+		for (size_t i=0; i<m_nodes.size(); ++i) link(i);
+	}
+
+	//Dependencies of node i: the last barrier before it and the nodes since
+	//then that write a buffer it accesses or read a buffer it writes
+	inline void link(size_t i) {
+		Node &n = *m_nodes[i];
+		n.deps.clear();
+
+		for (size_t j=i; j-- > 0; ) {
+			Node &p = *m_nodes[j];
+			if ((n.type == BARRIER) || (p.type == BARRIER) || conflicts(n, p)) n.deps.push_back(j);
+			if (p.type == BARRIER) break;
+		}
+	}
+
+	inline static bool conflicts(Node &a, Node &b) {
+		std::vector<cl_mem> reads_a, writes_a, reads_b, writes_b;
+		accesses(a, reads_a, writes_a);
+		accesses(b, reads_b, writes_b);
+		return intersect(writes_a, reads_b) || intersect(writes_a, writes_b) || intersect(reads_a, writes_b);
+	}
+
+	inline static void accesses(Node &n, std::vector<cl_mem> &reads, std::vector<cl_mem> &writes) {
+		if (n.src) reads.push_back(n.src);
+		if (n.dst) writes.push_back(n.dst);
+		for (size_t i=0; i<n.arg_buffers.size(); ++i) {
+			if (n.arg_buffers[i] == 0) continue;
+			if (n.arg_writes[i]) writes.push_back(n.arg_buffers[i]);
+			else reads.push_back(n.arg_buffers[i]);
+		}
+	}
+
+	inline static bool intersect(const std::vector<cl_mem> &a, const std::vector<cl_mem> &b) {
+		for (size_t i=0; i<a.size(); ++i) {
+			for (size_t j=0; j<b.size(); ++j) {
+				if (a[i] == b[j]) return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	OCLCommandGraph(const OCLCommandGraph &);
+	OCLCommandGraph &operator=(const OCLCommandGraph &);
+};
+
+}}
+#endif
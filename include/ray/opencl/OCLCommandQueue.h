@@ -7,6 +7,16 @@
  * A command queue is responsible for sending commands to a device.
  * Each device can be associated with multiple context, so the command queue
  * is specific to a context. 
+ *
+ * Queues created with CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE may run 
+ * commands in any order. On such queues, transfers on OCLBuffers and
+ * kernels with OCLBuffer arguments wait for the earlier commands that
+ * access the same buffers (see OCLBuffer), so independent commands overlap
+ * without passing events around. Commands on raw cl_mem objects are not
+ * tracked.
+ *
+ * Between begin_recording() and end_recording(), the same commands are 
+ * passed to a recorder (an OCLCommandGraph) instead of being enqueued.
  *  
  * Author: Radford Juang 
  * Date:  5.7.2010
@@ -15,43 +25,56 @@
 
 #include <ray/opencl/opencl.h>
 
+#include <vector>
 
 namespace ray { namespace opencl {
 
+//Receives the commands enqueued on a recording queue (see OCLCommandGraph)
+class OCLCommandRecorder {
+public:
+	virtual ~OCLCommandRecorder() { }
+	virtual void record_kernel(OCLKernel &kernel) = 0;
+	virtual void record_read(void *dst, OCLBuffer &src, size_t num_bytes, size_t buff_byte_offset) = 0;
+	virtual void record_write(OCLBuffer &dst, const void *src, size_t num_bytes, size_t buff_byte_offset) = 0;
+	virtual void record_copy(OCLBuffer &dst, OCLBuffer &src, size_t num_bytes, size_t dst_byte_offset, size_t src_byte_offset) = 0;
+	virtual void record_barrier() = 0;
+};
+
 class OCLCommandQueue : public OCLObject<cl_command_queue> {
 public:
 	cl_device_id				m_device;
 	cl_context					m_context;
 	cl_command_queue_properties m_properties;
 	cl_uint						m_refcount;
+	OCLCommandRecorder		   *m_recorder;		//Receives the commands instead of the queue if not 0
 public:
 
-	OCLCommandQueue(cl_command_queue id) : OCLObject<cl_command_queue>(id) { 
+	OCLCommandQueue(cl_command_queue id) : OCLObject<cl_command_queue>(id), m_recorder(0) { 
 		query_info(); 
 	}
 
 	OCLCommandQueue(cl_context context, cl_device_id device, cl_command_queue_properties properties = 0) : 
-		m_device(device), m_context(context), m_properties(properties){
+		m_device(device), m_context(context), m_properties(properties), m_recorder(0) {
 		create();
 	}
 
 	OCLCommandQueue(OCLContext &context, OCLDevice &device, cl_command_queue_properties properties = 0) : 
-		m_device(device.id()), m_context(context.id()), m_properties(properties){
+		m_device(device.id()), m_context(context.id()), m_properties(properties), m_recorder(0) {
 		create();
 	}
 
 	OCLCommandQueue(OCLContext *context, OCLDevice *device, cl_command_queue_properties properties = 0) : 
-		m_device(device->id()), m_context(context->id()), m_properties(properties){
+		m_device(device->id()), m_context(context->id()), m_properties(properties), m_recorder(0) {
 		create();
 	}
 
 	OCLCommandQueue(OCLContext &context, cl_device_id device, cl_command_queue_properties properties = 0) : 
-		m_device(device), m_context(context.id()), m_properties(properties){
+		m_device(device), m_context(context.id()), m_properties(properties), m_recorder(0) {
 		create();
 	}
 
 	OCLCommandQueue(OCLContext *context, cl_device_id device, cl_command_queue_properties properties = 0) : 
-		m_device(device), m_context(context->id()), m_properties(properties){
+		m_device(device), m_context(context->id()), m_properties(properties), m_recorder(0) {
 		create();
 	}
 
@@ -74,31 +97,37 @@ public:
 		set(m_properties);
 	}
 
-    //Deprecated in 1.1 API --
+	//clSetCommandQueueProperty is deprecated in 1.1, so the properties of a
+	//created queue cannot be changed. The queue is finished and created 
+	//again instead.
 	inline void set(cl_command_queue_properties properties) {
+		bool changed = (properties != m_properties);
 		m_properties = properties;
 
-		if (m_id) {
-			//Set the properties on device if queue is already created
-			cl_bool result = ((m_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0);
-
-            // These properties are deprecated and can no longer be set in
-            // 1.1+
-            /*         
-			ocl_check( 
-				clSetCommandQueueProperty(m_id, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, result,  NULL),
-				"clSetCommandQueue - CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE"
-			);
-           
-			result = ((m_properties & CL_QUEUE_PROFILING_ENABLE) != 0);
-            
-			ocl_check( 
-				clSetCommandQueueProperty(m_id, CL_QUEUE_PROFILING_ENABLE, result,  NULL),
-				"clSetCommandQueue - CL_QUEUE_PROFILING_ENABLE"
-			);
-            */
+		if (m_id && changed) {
+			finish();
+			create();
 		}
 	}
+
+	inline bool out_of_order() const {
+		return (m_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+	}
+
+	//Pass the kernel launches, OCLBuffer transfers and barriers enqueued
+	//from now on to recorder instead of running them. Commands with wait
+	//lists or output events, and maps, cannot be recorded and throw.
+	inline void begin_recording(OCLCommandRecorder *recorder) {
+		m_recorder = recorder;
+	}
+
+	inline void end_recording() {
+		m_recorder = 0;
+	}
+
+	inline bool recording() const {
+		return m_recorder != 0;
+	}
     
 
 	inline void create() {
@@ -195,7 +224,24 @@ public:
 		const cl_event *event_waitlist		 = NULL,
 			  OCLEvent *event_out			 = NULL
 	) { 	
-		enqueue_buffer_copy(dst,src.id(),num_bytes, buff_byte_offset, blocking, num_events_to_wait, event_waitlist, event_out);
+		if (m_recorder) {
+			check_recordable(num_events_to_wait, event_out);
+			m_recorder->record_read(dst, src, num_bytes, buff_byte_offset);
+			return;
+		}
+
+		if (!out_of_order()) {
+			enqueue_buffer_copy(dst,src.id(),num_bytes, buff_byte_offset, blocking, num_events_to_wait, event_waitlist, event_out);
+			return;
+		}
+
+		std::vector<cl_event> waits = wait_list(num_events_to_wait, event_waitlist);
+		src.dependencies(waits, false);
+
+		OCLEvent evt;
+		OCLEvent *out = event_out ? event_out : &evt;
+		enqueue_buffer_copy(dst, src.id(), num_bytes, buff_byte_offset, blocking, (cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], out);
+		src.record_access(out->id(), false);
 	}
 
 	inline void enqueue_buffer_copy(OCLBuffer &dst, const void *src, size_t num_bytes, 
@@ -205,7 +251,24 @@ public:
 		const cl_event *event_waitlist		 = NULL,
 			  OCLEvent *event_out			 = NULL
 	) {
-		enqueue_buffer_copy(dst.id(), src, num_bytes, buff_byte_offset, blocking, num_events_to_wait, event_waitlist, event_out);	
+		if (m_recorder) {
+			check_recordable(num_events_to_wait, event_out);
+			m_recorder->record_write(dst, src, num_bytes, buff_byte_offset);
+			return;
+		}
+
+		if (!out_of_order()) {
+			enqueue_buffer_copy(dst.id(), src, num_bytes, buff_byte_offset, blocking, num_events_to_wait, event_waitlist, event_out);	
+			return;
+		}
+
+		std::vector<cl_event> waits = wait_list(num_events_to_wait, event_waitlist);
+		dst.dependencies(waits, true);
+
+		OCLEvent evt;
+		OCLEvent *out = event_out ? event_out : &evt;
+		enqueue_buffer_copy(dst.id(), src, num_bytes, buff_byte_offset, blocking, (cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], out);
+		dst.record_access(out->id(), true);
 	}
 
 	inline void enqueue_buffer_copy(OCLBuffer &dst, OCLBuffer &src, size_t num_bytes, 
@@ -215,7 +278,118 @@ public:
 		const cl_event *event_waitlist		 = NULL,
 			  OCLEvent *event_out			 = NULL
 		) {
+		if (m_recorder) {
+			check_recordable(num_events_to_wait, event_out);
+			m_recorder->record_copy(dst, src, num_bytes, dst_byte_offset, src_byte_offset);
+			return;
+		}
+
+		if (!out_of_order()) {
 			enqueue_buffer_copy(dst.id(), src.id(), num_bytes, dst_byte_offset, src_byte_offset, num_events_to_wait, event_waitlist, event_out);		
+			return;
+		}
+
+		std::vector<cl_event> waits = wait_list(num_events_to_wait, event_waitlist);
+		src.dependencies(waits, false);
+		dst.dependencies(waits, true);
+
+		OCLEvent evt;
+		OCLEvent *out = event_out ? event_out : &evt;
+		enqueue_buffer_copy(dst.id(), src.id(), num_bytes, dst_byte_offset, src_byte_offset, (cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], out);
+		src.record_access(out->id(), false);
+		dst.record_access(out->id(), true);
+	}
+
+
+	//Map a region of a buffer into host memory. Returns the host pointer to
+	//the region, which stays valid until enqueue_unmap is called.
+	inline void *enqueue_map_buffer(cl_mem buffer, cl_map_flags flags, size_t num_bytes,
+				size_t  buff_byte_offset	 = 0,
+			   cl_bool	blocking			 = CL_TRUE,
+			   cl_uint  num_events_to_wait   = 0,
+		const cl_event *event_waitlist		 = NULL,
+			  OCLEvent *event_out			 = NULL
+		) {
+		cl_event e;
+		cl_int errcode = CL_SUCCESS;
+		void *ptr = 0;
+
+		if (m_recorder) throw OCLError(CL_INVALID_OPERATION, "OCLCommandQueue: maps cannot be recorded");
+
+		if (event_out) {
+			ptr = clEnqueueMapBuffer(m_id, buffer, blocking, flags, buff_byte_offset, num_bytes,
+									 num_events_to_wait, event_waitlist, &e, &errcode);
+			ocl_check(errcode, "clEnqueueMapBuffer");
+			event_out->assign(e);
+		} else {
+			ptr = clEnqueueMapBuffer(m_id, buffer, blocking, flags, buff_byte_offset, num_bytes,
+									 num_events_to_wait, event_waitlist, NULL, &errcode);
+			ocl_check(errcode, "clEnqueueMapBuffer");
+		}
+		return ptr;
+	}
+
+	inline void *enqueue_map_buffer(OCLBuffer &buffer, cl_map_flags flags, size_t num_bytes,
+				size_t  buff_byte_offset	 = 0,
+			   cl_bool	blocking			 = CL_TRUE,
+			   cl_uint  num_events_to_wait   = 0,
+		const cl_event *event_waitlist		 = NULL,
+			  OCLEvent *event_out			 = NULL
+		) {
+		if (!out_of_order()) {
+			return enqueue_map_buffer(buffer.id(), flags, num_bytes, buff_byte_offset, blocking, num_events_to_wait, event_waitlist, event_out);
+		}
+
+		bool write = (flags & CL_MAP_WRITE) != 0;
+		std::vector<cl_event> waits = wait_list(num_events_to_wait, event_waitlist);
+		buffer.dependencies(waits, write);
+
+		OCLEvent evt;
+		OCLEvent *out = event_out ? event_out : &evt;
+		void *ptr = enqueue_map_buffer(buffer.id(), flags, num_bytes, buff_byte_offset, blocking, (cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], out);
+		buffer.record_access(out->id(), write);
+		return ptr;
+	}
+
+	inline void enqueue_unmap(cl_mem buffer, void *mapped_ptr,
+			   cl_uint  num_events_to_wait   = 0,
+		const cl_event *event_waitlist		 = NULL,
+			  OCLEvent *event_out			 = NULL
+		) {
+		cl_event e;
+		if (event_out) {
+			ocl_check_fast(
+				clEnqueueUnmapMemObject(m_id, buffer, mapped_ptr, num_events_to_wait, event_waitlist, &e),
+				"clEnqueueUnmapMemObject"
+			);
+			event_out->assign(e);
+		} else {
+			ocl_check_fast(
+				clEnqueueUnmapMemObject(m_id, buffer, mapped_ptr, num_events_to_wait, event_waitlist, NULL),
+				"clEnqueueUnmapMemObject"
+			);
+		}
+	}
+
+	inline void enqueue_unmap(OCLBuffer &buffer, void *mapped_ptr,
+			   cl_uint  num_events_to_wait   = 0,
+		const cl_event *event_waitlist		 = NULL,
+			  OCLEvent *event_out			 = NULL
+		) {
+		if (!out_of_order()) {
+			enqueue_unmap(buffer.id(), mapped_ptr, num_events_to_wait, event_waitlist, event_out);
+			return;
+		}
+
+		//The host may have written the mapped region, so the unmap counts 
+		//as a write
+		std::vector<cl_event> waits = wait_list(num_events_to_wait, event_waitlist);
+		buffer.dependencies(waits, true);
+
+		OCLEvent evt;
+		OCLEvent *out = event_out ? event_out : &evt;
+		enqueue_unmap(buffer.id(), mapped_ptr, (cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], out);
+		buffer.record_access(out->id(), true);
 	}
 
 
@@ -240,6 +414,11 @@ public:
 	}
 
 	inline void enqueue_barrier() { 
+		if (m_recorder) {
+			m_recorder->record_barrier();
+			return;
+		}
+
 		ocl_check_fast(
 			clEnqueueBarrier(m_id),
 			"clEnqueueBarrier"
@@ -284,6 +463,17 @@ public:
 	}
 
 	inline void enqueue_ndrange_kernel(OCLKernel &kernel, OCLEvent *out_event=NULL) {
+		if (m_recorder) {
+			check_recordable(0, out_event);
+			m_recorder->record_kernel(kernel);
+			return;
+		}
+
+		if (out_of_order()) {
+			enqueue_tracked_kernel(kernel, std::vector<cl_event>(), out_event);
+			return;
+		}
+
 		cl_event e;
 		if (out_event) {
 			ocl_check_fast(
@@ -300,6 +490,17 @@ public:
 	}
 
 	inline void enqueue_ndrange_kernel(OCLKernel *kernel, OCLEvent *out_event=NULL) {
+		if (m_recorder) {
+			check_recordable(0, out_event);
+			m_recorder->record_kernel(*kernel);
+			return;
+		}
+
+		if (out_of_order()) {
+			enqueue_tracked_kernel(*kernel, std::vector<cl_event>(), out_event);
+			return;
+		}
+
 		cl_event e;
 		if (out_event) {
 			ocl_check_fast(
@@ -317,6 +518,17 @@ public:
 
 
 	inline void enqueue_ndrange_kernel(OCLKernel &kernel, std::vector<cl_event> &events_to_wait_on, OCLEvent *out_event=NULL) {
+		if (m_recorder) {
+			check_recordable((cl_uint) events_to_wait_on.size(), out_event);
+			m_recorder->record_kernel(kernel);
+			return;
+		}
+
+		if (out_of_order()) {
+			enqueue_tracked_kernel(kernel, events_to_wait_on, out_event);
+			return;
+		}
+
 		cl_event e;
 		if (out_event) {
 			ocl_check_fast(
@@ -333,6 +545,17 @@ public:
 	}
 
 	inline void enqueue_ndrange_kernel(OCLKernel *kernel, std::vector<cl_event> &events_to_wait_on, OCLEvent *out_event=NULL) {
+		if (m_recorder) {
+			check_recordable((cl_uint) events_to_wait_on.size(), out_event);
+			m_recorder->record_kernel(*kernel);
+			return;
+		}
+
+		if (out_of_order()) {
+			enqueue_tracked_kernel(*kernel, events_to_wait_on, out_event);
+			return;
+		}
+
 		cl_event e;
 		if (out_event) {
 			ocl_check_fast(
@@ -387,6 +610,35 @@ public:
 	
 protected:
 
+	//Launch on an out-of-order queue after waits and the commands that 
+	//conflict with the kernel's OCLBuffer arguments
+	inline void enqueue_tracked_kernel(OCLKernel &kernel, std::vector<cl_event> waits, OCLEvent *out_event) {
+		std::vector<OCLBuffer *> &buffers = kernel.m_args.buffers;
+		for (size_t i=0; i<buffers.size(); ++i) {
+			if (buffers[i]) buffers[i]->dependencies(waits, OCLKernel::writes(*buffers[i]));
+		}
+
+		OCLEvent evt;
+		OCLEvent *out = out_event ? out_event : &evt;
+		enqueue_ndrange_kernel(kernel.id(), kernel.m_num_dims, NULL, kernel.m_global_group_size, kernel.m_local_group_size,
+			(cl_uint) waits.size(), waits.empty() ? NULL : &waits[0], out);
+
+		for (size_t i=0; i<buffers.size(); ++i) {
+			if (buffers[i]) buffers[i]->record_access(out->id(), OCLKernel::writes(*buffers[i]));
+		}
+	}
+
+	inline static void check_recordable(cl_uint num_events, OCLEvent *event_out) {
+		if ((num_events > 0) || event_out) {
+			throw OCLError(CL_INVALID_OPERATION, "OCLCommandQueue: commands with wait lists or events cannot be recorded");
+		}
+	}
+
+	inline static std::vector<cl_event> wait_list(cl_uint num_events, const cl_event *events) {
+		if ((num_events == 0) || (events == NULL)) return std::vector<cl_event>();
+		return std::vector<cl_event>(events, events + num_events);
+	}
+
 	inline void query_info() {
 		ocl_get_info(m_id, CL_QUEUE_CONTEXT, m_context, cl_context,   clGetCommandQueueInfo);
 		ocl_get_info(m_id, CL_QUEUE_DEVICE,  m_device,  cl_device_id, clGetCommandQueueInfo);
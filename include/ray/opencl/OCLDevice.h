@@ -63,6 +63,9 @@ public:
 		ocl_get_info(m_id,CL_DEVICE_ERROR_CORRECTION_SUPPORT      , m_properties.error_correction_support      , cl_bool             , clGetDeviceInfo);
 		ocl_get_info(m_id,CL_DEVICE_PROFILING_TIMER_RESOLUTION    , m_properties.profiling_timer_resolution    , size_t			     , clGetDeviceInfo);
 		ocl_get_info(m_id,CL_DEVICE_ENDIAN_LITTLE                 , m_properties.endian_little                 , cl_bool             , clGetDeviceInfo);
+		//OpenCL 1.1 and later only. Left false on older devices.
+		m_properties.host_unified_memory = CL_FALSE;
+		clGetDeviceInfo(m_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &m_properties.host_unified_memory, NULL);
 		ocl_get_info(m_id,CL_DEVICE_AVAILABLE                     , m_properties.available                     , cl_bool             , clGetDeviceInfo);
 		ocl_get_info(m_id,CL_DEVICE_COMPILER_AVAILABLE            , m_properties.compiler_available            , cl_bool             , clGetDeviceInfo);
 		ocl_get_info(m_id,CL_DEVICE_EXECUTION_CAPABILITIES        , m_properties.execution_capabilities        , cl_device_exec_capabilities, clGetDeviceInfo);
@@ -0,0 +1,101 @@
+#ifndef _RAY_OPENCL_OCLHANDLETABLE_H_
+#define _RAY_OPENCL_OCLHANDLETABLE_H_
+
+/*
+ * Table of objects referenced by integer handles
+ *
+ * A handle holds the index of a slot in its low INDEX_BITS bits and the
+ * generation of the slot above them. The generation of a slot is increased
+ * whenever its object is removed, so a handle to a removed object no longer
+ * resolves, even after the slot has been reused for another object. Handles
+ * are positive and fit in an int (and exactly in a double).
+ *
+ * The table does not own the objects: remove() hands the pointer back and
+ * clear() only forgets them.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <vector>
+
+namespace ray { namespace opencl {
+
+template <typename T>
+class OCLHandleTable {
+public:
+	enum {
+		INDEX_BITS		= 20,
+		INDEX_MASK		= (1 << INDEX_BITS) - 1,
+		GENERATION_MASK	= (1 << (31 - INDEX_BITS)) - 1
+	};
+
+	std::vector<T *>			m_objects;		//Object in each slot (0 if free)
+	std::vector<unsigned int>	m_generations;	//Generation of each slot
+	std::vector<unsigned int>	m_free;			//Free slots
+
+public:
+	OCLHandleTable() { }
+
+	//Store object in a free slot and return its handle
+	inline unsigned int add(T *object) {
+		size_t idx = 0;
+		if (m_free.empty()) {
+			idx = m_objects.size();
+			if (idx > INDEX_MASK) throw OCLError(CL_OUT_OF_HOST_MEMORY, "OCLHandleTable: out of handles");
+
+			m_objects.push_back(object);
+			m_generations.push_back(1);
+		} else {
+			idx = m_free.back();
+			m_free.pop_back();
+			m_objects[idx] = object;
+		}
+		return (m_generations[idx] << INDEX_BITS) | (unsigned int) idx;
+	}
+
+	//Object of handle, or 0 if the handle is invalid or was removed
+	inline T *get(unsigned int handle) const {
+		size_t idx = handle & INDEX_MASK;
+		if ((handle >> 31) || (idx >= m_objects.size()) ||
+			(m_generations[idx] != (handle >> INDEX_BITS))) return 0;
+		return m_objects[idx];
+	}
+
+	//Remove the object of handle and return it (0 if the handle is invalid)
+	inline T *remove(unsigned int handle) {
+		T *object = get(handle);
+		if (object == 0) return 0;
+
+		size_t idx = handle & INDEX_MASK;
+		release_slot(idx);
+		return object;
+	}
+
+	//Number of slots. Slots hold 0 when free; see at().
+	inline size_t size() const {
+		return m_objects.size();
+	}
+
+	inline T *at(size_t idx) const {
+		return m_objects[idx];
+	}
+
+	//Forget all objects. Slot generations are kept, so handles issued
+	//before the call stay invalid afterwards.
+	inline void clear() {
+		for (size_t i=0; i<m_objects.size(); ++i) {
+			if (m_objects[i] != 0) release_slot(i);
+		}
+	}
+
+protected:
+	inline void release_slot(size_t idx) {
+		m_objects[idx] = 0;
+		m_generations[idx] = (m_generations[idx] + 1) & GENERATION_MASK;
+		if (m_generations[idx] == 0) m_generations[idx] = 1;
+		m_free.push_back((unsigned int) idx);
+	}
+};
+
+}}
+#endif
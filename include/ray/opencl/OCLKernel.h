@@ -16,23 +16,75 @@
 #include <ray/opencl/opencl.h>
 
 #include <string>
+#include <vector>
 #include <fstream>
 
 namespace ray{ namespace opencl {
 
+//Arguments last set on a kernel. OpenCL cannot query argument values, so
+//they are kept here for out-of-order queues and command graphs. The
+//buffers know the lists they are in (see OCLBuffer::bind), so a destroyed
+//buffer is cleared from them.
+typedef struct _OCLKernelArgs {
+	std::vector<OCLBuffer *>		buffers;	//OCLBuffer bound to each argument (0 for others)
+	std::vector<std::vector<char> >	values;		//Bytes of each argument (empty for local memory)
+	std::vector<size_t>				sizes;		//Size of each argument (0 if not set)
+
+	_OCLKernelArgs() { }
+
+	~_OCLKernelArgs() {
+		for (size_t i=0; i<buffers.size(); ++i) {
+			if (buffers[i]) buffers[i]->unbind(&buffers);
+		}
+	}
+
+private:
+	_OCLKernelArgs(const _OCLKernelArgs &);
+	_OCLKernelArgs &operator=(const _OCLKernelArgs &);
+} OCLKernelArgs;
+
+//Remember argument idx of a kernel: size bytes at value (0 for local
+//memory), and buffer if the argument is an OCLBuffer
+inline void ocl_store_arg(OCLKernelArgs *args, cl_uint idx, size_t size, const void *value, OCLBuffer *buffer) {
+	if (args == 0) return;
+	if (args->sizes.size() <= idx) {
+		args->buffers.resize(idx + 1, (OCLBuffer *) 0);
+		args->values.resize(idx + 1);
+		args->sizes.resize(idx + 1, 0);
+	}
+
+	OCLBuffer *old = args->buffers[idx];
+	args->buffers[idx] = buffer;
+	if (old != buffer) {
+		bool held = false;
+		for (size_t i=0; i<args->buffers.size(); ++i) held = held || (args->buffers[i] == old);
+		if (old && !held) old->unbind(&args->buffers);
+		if (buffer) buffer->bind(&args->buffers);
+	}
+
+	args->sizes[idx] = size;
+	if (value) {
+		args->values[idx].assign(static_cast<const char *>(value), static_cast<const char *>(value) + size);
+	} else {
+		args->values[idx].clear();
+	}
+}
+
 typedef struct _OCLKernel_WorkgroupInfo {
 	size_t		 work_group_size;
 	size_t		 compile_work_group_size[3];
 	cl_ulong	 local_mem_size;
+	size_t		 preferred_work_group_size_multiple;
 } OCLKernel_WorkgroupInfo;
 
 class OCLKernelSizeArg { 
 	cl_kernel m_kernel;
 	cl_uint	  m_index;	
 	size_t	  m_arg_size;
+	OCLKernelArgs *m_args;
 public:
-	OCLKernelSizeArg(cl_kernel id, cl_uint idx, size_t arg_size) : 
-		m_kernel(id), m_index(idx), m_arg_size(arg_size) {}
+	OCLKernelSizeArg(cl_kernel id, cl_uint idx, size_t arg_size, OCLKernelArgs *args = 0) : 
+		m_kernel(id), m_index(idx), m_arg_size(arg_size), m_args(args) {}
 
 	//Set the argument	
 	inline void *operator = (void *arg)
@@ -41,6 +93,7 @@ public:
 			clSetKernelArg(m_kernel, m_index, m_arg_size, arg),
 			"clSetKernelArg"
 		);
+		ocl_store_arg(m_args, m_index, m_arg_size, arg, 0);
 		return arg;
 	}
 };
@@ -48,10 +101,11 @@ public:
 class OCLKernelArg { 
 	cl_kernel m_kernel;
 	cl_uint	  m_index;
+	OCLKernelArgs *m_args;
 
 public:
-	OCLKernelArg(cl_kernel id, cl_uint idx) : 
-		m_kernel(id), m_index(idx){ }
+	OCLKernelArg(cl_kernel id, cl_uint idx, OCLKernelArgs *args = 0) : 
+		m_kernel(id), m_index(idx), m_args(args) { }
 
 	//Set the argument	
 	template <typename T>
@@ -61,6 +115,7 @@ public:
 			clSetKernelArg(m_kernel, m_index, sizeof(T), arg),
 			"clSetKernelArg"
 		);
+		ocl_store_arg(m_args, m_index, sizeof(T), arg, 0);
 		return arg;
 	}
 
@@ -70,6 +125,7 @@ public:
 			clSetKernelArg(m_kernel, m_index, sizeof(cl_mem), reinterpret_cast<void *>(arg.ptr())),
 			"clSetKernelArg"
 		);
+		ocl_store_arg(m_args, m_index, sizeof(cl_mem), arg.ptr(), &arg);
 		return arg;
 	}
 
@@ -79,6 +135,7 @@ public:
 			clSetKernelArg(m_kernel, m_index, sizeof(cl_mem), reinterpret_cast<void *>(arg->ptr())),
 			"clSetKernelArg"
 		);
+		ocl_store_arg(m_args, m_index, sizeof(cl_mem), arg->ptr(), arg);
 		return arg;
 	}
 };
@@ -97,13 +154,23 @@ public:
 	size_t		 m_global_group_size[3];
 	size_t		 m_local_group_size[3];
 
+	bool		 m_auto_size;		//Launch geometry is picked by auto_size()
+	cl_device_id m_auto_device;		//Device the values below were computed for
+	size_t		 m_auto_local_size;	//Work-group size to use on m_auto_device
+	cl_uint		 m_auto_compute_units;
+
+	//Arguments set through this object. Out-of-order queues make launches
+	//wait on the OCLBuffers among them; buffers passed as raw cl_mem are
+	//not tracked. A bound buffer must outlive the launches that use it.
+	OCLKernelArgs m_args;
+
 public:
-	OCLKernel() : OCLObject<cl_kernel>() { }
+	OCLKernel() : OCLObject<cl_kernel>(), m_auto_size(false), m_auto_device(0) { }
 
-	OCLKernel(cl_kernel id) : OCLObject<cl_kernel>(id) { query_info(); }
+	OCLKernel(cl_kernel id) : OCLObject<cl_kernel>(id), m_auto_size(false), m_auto_device(0) { query_info(); }
 
 	OCLKernel(cl_program prog, const char *name) :
-		m_program(prog), m_function_name(name) 
+		m_program(prog), m_function_name(name), m_auto_size(false), m_auto_device(0)
 	{
 		cl_int errcode  = CL_SUCCESS;
 		m_id = clCreateKernel(m_program, name, &errcode);
@@ -112,7 +179,7 @@ public:
 	
 
 	OCLKernel(OCLProgram &prog, const char *name) :
-		m_program(prog.id()), m_function_name(name) 
+		m_program(prog.id()), m_function_name(name), m_auto_size(false), m_auto_device(0)
 	{
 		cl_int errcode  = CL_SUCCESS;
 		m_id = clCreateKernel(m_program, name, &errcode);
@@ -120,7 +187,7 @@ public:
 	}
 
 	OCLKernel(OCLProgram *prog, const char *name) :
-		m_program(prog->id()), m_function_name(name) 
+		m_program(prog->id()), m_function_name(name), m_auto_size(false), m_auto_device(0)
 	{
 		cl_int errcode  = CL_SUCCESS;
 		m_id = clCreateKernel(m_program, name, &errcode);
@@ -137,7 +204,6 @@ public:
 
 	inline OCLKernel_WorkgroupInfo get_workgroup_info(cl_device_id device) {
 		OCLKernel_WorkgroupInfo w;
-		cl_int errcode = CL_SUCCESS;
 		w.compile_work_group_size[0] = 0;
 		w.compile_work_group_size[1] = 0;
 		w.compile_work_group_size[2] = 0;
@@ -160,6 +226,10 @@ public:
 			"clGetKernelWorkGroupInfo -- CL_KERNEL_LOCAL_MEM_SIZE"
 		);
 
+		//OpenCL 1.1 and later only. Left at 1 on older devices.
+		w.preferred_work_group_size_multiple = 1;
+		clGetKernelWorkGroupInfo(m_id, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &w.preferred_work_group_size_multiple, NULL);
+
 		return w;
 	}
 
@@ -167,6 +237,12 @@ public:
 		ocl_check_fast(
 			clSetKernelArg(m_id, idx, byte_size, value),
 			"clSetKernelArg");
+		ocl_store_arg(&m_args, idx, byte_size, value, 0);
+	}
+
+	//True if launches write buffer: buffers created read-only are only read
+	inline static bool writes(const OCLBuffer &buffer) {
+		return (buffer.m_flags & CL_MEM_READ_ONLY) == 0;
 	}
 
 	inline void set_ndims(cl_uint n) {  
@@ -190,16 +266,53 @@ public:
 		m_local_group_size[2]=x3;	
 	}
 
+	inline void set_auto_size(bool enable) {
+		m_auto_size = enable;
+	}
+
+	//Pick a 1-D launch geometry covering num_items work-items on device:
+	//the largest work-group size the kernel allows (up to 256), rounded to
+	//the preferred multiple, and enough groups to cover num_items. When 
+	//num_items is unknown (0), a few groups per compute unit are launched.
+	inline void auto_size(cl_device_id device, size_t num_items) {
+		if (device != m_auto_device) {
+			OCLKernel_WorkgroupInfo w = get_workgroup_info(device);
+			ocl_get_info(device, CL_DEVICE_MAX_COMPUTE_UNITS, m_auto_compute_units, cl_uint, clGetDeviceInfo);
+
+			size_t local = w.work_group_size;
+			if (local > 256) local = 256;
+
+			size_t multiple = w.preferred_work_group_size_multiple;
+			if ((multiple > 1) && (local >= multiple)) local -= local % multiple;
+
+			//Kernels declared with reqd_work_group_size must use that size
+			if (w.compile_work_group_size[0] > 0) local = w.compile_work_group_size[0];
+			if (local < 1) local = 1;
+
+			m_auto_local_size = local;
+			m_auto_device = device;
+		}
+
+		size_t local = m_auto_local_size;
+		size_t groups = (num_items + local - 1) / local;
+		if (groups == 0) groups = 4 * m_auto_compute_units;
+		if (groups == 0) groups = 1;
+
+		set_ndims(1);
+		set_local_size(local, 0, 0);
+		set_global_size(groups * local, 0, 0);
+	}
+
 	inline OCLKernelArg operator() (cl_uint idx) {		
-		return OCLKernelArg(m_id, idx);
+		return OCLKernelArg(m_id, idx, &m_args);
 	}
 
 	inline OCLKernelSizeArg operator() (cl_uint idx, cl_uint size) {		
-		return OCLKernelSizeArg(m_id, idx, size);
+		return OCLKernelSizeArg(m_id, idx, size, &m_args);
 	}
 
 	inline OCLKernelArg operator[] (cl_uint idx) {		
-		return OCLKernelArg(m_id, idx);
+		return OCLKernelArg(m_id, idx, &m_args);
 	}
 
 };
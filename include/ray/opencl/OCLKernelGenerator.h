@@ -0,0 +1,361 @@
+#ifndef _RAY_OPENCL_OCLKERNELGENERATOR_H_
+#define _RAY_OPENCL_OCLKERNELGENERATOR_H_
+
+/*
+ * Source generator for the elementwise kernels used by clobject
+ *
+ * Emits <type>_<op>, <type>_scalar_<op> and <type>_<op>_scalar kernels
+ * (plus the _v4 and _v8 vector variants) for every operation of ops() and
+ * element type of types(), with the names and arguments of the kernels in
+ * cl/matlab_kernels_float.cl. Adding an operation is one entry in ops().
+ *
+ * Integer kernels follow MATLAB: results saturate at the limits of the type
+ * and are rounded to the nearest integer, halves away from zero. Operations
+ * on two arrays are computed exactly in integer arithmetic. A scalar
+ * operand is a double in MATLAB, so the scalar kernels of 8 and 16 bit
+ * types take it as float and those of 32 bit types as double, compute in
+ * that type and round the result; the 32 bit ones are only compiled on
+ * devices with double precision. double cannot hold every 64 bit integer:
+ * 64 bit scalar kernels take the scalar in the element type and callers
+ * must only pass integral scalars. Operations without an integer
+ * expression, such as exp, are only generated for single and double.
+ *
+ * double kernels are only compiled on devices with cl_khr_fp64 or
+ * cl_amd_fp64, as in cl/matlab_kernels_double.cl.
+ *
+ * The generated source defines the same kernels as those files, so it is
+ * added instead of them, not together with them.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+namespace ray { namespace opencl {
+
+typedef struct _OCLElementType {
+	const char *name;			//MATLAB class, used as the kernel name prefix
+	const char *cl_type;		//OpenCL scalar type
+	const char *scalar_type;	//Type of scalar operands, in which results with them are computed
+	const char *min;			//Limits of integer types (0 for floating point)
+	const char *max;
+} OCLElementType;
+
+typedef struct _OCLElementOp {
+	const char *name;
+	int			num_args;	//1 or 2 operands
+	const char *float_expr;	//Result from operands a and b for floating point types, and from
+							//real operands for integer scalar kernels
+	const char *int_expr;	//Result for integer types, 0 if not defined. $T is the element
+							//type, with the vector width.
+} OCLElementOp;
+
+class OCLKernelGenerator {
+public:
+	inline static const OCLElementType *types(size_t &count) {
+		static const OCLElementType t[] = {
+			{"int8",	"char",		"float",	"CHAR_MIN",	"CHAR_MAX"},
+			{"uint8",	"uchar",	"float",	"0",		"UCHAR_MAX"},
+			{"int16",	"short",	"float",	"SHRT_MIN",	"SHRT_MAX"},
+			{"uint16",	"ushort",	"float",	"0",		"USHRT_MAX"},
+			{"int32",	"int",		"double",	"INT_MIN",	"INT_MAX"},
+			{"uint32",	"uint",		"double",	"0",		"UINT_MAX"},
+			{"int64",	"long",		"long",		"LONG_MIN",	"LONG_MAX"},
+			{"uint64",	"ulong",	"ulong",	"0",		"ULONG_MAX"},
+			{"single",	"float",	"float",	0,			0},
+			{"double",	"double",	"double",	0,			0}
+		};
+		count = sizeof(t) / sizeof(t[0]);
+		return t;
+	}
+
+	inline static const OCLElementOp *ops(size_t &count) {
+		static const OCLElementOp o[] = {
+			{"add",			2, "a + b",		"add_sat(a, b)"},
+			{"minus",		2, "a - b",		"sub_sat(a, b)"},
+			{"times",		2, "a * b",		"oclgen_times_$T(a, b)"},
+			{"divide",		2, "a / b",		"oclgen_divide_$T(a, b)"},
+			{"exponential",	1, "exp(a)",	0}
+		};
+		count = sizeof(o) / sizeof(o[0]);
+		return o;
+	}
+
+	//Kernels for all types
+	inline static std::string elementwise() {
+		return elementwise(std::vector<std::string>());
+	}
+
+	//Kernels for the listed types (MATLAB class names), or all if empty
+	inline static std::string elementwise(const std::vector<std::string> &type_names) {
+		size_t num_types = 0;
+		const OCLElementType *t = types(num_types);
+
+		for (size_t i=0; i<type_names.size(); ++i) {
+			if (find_type(type_names[i]) == 0) {
+				std::string msg = "OCLKernelGenerator: unknown element type " + type_names[i];
+				throw OCLError(CL_INVALID_VALUE, msg.c_str());
+			}
+		}
+
+		std::ostringstream src;
+		src << "#if defined(cl_khr_fp64)\n"
+			<< "#  pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+			<< "#  define OCLGEN_FP64\n"
+			<< "#elif defined(cl_amd_fp64)\n"
+			<< "#  pragma OPENCL EXTENSION cl_amd_fp64 : enable\n"
+			<< "#  define OCLGEN_FP64\n"
+			<< "#endif\n\n";
+
+		for (size_t i=0; i<num_types; ++i) {
+			if (!type_names.empty() && !contains(type_names, t[i].name)) continue;
+
+			if (std::string(t[i].cl_type) == "double") {
+				src << "#ifdef OCLGEN_FP64\n";
+				type_kernels(src, t[i]);
+				src << "#endif\n\n";
+			} else {
+				type_kernels(src, t[i]);
+			}
+		}
+		return src.str();
+	}
+
+	inline static const OCLElementType *find_type(const std::string &name) {
+		size_t num_types = 0;
+		const OCLElementType *t = types(num_types);
+		for (size_t i=0; i<num_types; ++i) {
+			if (name == t[i].name) return &t[i];
+		}
+		return 0;
+	}
+
+protected:
+	//Operand layouts of the binary kernels: both arrays, scalar first, scalar second
+	enum { ARRAY_ARRAY, SCALAR_ARRAY, ARRAY_SCALAR };
+
+	inline static void type_kernels(std::ostringstream &src, const OCLElementType &type) {
+		static const int widths[] = {1, 4, 8};
+		static const size_t num_widths = sizeof(widths) / sizeof(widths[0]);
+
+		size_t num_ops = 0;
+		const OCLElementOp *o = ops(num_ops);
+		bool integer = (type.max != 0);
+
+		if (integer) {
+			for (size_t w=0; w<num_widths; ++w) int_helpers(src, type, widths[w]);
+		}
+
+		for (size_t w=0; w<num_widths; ++w) {
+			for (size_t i=0; i<num_ops; ++i) {
+				const char *expr = integer ? o[i].int_expr : o[i].float_expr;
+				if (expr == 0) continue;
+
+				if (o[i].num_args == 1) {
+					kernel(src, type, o[i], widths[w], -1);
+				} else {
+					kernel(src, type, o[i], widths[w], ARRAY_ARRAY);
+				}
+			}
+		}
+
+		//Scalar operands in double need double precision
+		bool fp64 = (std::string(type.scalar_type) == "double") && (std::string(type.cl_type) != "double");
+		if (fp64) src << "#ifdef OCLGEN_FP64\n";
+		for (size_t w=0; w<num_widths; ++w) {
+			for (size_t i=0; i<num_ops; ++i) {
+				const char *expr = integer ? o[i].int_expr : o[i].float_expr;
+				if ((expr == 0) || (o[i].num_args == 1)) continue;
+
+				kernel(src, type, o[i], widths[w], SCALAR_ARRAY);
+				kernel(src, type, o[i], widths[w], ARRAY_SCALAR);
+			}
+		}
+		if (fp64) src << "#endif\n\n";
+	}
+
+	//Exact products and quotients of an integer type (see ops()), rounded and
+	//saturated like MATLAB. The vector forms apply the scalar ones per element.
+	inline static void int_helpers(std::ostringstream &src, const OCLElementType &type, int width) {
+		std::string T = type.cl_type;
+		bool is_unsigned = (T[0] == 'u');
+
+		if (width > 1) {
+			static const char *names[] = {"times", "divide"};
+			std::string TW = vector_type(T, width);
+			std::string W = to_string(width);
+
+			for (size_t i=0; i<sizeof(names)/sizeof(names[0]); ++i) {
+				std::string f = std::string("oclgen_") + names[i] + "_";
+				src << TW << " " << f << TW << "(" << TW << " a, " << TW << " b) {\n"
+					<< "  " << T << " x[" << W << "], y[" << W << "];\n"
+					<< "  vstore" << W << "(a, 0, x);\n"
+					<< "  vstore" << W << "(b, 0, y);\n"
+					<< "  for (int i = 0; i < " << W << "; ++i) x[i] = " << f << T << "(x[i], y[i]);\n"
+					<< "  return vload" << W << "(0, x);\n"
+					<< "}\n\n";
+			}
+			return;
+		}
+
+		std::string h;
+
+		//Products of up to 32 bits fit in 64; 64 bit ones overflow unless the
+		//high half is the sign extension of the low half
+		if ((T != "long") && (T != "ulong")) {
+			h = "$T oclgen_times_$T($T a, $T b) {\n"
+				"  return convert_$T_sat(($W) a * ($W) b);\n"
+				"}\n\n";
+		} else if (is_unsigned) {
+			h = "$T oclgen_times_$T($T a, $T b) {\n"
+				"  return (mul_hi(a, b) != 0) ? $MAX : a * b;\n"
+				"}\n\n";
+		} else {
+			h = "$T oclgen_times_$T($T a, $T b) {\n"
+				"  $T lo = as_long(as_ulong(a) * as_ulong(b));\n"
+				"  if (mul_hi(a, b) == ((lo < 0) ? -1 : 0)) return lo;\n"
+				"  return ((a < 0) != (b < 0)) ? $MIN : $MAX;\n"
+				"}\n\n";
+		}
+
+		//Quotients: truncated, then moved away from zero if the remainder is
+		//at least half the divisor. x/0 saturates, 0/0 is 0.
+		if (is_unsigned) {
+			h += "$T oclgen_divide_$T($T a, $T b) {\n"
+				 "  if (b == 0) return (a > 0) ? $MAX : 0;\n"
+				 "  $T q = a / b;\n"
+				 "  $T r = a - q * b;\n"
+				 "  if (r >= b - r) ++q;\n"
+				 "  return q;\n"
+				 "}\n\n";
+		} else {
+			h += "$T oclgen_divide_$T($T a, $T b) {\n"
+				 "  if (b == 0) return (a > 0) ? $MAX : ((a < 0) ? $MIN : 0);\n"
+				 "  if ((a == $MIN) && (b == -1)) return $MAX;\n"
+				 "  $T q = a / b;\n"
+				 "  $U r = abs(($T) (a - q * b));\n"
+				 "  if (r >= abs(b) - r) q += ((a < 0) != (b < 0)) ? -1 : 1;\n"
+				 "  return q;\n"
+				 "}\n\n";
+		}
+
+		replace_all(h, "$T", T);
+		replace_all(h, "$U", is_unsigned ? T : "u" + T);
+		replace_all(h, "$W", is_unsigned ? "ulong" : "long");
+		replace_all(h, "$MIN", type.min);
+		replace_all(h, "$MAX", type.max);
+		src << h;
+	}
+
+	//One kernel. layout is -1 for unary operations.
+	inline static void kernel(std::ostringstream &src, const OCLElementType &type, const OCLElementOp &op,
+		int width, int layout)
+	{
+		std::string T = type.cl_type;
+		std::string TW = vector_type(T, width);
+		std::string S = type.scalar_type;
+
+		//Integer kernels with a real scalar compute in the scalar's type and
+		//round the result
+		bool integer = (type.max != 0);
+		bool scalar = (layout == SCALAR_ARRAY) || (layout == ARRAY_SCALAR);
+		std::string R = (integer && scalar) ? S : T;
+		std::string expr;
+		if (!integer) {
+			expr = op.float_expr;
+		} else if (R != T) {
+			expr = std::string("convert_$T_sat(round(") + op.float_expr + "))";
+		} else {
+			expr = op.int_expr;
+		}
+
+		std::string name = std::string(type.name) + "_";
+		if (layout == SCALAR_ARRAY) name += "scalar_";
+		name += op.name;
+		if (layout == ARRAY_SCALAR) name += "_scalar";
+		if (width > 1) name += "_v" + to_string(width);
+
+		src << "__kernel void " << name << "(__global " << T << " *out, ";
+		switch (layout) {
+			case ARRAY_ARRAY:	src << "__global const " << T << " *x, __global const " << T << " *y, "; break;
+			case SCALAR_ARRAY:	src << S << " w, __global const " << T << " *x, "; break;
+			case ARRAY_SCALAR:	src << "__global const " << T << " *x, " << S << " w, "; break;
+			default:			src << "__global const " << T << " *x, "; break;
+		}
+		src << "int N) {\n";
+
+		std::string start = "get_global_id(0)";
+		if (width > 1) {
+			std::string W = to_string(width);
+			src << "  int nvec = N / " << W << ";\n"
+				<< "  for (int id = get_global_id(0); id < nvec; id += get_global_size(0)) {\n"
+				<< operands(layout, vector_type(R, width), load(T, R, width, "vload" + W + "(id, x)"),
+					load(T, R, width, "vload" + W + "(id, y)"))
+				<< "    vstore" << W << "(" << expand(expr, TW) << ", id, out);\n"
+				<< "  }\n";
+			start = "nvec*" + W + " + get_global_id(0)";
+		}
+
+		src << "  for (int id = " << start << "; id < N; id += get_global_size(0)) {\n"
+			<< operands(layout, R, load(T, R, 1, "x[id]"), load(T, R, 1, "y[id]"))
+			<< "    out[id] = " << expand(expr, T) << ";\n"
+			<< "  }\n"
+			<< "}\n\n";
+	}
+
+	//Declarations of operands a and b. A scalar operand w is broadcast.
+	inline static std::string operands(int layout, const std::string &type, const std::string &x, const std::string &y) {
+		std::string w = "(" + type + ")(w)";
+		switch (layout) {
+			case ARRAY_ARRAY:	return decl(type, "a", x) + decl(type, "b", y);
+			case SCALAR_ARRAY:	return decl(type, "a", w) + decl(type, "b", x);
+			case ARRAY_SCALAR:	return decl(type, "a", x) + decl(type, "b", w);
+			default:			return decl(type, "a", x);
+		}
+	}
+
+	//Array element(s) value of type T, converted to R
+	inline static std::string load(const std::string &T, const std::string &R, int width, const std::string &value) {
+		if (R == T) return value;
+		return "convert_" + vector_type(R, width) + "(" + value + ")";
+	}
+
+	inline static std::string decl(const std::string &type, const char *var, const std::string &value) {
+		return "    " + type + " " + var + " = " + value + ";\n";
+	}
+
+	inline static std::string vector_type(const std::string &type, int width) {
+		if (type.empty() || (width == 1)) return type;
+		return type + to_string(width);
+	}
+
+	inline static std::string expand(const std::string &expr, const std::string &T) {
+		std::string s(expr);
+		replace_all(s, "$T", T);
+		return s;
+	}
+
+	inline static void replace_all(std::string &s, const std::string &from, const std::string &to) {
+		for (size_t pos = s.find(from); pos != std::string::npos; pos = s.find(from, pos + to.size())) {
+			s.replace(pos, from.size(), to);
+		}
+	}
+
+	inline static std::string to_string(int value) {
+		std::ostringstream s;
+		s << value;
+		return s.str();
+	}
+
+	inline static bool contains(const std::vector<std::string> &names, const char *name) {
+		for (size_t i=0; i<names.size(); ++i) {
+			if (names[i] == name) return true;
+		}
+		return false;
+	}
+};
+
+}}
+#endif
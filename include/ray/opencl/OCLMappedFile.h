@@ -0,0 +1,220 @@
+#ifndef _RAY_OPENCL_OCLMAPPEDFILE_H_
+#define _RAY_OPENCL_OCLMAPPEDFILE_H_
+
+/*
+ * Memory-mapped file for feeding files to and from device buffers
+ *
+ * Maps a window of a file into the address space, so transfers can read
+ * from (or write into) the page cache directly instead of going through
+ * an intermediate host array. Only one window is mapped at a time; map()
+ * replaces the previous window. The window may start at any offset, the
+ * alignment the system requires is handled internally.
+ *
+ * Files opened READ_WRITE with a size are created if missing and grown to
+ * that size if shorter. COPY_ON_WRITE maps the file writable but
+ * private: writes go to copies of the pages and never reach the file,
+ * which is only opened for reading (e.g. for CL_MEM_USE_HOST_PTR buffers
+ * over a file, which kernels may write). The pointers returned by map()
+ * stay valid until the next map(), unmap() or close(); commands reading
+ * from or writing to them must have completed by then.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <string>
+
+#if defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+namespace ray { namespace opencl {
+
+class OCLMappedFile {
+public:
+	enum Mode { READ_ONLY, READ_WRITE, COPY_ON_WRITE };
+
+	std::string		m_path;
+	Mode			m_mode;
+	cl_ulong		m_size;			//Size of the file in bytes
+
+protected:
+	void		   *m_view;			//Start of the mapped window (aligned), 0 if none
+	size_t			m_view_size;	//Bytes mapped at m_view
+	size_t			m_view_skip;	//Bytes between m_view and the requested offset
+
+#if defined(_WIN32)
+	HANDLE			m_file;
+	HANDLE			m_mapping;
+#else
+	int				m_file;
+#endif
+
+public:
+	OCLMappedFile(const char *path, Mode mode = READ_ONLY, cl_ulong size = 0) :
+		m_path(path), m_mode(mode), m_size(0), m_view(0), m_view_size(0), m_view_skip(0)
+	{
+#if defined(_WIN32)
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = NULL;
+#else
+		m_file = -1;
+#endif
+		open(size);
+	}
+
+	~OCLMappedFile() {
+		close();
+	}
+
+	inline cl_ulong size() const {
+		return m_size;
+	}
+
+	//Map num_bytes starting at byte offset of the file and return a pointer
+	//to the byte at offset. num_bytes = 0 maps up to the end of the file.
+	inline void *map(cl_ulong offset, size_t num_bytes = 0) {
+		if (offset > m_size) throw OCLError(CL_INVALID_VALUE, "OCLMappedFile::map: offset past the end of the file");
+		if (num_bytes == 0) num_bytes = (size_t) (m_size - offset);
+		if (num_bytes > m_size - offset) throw OCLError(CL_INVALID_VALUE, "OCLMappedFile::map: range past the end of the file");
+
+		unmap();
+		if (num_bytes == 0) return 0;
+
+		cl_ulong start = offset - offset % granularity();
+		m_view_skip = (size_t) (offset - start);
+		m_view_size = num_bytes + m_view_skip;
+
+#if defined(_WIN32)
+		DWORD access = (m_mode == READ_WRITE) ? FILE_MAP_WRITE : ((m_mode == COPY_ON_WRITE) ? FILE_MAP_COPY : FILE_MAP_READ);
+		m_view = MapViewOfFile(m_mapping, access, (DWORD) (start >> 32), (DWORD) (start & 0xffffffff), m_view_size);
+		if (m_view == NULL) {
+			m_view = 0;
+			throw OCLError(CL_MAP_FAILURE, "OCLMappedFile::map: MapViewOfFile failed");
+		}
+#else
+		int prot = (m_mode == READ_ONLY) ? PROT_READ : (PROT_READ | PROT_WRITE);
+		int flags = (m_mode == COPY_ON_WRITE) ? MAP_PRIVATE : MAP_SHARED;
+		void *p = mmap(NULL, m_view_size, prot, flags, m_file, (off_t) start);
+		if (p == MAP_FAILED) throw OCLError(CL_MAP_FAILURE, "OCLMappedFile::map: mmap failed");
+		m_view = p;
+
+		//Windows are usually read once, front to back
+		madvise(m_view, m_view_size, MADV_SEQUENTIAL);
+#endif
+		return static_cast<char *>(m_view) + m_view_skip;
+	}
+
+	//Pointer returned by the last map(), or 0 if nothing is mapped
+	inline void *data() {
+		return m_view ? static_cast<char *>(m_view) + m_view_skip : 0;
+	}
+
+	inline void unmap() {
+		if (m_view == 0) return;
+#if defined(_WIN32)
+		UnmapViewOfFile(m_view);
+#else
+		munmap(m_view, m_view_size);
+#endif
+		m_view = 0;
+		m_view_size = 0;
+		m_view_skip = 0;
+	}
+
+	inline void close() {
+		unmap();
+#if defined(_WIN32)
+		if (m_mapping != NULL) CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+		m_mapping = NULL;
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_file >= 0) ::close(m_file);
+		m_file = -1;
+#endif
+	}
+
+protected:
+	inline void open(cl_ulong size) {
+		bool resize = (m_mode == READ_WRITE) && (size > 0);
+
+#if defined(_WIN32)
+		DWORD access = (m_mode == READ_WRITE) ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+		DWORD creation = resize ? OPEN_ALWAYS : OPEN_EXISTING;
+		m_file = CreateFileA(m_path.c_str(), access, FILE_SHARE_READ, NULL, creation, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) throw OCLError(CL_INVALID_VALUE, "OCLMappedFile: cannot open file");
+
+		LARGE_INTEGER sz;
+		if (!GetFileSizeEx(m_file, &sz)) {
+			close();
+			throw OCLError(CL_INVALID_VALUE, "OCLMappedFile: cannot read file size");
+		}
+		m_size = (cl_ulong) sz.QuadPart;
+
+		if (resize && (m_size < size)) {
+			sz.QuadPart = (LONGLONG) size;
+			if (!SetFilePointerEx(m_file, sz, NULL, FILE_BEGIN) || !SetEndOfFile(m_file)) {
+				close();
+				throw OCLError(CL_INVALID_VALUE, "OCLMappedFile: cannot resize file");
+			}
+			m_size = size;
+		}
+
+		//Empty files cannot be mapped; map() returns 0 for them
+		if (m_size > 0) {
+			DWORD protect = (m_mode == READ_WRITE) ? PAGE_READWRITE : ((m_mode == COPY_ON_WRITE) ? PAGE_WRITECOPY : PAGE_READONLY);
+			m_mapping = CreateFileMappingA(m_file, NULL, protect, 0, 0, NULL);
+			if (m_mapping == NULL) {
+				close();
+				throw OCLError(CL_MAP_FAILURE, "OCLMappedFile: CreateFileMapping failed");
+			}
+		}
+#else
+		int flags = (m_mode == READ_WRITE) ? O_RDWR : O_RDONLY;
+		if (resize) flags |= O_CREAT;
+		m_file = ::open(m_path.c_str(), flags, 0644);
+		if (m_file < 0) throw OCLError(CL_INVALID_VALUE, "OCLMappedFile: cannot open file");
+
+		struct stat st;
+		if (fstat(m_file, &st) != 0) {
+			close();
+			throw OCLError(CL_INVALID_VALUE, "OCLMappedFile: cannot read file size");
+		}
+		m_size = (cl_ulong) st.st_size;
+
+		if (resize && (m_size < size)) {
+			if (ftruncate(m_file, (off_t) size) != 0) {
+				close();
+				throw OCLError(CL_INVALID_VALUE, "OCLMappedFile: cannot resize file");
+			}
+			m_size = size;
+		}
+#endif
+	}
+
+	//Alignment of the file offset of a mapping
+	inline static cl_ulong granularity() {
+#if defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity;
+#else
+		return (cl_ulong) sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+private:
+	OCLMappedFile(const OCLMappedFile &);
+	OCLMappedFile &operator=(const OCLMappedFile &);
+};
+
+}}
+#endif
@@ -0,0 +1,225 @@
+#ifndef _RAY_OPENCL_OCLPROFILER_H_
+#define _RAY_OPENCL_OCLPROFILER_H_
+
+/*
+ * OpenCL command profiler
+ *
+ * Keeps the events of recorded commands (kernel launches, transfers)
+ * together with a name, the index of the device and the number of bytes
+ * moved. Timestamps are read when the records are collected, after the
+ * commands have completed. The queues the events come from must be created
+ * with CL_QUEUE_PROFILING_ENABLE.
+ *
+ * At most m_max_records commands are kept; later ones are counted in
+ * m_dropped until the records are cleared. Host spans have the same limit
+ * and their own count, m_dropped_host.
+ *
+ * Host-side spans (e.g. the time spent dispatching a call) can be recorded
+ * as well. write_trace() writes everything as a Chrome Trace Event Format
+ * JSON file, with one track for the host and one per device. Device
+ * timestamps are moved onto the host clock using the host time at which
+ * each command was recorded.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+
+#if defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+namespace ray { namespace opencl {
+
+typedef struct _OCLProfileRecord {
+	std::string		name;		//Kernel function name, or "upload"/"download" for transfers
+	cl_uint			device;		//Index of the device (queue) the command ran on
+	size_t			bytes;		//Bytes moved between host and device (0 for kernels)
+	OCLEvent		event;		//Event of the command
+	cl_ulong		host_time;	//Host clock (ns) when the command was recorded
+} OCLProfileRecord;
+
+typedef struct _OCLHostSpan {
+	std::string		name;
+	cl_ulong		start;		//Host clock (ns)
+	cl_ulong		end;
+} OCLHostSpan;
+
+class OCLProfiler {
+public:
+	std::vector<OCLProfileRecord *>		m_records;
+	std::vector<OCLHostSpan>			m_host_spans;
+	size_t								m_max_records;	//Limit for m_records and for m_host_spans
+	size_t								m_dropped;		//Commands not recorded since the last clear()
+	size_t								m_dropped_host;	//Host spans not recorded since the last clear()
+
+public:
+	OCLProfiler(size_t max_records = 65536) : m_max_records(max_records), m_dropped(0), m_dropped_host(0) { }
+	~OCLProfiler() { clear(); }
+
+	inline void record(const std::string &name, cl_uint device, size_t bytes, OCLEvent &event) {
+		if (!event.id()) return;
+
+		if (m_records.size() >= m_max_records) {
+			++m_dropped;
+			return;
+		}
+
+		//The record holds its own reference to the event
+		ocl_check(clRetainEvent(event.id()), "clRetainEvent");
+
+		OCLProfileRecord *r = new OCLProfileRecord;
+		r->name = name;
+		r->device = device;
+		r->bytes = bytes;
+		r->event.assign(event.id());
+		r->host_time = host_time();
+		m_records.push_back(r);
+	}
+
+	inline void record_host(const std::string &name, cl_ulong start, cl_ulong end) {
+		if (m_host_spans.size() >= m_max_records) {
+			++m_dropped_host;
+			return;
+		}
+
+		OCLHostSpan s;
+		s.name = name;
+		s.start = start;
+		s.end = end;
+		m_host_spans.push_back(s);
+	}
+
+	//Timestamps of record i (ns, device clock). Waits for the command.
+	inline OCLEventProfile times(size_t i) {
+		m_records[i]->event.wait();
+		return m_records[i]->event.get_times();
+	}
+
+	inline size_t size() const {
+		return m_records.size();
+	}
+
+	inline void clear() {
+		for (size_t i=0; i<m_records.size(); ++i) delete m_records[i];
+		m_records.clear();
+		m_host_spans.clear();
+		m_dropped = 0;
+		m_dropped_host = 0;
+	}
+
+	//Monotonic host clock in nanoseconds
+	inline static cl_ulong host_time() {
+#if defined(_WIN32)
+		LARGE_INTEGER freq, count;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&count);
+		return (cl_ulong) ((double) count.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (cl_ulong) ts.tv_sec * 1000000000ULL + (cl_ulong) ts.tv_nsec;
+#endif
+	}
+
+	//Write all records as Chrome Trace Event Format JSON (open with
+	//chrome://tracing or Perfetto). Waits for the recorded commands.
+	//Records are kept. Returns false if the file could not be written.
+	inline bool write_trace(const char *path) {
+		//Device clock to host clock: commands are recorded right after they
+		//are enqueued, so the smallest host - queued difference is the
+		//closest estimate of the offset.
+		std::vector<OCLEventProfile> t(m_records.size());
+		std::map<cl_uint, cl_long> offset;
+		for (size_t i=0; i<m_records.size(); ++i) {
+			t[i] = times(i);
+			cl_long d = (cl_long) m_records[i]->host_time - (cl_long) t[i].time_queued;
+
+			std::map<cl_uint, cl_long>::iterator it = offset.find(m_records[i]->device);
+			if ((it == offset.end()) || (d < it->second)) offset[m_records[i]->device] = d;
+		}
+
+		//Timestamps in microseconds, relative to the first event
+		cl_ulong origin = 0;
+		bool has_origin = false;
+		for (size_t i=0; i<m_host_spans.size(); ++i) {
+			if (!has_origin || (m_host_spans[i].start < origin)) origin = m_host_spans[i].start;
+			has_origin = true;
+		}
+		for (size_t i=0; i<m_records.size(); ++i) {
+			cl_ulong q = (cl_ulong) ((cl_long) t[i].time_queued + offset[m_records[i]->device]);
+			if (!has_origin || (q < origin)) origin = q;
+			has_origin = true;
+		}
+
+		std::ofstream file(path, std::ios_base::out | std::ios_base::trunc);
+		if (!file.is_open()) return false;
+		file.precision(15);
+
+		file << "{\"traceEvents\":[\n";
+		file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Host\"}}";
+
+		std::map<cl_uint, cl_long>::iterator it;
+		for (it = offset.begin(); it != offset.end(); ++it) {
+			file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << (it->first + 1)
+				 << ",\"args\":{\"name\":\"Device " << (it->first + 1) << " queue\"}}";
+		}
+
+		for (size_t i=0; i<m_host_spans.size(); ++i) {
+			const OCLHostSpan &s = m_host_spans[i];
+			file << ",\n{\"name\":\"" << escape(s.name) << "\",\"cat\":\"host\",\"ph\":\"X\",\"pid\":1,\"tid\":0"
+				 << ",\"ts\":" << (s.start - origin) / 1000.0
+				 << ",\"dur\":" << (s.end - s.start) / 1000.0 << "}";
+		}
+
+		for (size_t i=0; i<m_records.size(); ++i) {
+			OCLProfileRecord *r = m_records[i];
+			cl_long off = offset[r->device];
+			cl_ulong start = (cl_ulong) ((cl_long) t[i].time_start + off);
+
+			file << ",\n{\"name\":\"" << escape(r->name) << "\",\"cat\":\"" << category(r->event.get_cmd_type())
+				 << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (r->device + 1)
+				 << ",\"ts\":" << (start - origin) / 1000.0
+				 << ",\"dur\":" << (t[i].time_end - t[i].time_start) / 1000.0
+				 << ",\"args\":{\"bytes\":" << r->bytes
+				 << ",\"queued_to_start_us\":" << (t[i].time_start - t[i].time_queued) / 1000.0 << "}}";
+		}
+
+		file << "\n]}\n";
+		return file.good();
+	}
+
+protected:
+	inline static const char *category(cl_command_type type) {
+		switch (type) {
+			case CL_COMMAND_NDRANGE_KERNEL:		return "kernel";
+			case CL_COMMAND_READ_BUFFER:
+			case CL_COMMAND_MAP_BUFFER:			return "read";
+			case CL_COMMAND_WRITE_BUFFER:
+			case CL_COMMAND_UNMAP_MEM_OBJECT:	return "write";
+			case CL_COMMAND_COPY_BUFFER:		return "copy";
+			default:							return "other";
+		}
+	}
+
+	inline static std::string escape(const std::string &text) {
+		std::string s;
+		for (size_t i=0; i<text.size(); ++i) {
+			char c = text[i];
+			if ((c == '"') || (c == '\\')) s += '\\';
+			if (static_cast<unsigned char>(c) < 0x20) c = ' ';
+			s += c;
+		}
+		return s;
+	}
+};
+
+}}
+#endif
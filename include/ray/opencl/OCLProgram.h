@@ -18,6 +18,7 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <cstdio>
 
 namespace ray{ namespace opencl {
 
@@ -60,14 +61,17 @@ public:
 	std::vector<OCLProgram_BuildInfo>		m_build_status;
 	cl_uint									m_refcount;
 
+	std::string								m_cache_dir;	//Directory of cached binaries (empty = no caching)
+	int										m_from_cache;	//Non-zero if the last build used cached binaries
+
 public:
-	OCLProgram(cl_program prog) : OCLObject<cl_program>(prog) {
+	OCLProgram(cl_program prog) : OCLObject<cl_program>(prog), m_from_cache(0) {
 		query_info();	
 	}
 
-	OCLProgram(cl_context context) : m_context(context), OCLObject<cl_program>() { }
-	OCLProgram(OCLContext &context) : m_context(context.id()), OCLObject<cl_program>() { }
-	OCLProgram(OCLContext *context) : m_context(context->id()), OCLObject<cl_program>() { }
+	OCLProgram(cl_context context) : m_context(context), OCLObject<cl_program>(), m_from_cache(0) { }
+	OCLProgram(OCLContext &context) : m_context(context.id()), OCLObject<cl_program>(), m_from_cache(0) { }
+	OCLProgram(OCLContext *context) : m_context(context->id()), OCLObject<cl_program>(), m_from_cache(0) { }
 
 	inline void create() {
 		//Prefer binary files if source and binary-device pairing both exist for some odd-reason
@@ -97,6 +101,13 @@ public:
 	}
 
 	inline void add_source(const std::string &text) {
+		//A built program is created again from all sources on the next build;
+		//the binaries it reported are for the old sources only
+		if (m_id) {
+			release();
+			m_binary.clear();
+			m_devices.clear();
+		}
 		m_source.push_back(text);
 	}
 
@@ -154,6 +165,13 @@ public:
 		}
 	}
 
+	//Enable the on-disk binary cache. Binaries are stored in dir, one file per
+	// device, keyed on the program source, build options, device name and driver 
+	// version. Pass NULL or "" to disable caching. The directory must exist.
+	inline void set_cache_dir(const char *dir) {
+		m_cache_dir = (dir) ? dir : "";
+	}
+
 	inline void build(const char *build_options = NULL) {
 		//If no arguments provided or only build options provided, build on
 		// all devices in context
@@ -177,13 +195,32 @@ public:
 
 	inline void build(std::vector<cl_device_id> &devices, const char *build_options=NULL) {		
 		//Don't throw because an error in building is a result of bad code, etc. Show log for error details
+		std::vector<std::string> sources = m_source;
+		std::vector<std::string> keys;
+
+		m_from_cache = 0;
+		if (!m_cache_dir.empty() && (sources.size() > 0)) {
+			keys = cache_keys(devices, sources, build_options);
+			m_from_cache = load_cache(devices, keys);
+		}
+
 		if (!m_id) create();
+		compile(devices, build_options);
+
+		if (m_from_cache && !build_succeeded(devices)) {
+			//Cached binary was rejected (e.g. stale or truncated file). Rebuild from source
+			m_from_cache = 0;
+			m_binary.clear();
+			m_devices.clear();
+			m_source = sources;
+			create();
+			compile(devices, build_options);
+		}
 
-		clBuildProgram(m_id, devices.size(), &devices[0], build_options, NULL, NULL);	
+		//Programs created from binaries do not report their source
+		if (m_source.empty()) m_source = sources;
 
-		ocl_check(clUnloadCompiler(), "clUnloadCompiler");
-		query_info();			//When we build, we want to retrieve the binaries  and the build info
-		query_build_info();
+		if (!m_from_cache && (keys.size() > 0)) save_cache(devices, keys);
 	}
 
 	std::vector<cl_kernel> get_kernels() {	
@@ -204,6 +241,126 @@ public:
 
 protected:
 
+	inline void compile(std::vector<cl_device_id> &devices, const char *build_options) {
+		clBuildProgram(m_id, devices.size(), &devices[0], build_options, NULL, NULL);	
+
+		ocl_check(clUnloadCompiler(), "clUnloadCompiler");
+		query_info();			//When we build, we want to retrieve the binaries  and the build info
+		query_build_info();
+	}
+
+	inline int build_succeeded(std::vector<cl_device_id> &devices) {
+		for (size_t i=0; i<m_devices.size(); ++i) {
+			for (size_t j=0; j<devices.size(); ++j) {
+				if ((m_devices[i] == devices[j]) && 
+					(m_build_status[i].status != CL_BUILD_SUCCESS)) return 0;
+			}
+		}
+		return 1;
+	}
+
+	//64-bit FNV-1a hash, formatted as 16 hex digits
+	inline static std::string hash_string(const std::string &text) {
+		cl_ulong h = 14695981039346656037ULL;
+		for (size_t i=0; i<text.size(); ++i) {
+			h ^= static_cast<unsigned char>(text[i]);
+			h *= 1099511628211ULL;
+		}
+
+		const char *digits = "0123456789abcdef";
+		std::string hex(16, '0');
+		for (int i=15; i>=0; --i) {
+			hex[i] = digits[h & 0xF];
+			h >>= 4;
+		}
+		return hex;
+	}
+
+	inline std::vector<std::string> cache_keys(std::vector<cl_device_id> &devices, 
+		const std::vector<std::string> &sources, const char *build_options) 
+	{
+		std::string text;
+		for (size_t i=0; i<sources.size(); ++i) text += sources[i];
+
+		std::string source_hash = hash_string(text);
+		std::string options = (build_options) ? build_options : "";
+
+		std::vector<std::string> keys;
+		keys.resize(devices.size());
+		for (size_t i=0; i<devices.size(); ++i) {
+			std::string name, driver, version;
+			ocl_get_info_string(devices[i], CL_DEVICE_NAME,	   name,	std::string, clGetDeviceInfo);
+			ocl_get_info_string(devices[i], CL_DRIVER_VERSION, driver,	std::string, clGetDeviceInfo);
+			ocl_get_info_string(devices[i], CL_DEVICE_VERSION, version, std::string, clGetDeviceInfo);
+
+			keys[i] = source_hash + "-" + hash_string(options + '\n' + name + '\n' + driver + '\n' + version);
+		}
+		return keys;
+	}
+
+	inline std::string cache_path(const std::string &key) {
+		return m_cache_dir + "/" + key + ".bin";
+	}
+
+	inline int load_cache(std::vector<cl_device_id> &devices, std::vector<std::string> &keys) {
+		std::vector<std::vector<char> > binaries;
+		binaries.resize(devices.size());
+
+		for (size_t i=0; i<devices.size(); ++i) {
+			std::ifstream file(cache_path(keys[i]).c_str(), std::ios_base::binary | std::ios_base::in);
+			if (!file.is_open()) return 0;
+
+			binaries[i].assign(std::istreambuf_iterator<char>(file), (std::istreambuf_iterator<char>()));
+			if (binaries[i].empty()) return 0;
+		}
+
+		if (m_id) release();
+		m_devices = devices;
+		m_binary.swap(binaries);
+
+		try {
+			create_from_binary();
+		} catch (OCLError &) {
+			m_id = 0;
+		}
+
+		int ok = (m_id != 0);
+		for (size_t i=0; ok && (i<m_status.size()); ++i) {
+			if (m_status[i] != CL_SUCCESS) ok = 0;
+		}
+
+		if (!ok) {
+			if (m_id) release();
+			m_binary.clear();
+			m_devices.clear();
+		}
+		return ok;
+	}
+
+	inline void save_cache(std::vector<cl_device_id> &devices, std::vector<std::string> &keys) {
+		//The cache is best effort: failing to write an entry only costs a rebuild next time.
+		//Entries are written to a temporary file first so readers never see a partial binary.
+		for (size_t i=0; i<m_devices.size(); ++i) {
+			if ((m_build_status[i].status != CL_BUILD_SUCCESS) || m_binary[i].empty()) continue;
+
+			for (size_t j=0; j<devices.size(); ++j) {
+				if (m_devices[i] != devices[j]) continue;
+
+				std::string path = cache_path(keys[j]);
+				std::string tmp_path = path + ".tmp";
+				{
+					std::ofstream file(tmp_path.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+					if (!file.is_open()) break;
+					file.write(&m_binary[i][0], m_binary[i].size());
+					if (!file.good()) break;
+				}
+				std::remove(path.c_str());
+				std::rename(tmp_path.c_str(), path.c_str());
+				break;
+			}
+		}
+	}
+
 	inline void query_info() {		
 		std::string source = "";
 		std::vector<size_t> binary_sizes;
@@ -302,15 +459,18 @@ protected:
 
 	inline void create_from_binary() {				
 		std::vector<size_t> lengths;
+		std::vector<const unsigned char *> binaries;
 		lengths.resize(m_binary.size());
+		binaries.resize(m_binary.size());
 		m_status.resize(m_binary.size());
 
 		for (size_t i=0; i < m_binary.size(); ++i) {
 			lengths[i] = m_binary[i].size();
+			binaries[i] = (lengths[i] > 0) ? reinterpret_cast<const unsigned char *>(&m_binary[i][0]) : NULL;
 		}
 
 		cl_int errcode = CL_SUCCESS;
-		m_id = clCreateProgramWithBinary(m_context, m_devices.size(), &m_devices[0], &lengths[0], (const unsigned char **) &m_binary[0], &m_status[0], &errcode);
+		m_id = clCreateProgramWithBinary(m_context, m_devices.size(), &m_devices[0], &lengths[0], &binaries[0], &m_status[0], &errcode);
 
 		ocl_check(errcode, "clCreateProgramWithBinary");	
 	}
@@ -0,0 +1,241 @@
+#ifndef _RAY_OPENCL_OCLSCHEDULER_H_
+#define _RAY_OPENCL_OCLSCHEDULER_H_
+
+/*
+ * Dynamic tile scheduler over several command queues
+ *
+ * Splits a 1-D range of work-items into tiles and hands them out as the
+ * devices finish them. Every queue starts with m_depth tiles in flight and
+ * receives the next tile each time one of its tiles completes, so faster
+ * devices end up running more tiles. Completion is reported by event
+ * callbacks (OpenCL 1.1); the host thread sleeps until a tile completes.
+ *
+ * Each tile is launched with a global work offset. The kernel must take its
+ * element index from get_global_id(0) and ignore ids past the end of the
+ * data, as the last tile is rounded up to a multiple of the work-group
+ * size. m_tile_size should be a multiple of the work-group size; if it is
+ * not, the work-group size of the other tiles is left to the runtime.
+ * Grid-stride kernels (looping with get_global_size) are not suitable: they
+ * would also visit the elements of later tiles.
+ *
+ * The kernel arguments are shared by all tiles, so buffers must be usable
+ * from every queue (all queues of one context).
+ *
+ * Tiles do not record their accesses on the kernel's OCLBuffers (see 
+ * OCLBuffer). run() first waits for the commands pending on those buffers,
+ * and on out-of-order queues tiles are fenced from earlier commands by a
+ * barrier; all tiles have completed when run() returns.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <vector>
+
+#if defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#endif
+
+namespace ray { namespace opencl {
+
+class OCLScheduler {
+public:
+	typedef struct _Tile {
+		OCLScheduler   *owner;
+		size_t			queue;		//Index in m_queues
+		cl_event		event;
+		cl_int			status;		//Execution status reported to the callback
+	} Tile;
+
+	std::vector<OCLCommandQueue *>	m_queues;
+	size_t							m_tile_size;	//Work-items per tile
+	size_t							m_depth;		//Tiles in flight per queue
+	std::vector<size_t>				m_tiles_done;	//Tiles run by each queue in the last run()
+
+protected:
+	std::vector<Tile *>				m_completed;	//Filled by the callback, guarded by m_lock
+
+#if defined(_WIN32)
+	CRITICAL_SECTION				m_lock;
+	CONDITION_VARIABLE				m_signal;
+#else
+	pthread_mutex_t					m_lock;
+	pthread_cond_t					m_signal;
+#endif
+
+public:
+	OCLScheduler(const std::vector<OCLCommandQueue *> &queues, size_t tile_size = 65536, size_t depth = 2) :
+		m_queues(queues), m_tile_size(tile_size), m_depth(depth)
+	{
+#if defined(_WIN32)
+		InitializeCriticalSection(&m_lock);
+		InitializeConditionVariable(&m_signal);
+#else
+		pthread_mutex_init(&m_lock, NULL);
+		pthread_cond_init(&m_signal, NULL);
+#endif
+		if (m_tile_size < 1) m_tile_size = 1;
+		if (m_depth < 1) m_depth = 1;
+	}
+
+	~OCLScheduler() {
+#if defined(_WIN32)
+		DeleteCriticalSection(&m_lock);
+#else
+		pthread_cond_destroy(&m_signal);
+		pthread_mutex_destroy(&m_lock);
+#endif
+	}
+
+	//Run kernel over num_items work-items, split into tiles between the
+	//queues. Blocks until all tiles have completed. The number of tiles
+	//each queue ran is left in m_tiles_done.
+	inline void run(OCLKernel &kernel, size_t num_items) {
+		size_t num_tiles = (num_items + m_tile_size - 1) / m_tile_size;
+		size_t next = 0;
+		size_t in_flight = 0;
+		cl_int failed = CL_SUCCESS;
+
+		m_tiles_done.assign(m_queues.size(), 0);
+		m_completed.clear();
+
+		for (size_t i=0; i<kernel.m_args.buffers.size(); ++i) {
+			OCLBuffer *b = kernel.m_args.buffers[i];
+			if (b) b->wait_access(OCLKernel::writes(*b));
+		}
+		for (size_t q=0; q<m_queues.size(); ++q) {
+			if (m_queues[q]->out_of_order()) m_queues[q]->enqueue_barrier();
+		}
+
+		//Queues that fail to launch are dropped; tiles go to the others
+		std::vector<bool> active(m_queues.size(), true);
+		OCLError error(CL_SUCCESS, "");
+
+		for (size_t d=0; d<m_depth; ++d) {
+			for (size_t q=0; (q < m_queues.size()) && (next < num_tiles); ++q) {
+				if (!active[q]) continue;
+				try {
+					launch(kernel, q, next, num_items);
+					++next;
+					++in_flight;
+				} catch (const OCLError &err) {
+					active[q] = false;
+					error = err;
+				}
+			}
+		}
+
+		if ((in_flight == 0) && (num_tiles > 0)) throw error;
+
+		while (in_flight > 0) {
+			Tile *t = wait_completed();
+			--in_flight;
+
+			size_t q = t->queue;
+			if (t->status < 0) failed = t->status;
+			clReleaseEvent(t->event);
+			delete t;
+			++m_tiles_done[q];
+
+			if ((next < num_tiles) && (failed == CL_SUCCESS) && active[q]) {
+				try {
+					launch(kernel, q, next, num_items);
+					++next;
+					++in_flight;
+				} catch (const OCLError &err) {
+					active[q] = false;
+					error = err;
+				}
+			}
+
+			//Every queue that could take the remaining tiles has failed
+			if ((in_flight == 0) && (next < num_tiles) && (failed == CL_SUCCESS)) throw error;
+		}
+
+		if (failed != CL_SUCCESS) throw OCLError(failed, "OCLScheduler: a tile failed to execute");
+	}
+
+protected:
+	inline void launch(OCLKernel &kernel, size_t q, size_t tile, size_t num_items) {
+		OCLCommandQueue *queue = m_queues[q];
+
+		size_t offset = tile * m_tile_size;
+		size_t count = num_items - offset;
+		if (count > m_tile_size) count = m_tile_size;
+
+		if (kernel.m_auto_size) kernel.auto_size(queue->m_device, count);
+		size_t local = kernel.m_local_group_size[0];
+
+		//Only the last tile may be padded; otherwise the padding would run
+		//the first work-items of the next tile twice
+		if ((local > 0) && (count % local != 0) && (offset + count < num_items)) local = 0;
+		size_t global = (local > 0) ? ((count + local - 1) / local) * local : count;
+
+		Tile *t = new Tile;
+		t->owner = this;
+		t->queue = q;
+		t->event = 0;
+		t->status = CL_SUCCESS;
+
+		try {
+			queue->enqueue_ndrange_kernel(kernel.id(), 1, &offset, &global, (local > 0) ? &local : NULL, 0, NULL, &t->event);
+			ocl_check(clSetEventCallback(t->event, CL_COMPLETE, &OCLScheduler::on_complete, t), "clSetEventCallback");
+		} catch (...) {
+			//The callback may not fire, so wait here before freeing the tile
+			if (t->event) {
+				clWaitForEvents(1, &t->event);
+				clReleaseEvent(t->event);
+			}
+			delete t;
+			throw;
+		}
+		queue->flush();
+	}
+
+	//Called by the OpenCL runtime, possibly from another thread
+	static void CL_CALLBACK on_complete(cl_event /*event*/, cl_int status, void *user_data) {
+		Tile *t = static_cast<Tile *>(user_data);
+		OCLScheduler *s = t->owner;
+		t->status = status;
+
+#if defined(_WIN32)
+		EnterCriticalSection(&s->m_lock);
+		s->m_completed.push_back(t);
+		LeaveCriticalSection(&s->m_lock);
+		WakeConditionVariable(&s->m_signal);
+#else
+		pthread_mutex_lock(&s->m_lock);
+		s->m_completed.push_back(t);
+		pthread_cond_signal(&s->m_signal);
+		pthread_mutex_unlock(&s->m_lock);
+#endif
+	}
+
+	inline Tile *wait_completed() {
+		Tile *t = 0;
+#if defined(_WIN32)
+		EnterCriticalSection(&m_lock);
+		while (m_completed.empty()) SleepConditionVariableCS(&m_signal, &m_lock, INFINITE);
+		t = m_completed.back();
+		m_completed.pop_back();
+		LeaveCriticalSection(&m_lock);
+#else
+		pthread_mutex_lock(&m_lock);
+		while (m_completed.empty()) pthread_cond_wait(&m_signal, &m_lock);
+		t = m_completed.back();
+		m_completed.pop_back();
+		pthread_mutex_unlock(&m_lock);
+#endif
+		return t;
+	}
+
+private:
+	OCLScheduler(const OCLScheduler &);
+	OCLScheduler &operator=(const OCLScheduler &);
+};
+
+}}
+#endif
@@ -0,0 +1,189 @@
+#ifndef _RAY_OPENCL_OCLSTAGINGRING_H_
+#define _RAY_OPENCL_OCLSTAGINGRING_H_
+
+/*
+ * OpenCL pinned staging ring for host <-> device transfers
+ *
+ * Reads and writes from pageable host memory make the driver copy through
+ * its own pinned staging area first. The ring keeps a few buffers allocated
+ * with CL_MEM_ALLOC_HOST_PTR mapped for its whole lifetime, so the driver
+ * can DMA straight from and into them. Large transfers are split into
+ * chunks: copying the next chunk into one slot overlaps with the transfer
+ * of the previous chunk from another.
+ *
+ * The ring is bound to one command queue, which must outlive it. If a
+ * profiler is set, every chunk transfer is recorded as "upload" or 
+ * "download".
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <string.h>
+#include <vector>
+
+namespace ray { namespace opencl {
+
+class OCLStagingRing {
+public:
+	typedef struct _Slot {
+		OCLBuffer	   *buffer;		//Pinned buffer backing the slot
+		void		   *host;		//Mapped host pointer of buffer
+		OCLEvent		event;		//Last transfer that used the slot
+		bool			busy;		//True while event is pending
+	} Slot;
+
+	OCLCommandQueue				   *m_queue;
+	size_t							m_chunk_size;	//Size of each slot in bytes
+	std::vector<Slot *>				m_slots;
+	size_t							m_next;			//Next slot to use
+	OCLProfiler					   *m_profiler;		//Records chunk transfers if not 0
+	cl_uint							m_device_index;	//Device index passed to m_profiler
+
+public:
+	OCLStagingRing(OCLContext &context, OCLCommandQueue &queue, size_t chunk_size = 4*1024*1024, size_t num_slots = 3) :
+		m_queue(&queue), m_chunk_size(chunk_size), m_next(0), m_profiler(0), m_device_index(0)
+	{
+		create(context.id(), num_slots);
+	}
+
+	OCLStagingRing(OCLContext *context, OCLCommandQueue *queue, size_t chunk_size = 4*1024*1024, size_t num_slots = 3) :
+		m_queue(queue), m_chunk_size(chunk_size), m_next(0), m_profiler(0), m_device_index(0)
+	{
+		create(context->id(), num_slots);
+	}
+
+	~OCLStagingRing() {
+		for (size_t i=0; i<m_slots.size(); ++i) {
+			try {
+				if (m_slots[i]->busy) m_slots[i]->event.wait();
+				m_queue->enqueue_unmap(*m_slots[i]->buffer, m_slots[i]->host);
+			} catch (...) { }
+		}
+		try { m_queue->finish(); } catch (...) { }
+
+		for (size_t i=0; i<m_slots.size(); ++i) {
+			delete m_slots[i]->buffer;
+			delete m_slots[i];
+		}
+		m_slots.clear();
+	}
+
+	//Copy num_bytes from host memory src to dst. Returns once src may be
+	//reused; the last chunk may still be in flight (see finish()).
+	inline void upload(cl_mem dst, const void *src, size_t num_bytes, size_t buff_byte_offset = 0) {
+		const char *p = static_cast<const char *>(src);
+
+		for (size_t off = 0; off < num_bytes; off += m_chunk_size) {
+			size_t n = num_bytes - off;
+			if (n > m_chunk_size) n = m_chunk_size;
+
+			Slot *s = acquire();
+			memcpy(s->host, p + off, n);
+			m_queue->enqueue_buffer_copy(dst, s->host, n, buff_byte_offset + off, CL_FALSE, 0, NULL, &s->event);
+			s->busy = true;
+			if (m_profiler) m_profiler->record("upload", m_device_index, n, s->event);
+			m_queue->flush();
+		}
+	}
+
+	inline void upload(OCLBuffer &dst, const void *src, size_t num_bytes, size_t buff_byte_offset = 0) {
+		upload(dst.id(), src, num_bytes, buff_byte_offset);
+	}
+
+	//Copy num_bytes from src to host memory dst. Blocks until all data is in dst.
+	inline void download(void *dst, cl_mem src, size_t num_bytes, size_t buff_byte_offset = 0) {
+		char *p = static_cast<char *>(dst);
+		size_t num_slots = m_slots.size();
+
+		//Keep every slot busy: the oldest chunk is copied out while the
+		//following ones are still being transferred.
+		std::vector<Slot *> pending;
+		size_t out = 0;		//Offset of the oldest pending chunk
+
+		for (size_t off = 0; off < num_bytes; off += m_chunk_size) {
+			if (pending.size() == num_slots) {
+				drain(p, num_bytes, pending.front(), out);
+				pending.erase(pending.begin());
+				out += m_chunk_size;
+			}
+
+			size_t n = num_bytes - off;
+			if (n > m_chunk_size) n = m_chunk_size;
+
+			Slot *s = acquire();
+			m_queue->enqueue_buffer_copy(s->host, src, n, buff_byte_offset + off, CL_FALSE, 0, NULL, &s->event);
+			s->busy = true;
+			if (m_profiler) m_profiler->record("download", m_device_index, n, s->event);
+			m_queue->flush();
+			pending.push_back(s);
+		}
+
+		while (!pending.empty()) {
+			drain(p, num_bytes, pending.front(), out);
+			pending.erase(pending.begin());
+			out += m_chunk_size;
+		}
+	}
+
+	inline void download(void *dst, OCLBuffer &src, size_t num_bytes, size_t buff_byte_offset = 0) {
+		download(dst, src.id(), num_bytes, buff_byte_offset);
+	}
+
+	//Record chunk transfers in profiler (0 to stop), as device device_index
+	inline void set_profiler(OCLProfiler *profiler, cl_uint device_index) {
+		m_profiler = profiler;
+		m_device_index = device_index;
+	}
+
+	//Wait for all uploads issued through the ring
+	inline void finish() {
+		for (size_t i=0; i<m_slots.size(); ++i) {
+			if (m_slots[i]->busy) {
+				m_slots[i]->event.wait();
+				m_slots[i]->busy = false;
+			}
+		}
+	}
+
+protected:
+	inline void create(cl_context context, size_t num_slots) {
+		if (num_slots < 1) num_slots = 1;
+
+		for (size_t i=0; i<num_slots; ++i) {
+			Slot *s = new Slot;
+			s->busy = false;
+			s->host = 0;
+			s->buffer = 0;
+			m_slots.push_back(s);
+
+			s->buffer = new OCLBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, m_chunk_size);
+			s->host = m_queue->enqueue_map_buffer(*s->buffer, CL_MAP_READ | CL_MAP_WRITE, m_chunk_size);
+		}
+	}
+
+	//Next slot in the ring, once its previous transfer is complete
+	inline Slot *acquire() {
+		Slot *s = m_slots[m_next];
+		m_next = (m_next + 1) % m_slots.size();
+
+		if (s->busy) {
+			s->event.wait();
+			s->busy = false;
+		}
+		return s;
+	}
+
+	inline void drain(char *dst, size_t num_bytes, Slot *s, size_t off) {
+		size_t n = num_bytes - off;
+		if (n > m_chunk_size) n = m_chunk_size;
+
+		if (s->busy) {
+			s->event.wait();
+			s->busy = false;
+		}
+		memcpy(dst + off, s->host, n);
+	}
+};
+
+}}
+#endif
@@ -0,0 +1,274 @@
+#ifndef _RAY_OPENCL_OCLSTREAMER_H_
+#define _RAY_OPENCL_OCLSTREAMER_H_
+
+/*
+ * Streaming executor for data larger than device memory
+ *
+ * Runs a kernel over a host array (or a memory-mapped file, see
+ * OCLMappedFile) tile by tile. Each tile is uploaded into one of a few
+ * device buffer slots, processed, and its results downloaded, with the
+ * uploads, launches and downloads on three command queues: while tile i
+ * is computed, tile i+1 is uploaded and tile i-1 downloaded. Launches wait
+ * for their upload and downloads for their launch through events; a slot
+ * is reused once the host has seen its previous tile complete, so at most
+ * one tile per slot is in flight.
+ *
+ * The kernel is launched once per tile with its input and output buffer
+ * arguments set to the slot's buffers (see bind()), and optionally the
+ * number of items in the tile as a cl_int argument. It must take its
+ * element index from get_global_id(0) and ignore ids past that count, as
+ * the launch is rounded up to a multiple of the work-group size. Items
+ * are numbered from 0 in every tile. When run() returns, the kernel no
+ * longer refers to the slot buffers as OCLBuffers (see OCLKernelArgs).
+ *
+ * With an output item size of 0 the kernel works in place and the input
+ * buffer is downloaded. The three queues must belong to one context; they
+ * may be the same queue, at the cost of the overlap. If a profiler is set,
+ * every transfer and launch is recorded.
+ */
+
+#include <ray/opencl/opencl.h>
+
+#include <vector>
+
+namespace ray { namespace opencl {
+
+class OCLStreamer {
+public:
+	typedef struct _Slot {
+		OCLBuffer	   *input;		//Input tile
+		OCLBuffer	   *output;		//Output tile (input when in place)
+		OCLEvent		uploaded;	//Last upload into input
+		OCLEvent		computed;	//Last launch on the slot
+		OCLEvent		downloaded;	//Last download from output
+	} Slot;
+
+	OCLCommandQueue				   *m_upload;
+	OCLCommandQueue				   *m_compute;
+	OCLCommandQueue				   *m_download;
+
+	size_t							m_tile_items;		//Items per tile
+	size_t							m_in_item_size;		//Bytes per input item
+	size_t							m_out_item_size;	//Bytes per output item (0: in place)
+	std::vector<Slot *>				m_slots;
+
+	cl_uint							m_input_arg;		//Kernel argument of the input tile
+	cl_uint							m_output_arg;		//Kernel argument of the output tile
+	cl_int							m_count_arg;		//Kernel argument of the item count (-1: none)
+
+	OCLProfiler					   *m_profiler;			//Records transfers and launches if not 0
+	cl_uint							m_device_index;		//Device index passed to m_profiler
+
+public:
+	OCLStreamer(OCLContext &context, OCLCommandQueue &upload, OCLCommandQueue &compute, OCLCommandQueue &download,
+		size_t tile_items, size_t in_item_size, size_t out_item_size = 0, size_t num_slots = 3) :
+		m_upload(&upload), m_compute(&compute), m_download(&download),
+		m_tile_items(tile_items), m_in_item_size(in_item_size), m_out_item_size(out_item_size),
+		m_input_arg(0), m_output_arg(1), m_count_arg(-1), m_profiler(0), m_device_index(0)
+	{
+		create(context.id(), num_slots);
+	}
+
+	OCLStreamer(OCLContext *context, OCLCommandQueue *upload, OCLCommandQueue *compute, OCLCommandQueue *download,
+		size_t tile_items, size_t in_item_size, size_t out_item_size = 0, size_t num_slots = 3) :
+		m_upload(upload), m_compute(compute), m_download(download),
+		m_tile_items(tile_items), m_in_item_size(in_item_size), m_out_item_size(out_item_size),
+		m_input_arg(0), m_output_arg(1), m_count_arg(-1), m_profiler(0), m_device_index(0)
+	{
+		create(context->id(), num_slots);
+	}
+
+	~OCLStreamer() {
+		try { wait_all(); } catch (...) { }
+		destroy();
+	}
+
+	//Kernel arguments the tiles are bound to. output_arg is ignored when
+	//working in place; count_arg = -1 passes no item count.
+	inline void bind(cl_uint input_arg, cl_uint output_arg, cl_int count_arg = -1) {
+		m_input_arg = input_arg;
+		m_output_arg = output_arg;
+		m_count_arg = count_arg;
+	}
+
+	//Record transfers and launches in profiler (0 to stop), as device device_index
+	inline void set_profiler(OCLProfiler *profiler, cl_uint device_index) {
+		m_profiler = profiler;
+		m_device_index = device_index;
+	}
+
+	inline bool in_place() const {
+		return m_out_item_size == 0;
+	}
+
+	//Run kernel over num_items items from src, writing the results to dst
+	//(0 to skip the downloads). Blocks until the last tile has completed.
+	inline void run(OCLKernel &kernel, const void *src, void *dst, size_t num_items) {
+		const char *in = static_cast<const char *>(src);
+		char *out = static_cast<char *>(dst);
+		size_t out_size = in_place() ? m_in_item_size : m_out_item_size;
+		size_t num_tiles = (num_items + m_tile_items - 1) / m_tile_items;
+
+		//Launches are not tracked on the kernel's other OCLBuffers (see
+		//OCLScheduler): wait for the commands pending on them first
+		for (size_t i=0; i<kernel.m_args.buffers.size(); ++i) {
+			OCLBuffer *b = kernel.m_args.buffers[i];
+			if (b) b->wait_access(OCLKernel::writes(*b));
+		}
+		if (m_compute->out_of_order()) m_compute->enqueue_barrier();
+
+		try {
+			for (size_t t=0; t<num_tiles; ++t) {
+				Slot *s = acquire(t);
+				size_t first = t * m_tile_items;
+				size_t count = num_items - first;
+				if (count > m_tile_items) count = m_tile_items;
+
+				//Upload
+				m_upload->enqueue_buffer_copy(s->input->id(), in + first * m_in_item_size, count * m_in_item_size,
+					0, CL_FALSE, 0, NULL, &s->uploaded);
+				if (m_profiler) m_profiler->record("upload", m_device_index, count * m_in_item_size, s->uploaded);
+				m_upload->flush();
+
+				//Compute, once the upload is done
+				launch(kernel, *s, count);
+				m_compute->flush();
+
+				//Download, once the launch is done
+				if (out) {
+					m_download->enqueue_buffer_copy(out + first * out_size, s->output->id(), count * out_size,
+						0, CL_FALSE, 1, s->computed.ptr(), &s->downloaded);
+					if (m_profiler) m_profiler->record("download", m_device_index, count * out_size, s->downloaded);
+					m_download->flush();
+				}
+			}
+			wait_all();
+		} catch (...) {
+			//src and dst may go away once we return
+			try { m_upload->finish(); m_compute->finish(); m_download->finish(); } catch (...) { }
+			unbind(kernel);
+			throw;
+		}
+		unbind(kernel);
+	}
+
+	//As run(), streaming num_items items from src (from byte src_offset)
+	//into dst (from byte dst_offset). src and dst must be different objects;
+	//to work on one file, open it twice. The files stay mapped until their
+	//next map() or unmap().
+	inline void run(OCLKernel &kernel, OCLMappedFile &src, OCLMappedFile &dst, size_t num_items,
+		cl_ulong src_offset = 0, cl_ulong dst_offset = 0) {
+
+		if (num_items == 0) return;
+
+		size_t out_size = in_place() ? m_in_item_size : m_out_item_size;
+		const void *in = src.map(src_offset, num_items * m_in_item_size);
+		void *out = dst.map(dst_offset, num_items * out_size);
+		run(kernel, in, out, num_items);
+	}
+
+	//Largest number of items per tile for which each slot buffer fits in
+	//a single allocation on device
+	inline static size_t max_tile_items(cl_device_id device, size_t in_item_size, size_t out_item_size = 0) {
+		cl_ulong max_alloc = 0;
+		ocl_get_info(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, max_alloc, cl_ulong, clGetDeviceInfo);
+
+		size_t item_size = (in_item_size > out_item_size) ? in_item_size : out_item_size;
+		if (item_size == 0) return 0;
+		return (size_t) (max_alloc / item_size);
+	}
+
+protected:
+	inline void create(cl_context context, size_t num_slots) {
+		if (m_tile_items < 1) m_tile_items = 1;
+		if (num_slots < 1) num_slots = 1;
+
+		try {
+			for (size_t i=0; i<num_slots; ++i) {
+				Slot *s = new Slot;
+				s->input = 0;
+				s->output = 0;
+				m_slots.push_back(s);
+
+				if (in_place()) {
+					s->input = new OCLBuffer(context, CL_MEM_READ_WRITE, m_tile_items * m_in_item_size);
+					s->output = s->input;
+				} else {
+					s->input = new OCLBuffer(context, CL_MEM_READ_ONLY, m_tile_items * m_in_item_size);
+					s->output = new OCLBuffer(context, CL_MEM_WRITE_ONLY, m_tile_items * m_out_item_size);
+				}
+			}
+		} catch (...) {
+			destroy();
+			throw;
+		}
+	}
+
+	inline void destroy() {
+		for (size_t i=0; i<m_slots.size(); ++i) {
+			if (m_slots[i]->output != m_slots[i]->input) delete m_slots[i]->output;
+			delete m_slots[i]->input;
+			delete m_slots[i];
+		}
+		m_slots.clear();
+	}
+
+	//Slot for tile t, once its previous tile has completed
+	inline Slot *acquire(size_t t) {
+		Slot *s = m_slots[t % m_slots.size()];
+		wait(*s);
+		return s;
+	}
+
+	inline void launch(OCLKernel &kernel, Slot &s, size_t count) {
+		kernel[m_input_arg] = *s.input;
+		if (!in_place()) kernel[m_output_arg] = *s.output;
+		if (m_count_arg >= 0) {
+			cl_int n = (cl_int) count;
+			kernel.set((cl_uint) m_count_arg, sizeof(cl_int), &n);
+		}
+
+		if (kernel.m_auto_size) kernel.auto_size(m_compute->m_device, count);
+		size_t local = kernel.m_local_group_size[0];
+		size_t global = (local > 0) ? ((count + local - 1) / local) * local : count;
+
+		m_compute->enqueue_ndrange_kernel(kernel.id(), 1, NULL, &global, (local > 0) ? &local : NULL,
+			1, s.uploaded.ptr(), &s.computed);
+		if (m_profiler) m_profiler->record(kernel.m_function_name, m_device_index, 0, s.computed);
+	}
+
+	//Keep the slot buffers' cl_mem in the kernel's recorded arguments, but
+	//not the OCLBuffers, which the kernel may outlive
+	inline void unbind(OCLKernel &kernel) {
+		cl_uint idx[2] = {m_input_arg, m_output_arg};
+		std::vector<OCLBuffer *> &buffers = kernel.m_args.buffers;
+
+		for (size_t i=0; i<2; ++i) {
+			if ((idx[i] >= buffers.size()) || (buffers[idx[i]] == 0)) continue;
+			for (size_t j=0; j<m_slots.size(); ++j) {
+				if ((buffers[idx[i]] == m_slots[j]->input) || (buffers[idx[i]] == m_slots[j]->output)) {
+					cl_mem mem = buffers[idx[i]]->id();
+					ocl_store_arg(&kernel.m_args, idx[i], sizeof(cl_mem), &mem, 0);
+					break;
+				}
+			}
+		}
+	}
+
+	inline void wait(Slot &s) {
+		if (s.uploaded.id()) { s.uploaded.wait(); s.uploaded.assign(0); }
+		if (s.computed.id()) { s.computed.wait(); s.computed.assign(0); }
+		if (s.downloaded.id()) { s.downloaded.wait(); s.downloaded.assign(0); }
+	}
+
+	inline void wait_all() {
+		for (size_t i=0; i<m_slots.size(); ++i) wait(*m_slots[i]);
+	}
+
+private:
+	OCLStreamer(const OCLStreamer &);
+	OCLStreamer &operator=(const OCLStreamer &);
+};
+
+}}
+#endif
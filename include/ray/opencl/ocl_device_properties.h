@@ -57,6 +57,7 @@ typedef struct _ocl_device_properties {
 		cl_bool								error_correction_support;
 		size_t								profiling_timer_resolution;
 		cl_bool								endian_little;
+		cl_bool								host_unified_memory;
 		cl_bool								available;
 		cl_bool								compiler_available;
 		cl_device_exec_capabilities			execution_capabilities;
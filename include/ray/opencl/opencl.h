@@ -20,9 +20,20 @@
 #include <ray/opencl/OCLEvent.h>
 #include <ray/opencl/OCLKernel.h>
 #include <ray/opencl/OCLCommandQueue.h>
+#include <ray/opencl/OCLBufferPool.h>
+#include <ray/opencl/OCLProfiler.h>
+#include <ray/opencl/OCLStagingRing.h>
+#include <ray/opencl/OCLAutotuner.h>
+#include <ray/opencl/OCLBlas.h>
+#include <ray/opencl/OCLHandleTable.h>
+#include <ray/opencl/OCLScheduler.h>
+#include <ray/opencl/OCLKernelGenerator.h>
+#include <ray/opencl/OCLCommandGraph.h>
+#include <ray/opencl/OCLMappedFile.h>
+#include <ray/opencl/OCLStreamer.h>
 
 
 #pragma comment(lib, "OpenCL")
 
 
-#endif
\ No newline at end of file
+#endif
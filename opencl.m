@@ -15,7 +15,13 @@
 %   opencl/opencl
 %   opencl/initialize
 %   opencl/addfile
+%   opencl/add_elementwise
 %   opencl/build
+%   opencl/set_pool_limit
+%   opencl/set_tuning_file
+%   opencl/get_profile
+%   opencl/write_trace
+%   opencl/command
 %   opencl/wait
 %
 % Author: Radford Ray Juang
@@ -120,10 +126,12 @@ classdef opencl < handle
             this.platforms = openclcmd();            
         end
         
-        function initialize(this, platform, devices)
+        function initialize(this, platform, devices, varargin)
         % initialize(obj)
         % initialize(obj, PLATFORM)        
         % initialize(obj, PLATFORM, DEVICES)
+        % initialize(obj, PLATFORM, DEVICES, 'profile')
+        % initialize(obj, PLATFORM, DEVICES, 'out_of_order')
         % 
         % Initialize OpenCL interface to use the specified platform and 
         % devices. 
@@ -136,6 +144,16 @@ classdef opencl < handle
         % (where first index is 1). If unspecified, the first device on
         % the selected PLATFORM is used. 
         %
+        % With 'profile', every kernel launch and transfer is timed on the
+        % device. The timings are returned by get_profile. Profiling adds
+        % some overhead to each command, so it is off by default.
+        %
+        % With 'out_of_order', devices that support it run commands out of
+        % order: kernels and transfers only wait for earlier commands on 
+        % the same buffers, so independent ones can overlap. Buffers
+        % created 'ro' are taken as only read by kernels; all others as
+        % written.
+        %
     	% Note: Calling this function wipes out the previous state of the
 	    % interface mex and resets the GPGPU state.
     	% 
@@ -163,8 +181,13 @@ classdef opencl < handle
             if isempty(devices),
                 devices = 1;
             end
+
+            profile = any(strcmp(varargin, 'profile'));
+            out_of_order = any(strcmp(varargin, 'out_of_order'));
            
-            result = openclcmd('initialize', uint32(platform-1), uint32(devices-1));
+            clobject.kernel_cache();
+            clexpr.kernel_cache();
+            result = openclcmd('initialize', uint32(platform-1), uint32(devices-1), profile, out_of_order);
             
             if ~result,
                 error('OpenCL platform and device could not be initialized.');
@@ -172,6 +195,12 @@ classdef opencl < handle
             
             this.selected_platform = platform;
             this.selected_device = devices;
+
+            tuning_dir = fullfile(tempdir, 'opencl_toolbox_cache');
+            if ~exist(tuning_dir, 'dir'),
+                mkdir(tuning_dir);
+            end
+            this.set_tuning_file(fullfile(tuning_dir, 'autotune.txt'));
         end
         
         function addfile(this, filename)
@@ -196,20 +225,83 @@ classdef opencl < handle
             this.files_loaded{end+1} = filename;
             openclcmd('addfile', filename);
         end
+
+        function add_elementwise(this, types)
+        % add_elementwise(obj)
+        % add_elementwise(obj, types)
+        %
+        % Includes the elementwise kernels used by clobject operators,
+        % generated for every numeric class (int8 ... uint64, single,
+        % double) or for the classes in the cell array types. Use this
+        % instead of adding cl/matlab_kernels_float.cl and
+        % cl/matlab_kernels_double.cl; the kernels have the same names.
+        %
+        % Example:
+        %
+        %  ocl = opencl();
+        %  ocl.initialize(1,1);
+        %  ocl.add_elementwise({'single', 'int16'});
+        %  ocl.build();
+        %  a = clobject(int16(1:10));
+        %  b = a .* 3;
+        %
+        % See also opencl/addfile, opencl/build
+            if nargin < 2,
+                types = {};
+            end
+            openclcmd('add_elementwise', types);
+        end
         
-        function build(this)
+        function build(this, cache_dir)
         % build(obj)
+        % build(obj, cache_dir)
         % 
         % Build the opencl files and send to GPGPU.
         % Note: Only opencl files added with addfile are compiled
 	    % and sent to the GPGPU
 	    %
+        % Compiled program binaries are cached in cache_dir, so later
+        % sessions building the same sources on the same device and driver
+        % skip the compiler. If unspecified, a folder in tempdir is used.
+        % Pass '' to disable the cache.
+        %
 	    % See also opencl/addfile
 
-            openclcmd('build');
+            if nargin < 2,
+                cache_dir = fullfile(tempdir, 'opencl_toolbox_cache');
+            end
+
+            if ~isempty(cache_dir) && ~exist(cache_dir, 'dir'),
+                mkdir(cache_dir);
+            end
+
+            clobject.kernel_cache();
+            openclcmd('build', cache_dir);
             this.built = 1; 
         end
         
+        function set_pool_limit(this, num_bytes)
+        % set_pool_limit(obj, num_bytes)
+        %
+        % Device buffers released by clbuffer/clobject are kept and reused
+        % by later allocations of the same mode and a similar size. This 
+        % sets the maximum number of bytes kept by idle buffers. Use 0 to 
+        % release buffers immediately.
+        %
+            openclcmd('set_pool_limit', double(num_bytes));
+        end
+
+        function set_tuning_file(this, filename)
+        % set_tuning_file(obj, filename)
+        %
+        % Work-group sizes found by clkernel/autotune are stored in filename
+        % and loaded from it, so tuning only has to be done once per kernel,
+        % device and problem size. initialize uses a file in tempdir by
+        % default. Pass '' to keep results for this session only.
+        %
+            openclcmd('set_tuning_file', filename);
+        end
+
         function wait(this, device_id)
         % wait(obj)
         % wait(obj, device)
@@ -243,6 +335,66 @@ classdef opencl < handle
             
             openclcmd('wait_queue', device_id-1);
         end
+
+        function [records, dropped] = get_profile(this)
+        % records = get_profile(obj)
+        % [records, dropped] = get_profile(obj)
+        %
+        % Returns the kernel launches and transfers recorded since the last
+        % call, as a struct array with fields:
+        %   name   : kernel function name, 'upload' or 'download'
+        %   device : index of the device the command ran on
+        %   bytes  : bytes moved between host and device (0 for kernels)
+        %   queued, submit, start, end : device timestamps in nanoseconds
+        %
+        % For example, the time spent in transfers and in kernels:
+        %   p = ocl.get_profile();
+        %   t = [p.end] - [p.start];
+        %   xfer = sum(t([p.bytes] > 0));
+        %   compute = sum(t([p.bytes] == 0));
+        %
+        % At most 65536 commands are kept between calls; dropped is the
+        % number of commands that were not recorded. Requires initialize
+        % with 'profile'.
+        %
+            [records, dropped] = openclcmd('get_profile');
+        end
+
+        function write_trace(this, filename)
+        % write_trace(obj, filename)
+        %
+        % Writes the recorded commands to filename as a Chrome trace (JSON).
+        % Open it in chrome://tracing or https://ui.perfetto.dev to see one
+        % timeline per device queue, with kernels, reads, writes and copies,
+        % and a host timeline with the time spent in each openclcmd call.
+        %
+        % The records are kept, so write_trace can be followed by
+        % get_profile. Requires initialize with 'profile'.
+        %
+            openclcmd('write_trace', filename);
+        end
     end           
+
+    methods (Static)
+        function id = command(name)
+        % id = opencl.command(name)
+        %
+        % Returns the number of the openclcmd command name. Passing the 
+        % number to openclcmd instead of the name skips the name lookup, 
+        % which matters for commands issued many times, e.g.:
+        %
+        %   persistent cmd;
+        %   if isempty(cmd), cmd = opencl.command('submit_batch'); end
+        %   openclcmd(cmd, commands);
+        %
+        % The numbers are read once from openclcmd('commands').
+        %
+            persistent ids;
+            if isempty(ids),
+                ids = openclcmd('commands');
+            end
+            id = ids.(name);
+        end
+    end
 end
     
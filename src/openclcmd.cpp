@@ -28,6 +28,9 @@
  */
 #include <ray/opencl/opencl.h>
 #include <vector>
+#include <map>
+#include <string>
+#include <sstream>
 #include <iostream>
 #include <stdio.h>
 #include <string.h>
@@ -47,13 +50,164 @@ using namespace ray::opencl;
 static OCLPlatform *g_platform = 0;            //Pointer to platform to use.
 static OCLContext  *g_context  = 0;            //Pointer to context to use.
 static OCLProgram  *g_program  = 0;            //Pointer to program (kernels) to load and compile to device
+static OCLBufferPool *g_pool   = 0;            //Pool of released device buffers for reuse
+static OCLAutotuner *g_tuner   = 0;            //Tuned launch geometries for auto-sized kernels
+static OCLProfiler *g_profiler = 0;            //Records commands if profiling was enabled in initialize
 
 
-static std::vector<OCLBuffer *> g_buffers;           //Vector of buffers
+//Buffers, kernels and pending transfers are returned to MATLAB as handles 
+//(see OCLHandleTable). Handles of released objects, including those from 
+//before a cleanup, are detected instead of reaching a freed or reused slot.
+static OCLHandleTable<OCLBuffer> g_buffers;          //Buffers by handle
 static std::vector<OCLCommandQueue*> g_queues;       //Vector of pointers to command queues
-static std::vector<OCLKernel*> g_kernels;            //Vector of pointers to kernels
-static std::vector<unsigned int> g_free_buffer_pool; //Array of free indices in g_buffers
+static std::vector<OCLStagingRing*> g_staging;       //Pinned staging ring for each queue (0 if unavailable)
+static std::vector<bool> g_unified;                  //True if the device of each queue shares host memory
+static std::vector<OCLBlas*> g_blas;                 //BLAS kernels for each queue, built on first use (0 until then)
+
+//Transfers smaller than this go straight through clEnqueueRead/WriteBuffer;
+//the staging ring only pays off once the copy dominates the call overhead.
+static const size_t STAGING_MIN_BYTES = 256*1024;
+
+//Kernels are shared between create_kernel calls with the same name and work 
+//sizes. Each entry in g_kernels is reference counted and released by 
+//destroy_kernel once no longer referenced.
+typedef struct _KernelEntry {
+    OCLKernel          *kernel;
+    std::string         key;            //Key in g_kernel_cache
+    unsigned int        refs;           //Number of references to the kernel
+} KernelEntry;
+
+static OCLHandleTable<KernelEntry> g_kernels;        //Kernels by handle
+static std::map<std::string, unsigned int> g_kernel_cache; //Kernel handle by name and work sizes
+
+//Programs built from source text by compile_kernel (e.g. fused clexpr 
+//kernels), by source. Kept until cleanup so that recreating a kernel for the
+//same expression does not rebuild it.
+static std::map<std::string, OCLProgram *> g_source_programs;
+
+//A non-blocking transfer started by set_buffer_async or get_buffer_async. 
+//The host data is staged here so that it outlives the MATLAB array.
+typedef struct _PendingTransfer {
+    OCLEvent            event;          //Completion event of the transfer
+    std::vector<char>   host;           //Staging copy of the host data
+    std::string         type;           //Type of the array returned by wait_event (empty for uploads)
+    size_t              num_elems;      //Number of elements returned by wait_event
+} PendingTransfer;
+
+static OCLHandleTable<PendingTransfer> g_events;    //Pending transfers by handle
+
+//Free a pending transfer whose event failed or may not have completed. The
+//transfer may still be reading or writing t->host, so finish its queue 
+//first, ignoring any error.
+static void discard_event(PendingTransfer *t) {
+    if (t == 0) return;
+    cl_command_queue queue = 0;
+    if (t->event.id() && (clGetEventInfo(t->event.id(), CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, NULL) == CL_SUCCESS) && queue)
+        clFinish(queue);
+    delete t;
+}
+
+//A command graph recorded by record_batch, replayed on the queue of one device
+typedef struct _GraphEntry {
+    OCLCommandGraph    *graph;
+    size_t              dev_idx;        //Device whose queue the graph is replayed on
+} GraphEntry;
+
+static OCLHandleTable<GraphEntry> g_graphs;         //Command graphs by handle
+
+//Files mapped by load_file under buffers created with CL_MEM_USE_HOST_PTR,
+//by buffer. Unmapped when the buffer is destroyed; such buffers bypass the pool.
+static std::map<OCLBuffer *, OCLMappedFile *> g_mapped_files;
+
+
+/********************************
+ * COMMANDS                     *
+ ********************************/
 
+//Commands are passed to openclcmd by name, or by the number returned for the
+//name by openclcmd('commands'). Numbers index g_command_names.
+enum CommandId {
+    CMD_INITIALIZE,
+    CMD_GET_PROFILE,
+    CMD_WRITE_TRACE,
+    CMD_ADDFILE,
+    CMD_BUILD,
+    CMD_CREATE_BUFFER,
+    CMD_DESTROY_BUFFER,
+    CMD_SET_POOL_LIMIT,
+    CMD_SET_BUFFER,
+    CMD_GET_BUFFER,
+    CMD_SET_BUFFER_ASYNC,
+    CMD_GET_BUFFER_ASYNC,
+    CMD_WAIT_EVENT,
+    CMD_CREATE_KERNEL,
+    CMD_COMPILE_KERNEL,
+    CMD_DESTROY_KERNEL,
+    CMD_SET_KERNEL_ARGS,
+    CMD_SUBMIT_BATCH,
+    CMD_EXECUTE_KERNEL,
+    CMD_AUTOTUNE,
+    CMD_SET_TUNING_FILE,
+    CMD_VECTOR_WIDTH,
+    CMD_BLAS_GEMM,
+    CMD_BLAS_GEMV,
+    CMD_BLAS_AXPY,
+    CMD_BLAS_SCAL,
+    CMD_WAIT_QUEUE,
+    CMD_CLEANUP,
+    CMD_COMMANDS,
+    CMD_CONTEXT_DEVICES,
+    CMD_SCHEDULE_KERNEL,
+    CMD_ADD_ELEMENTWISE,
+    CMD_RECORD_BATCH,
+    CMD_REPLAY_GRAPH,
+    CMD_SET_GRAPH_ARG,
+    CMD_DESTROY_GRAPH,
+    CMD_STREAM_FILE,
+    CMD_LOAD_FILE,
+    NUM_COMMANDS
+};
+
+static const char *g_command_names[NUM_COMMANDS] = {
+    "initialize",
+    "get_profile",
+    "write_trace",
+    "addfile",
+    "build",
+    "create_buffer",
+    "destroy_buffer",
+    "set_pool_limit",
+    "set_buffer",
+    "get_buffer",
+    "set_buffer_async",
+    "get_buffer_async",
+    "wait_event",
+    "create_kernel",
+    "compile_kernel",
+    "destroy_kernel",
+    "set_kernel_args",
+    "submit_batch",
+    "execute_kernel",
+    "autotune",
+    "set_tuning_file",
+    "vector_width",
+    "blas_gemm",
+    "blas_gemv",
+    "blas_axpy",
+    "blas_scal",
+    "wait_queue",
+    "cleanup",
+    "commands",
+    "context_devices",
+    "schedule_kernel",
+    "add_elementwise",
+    "record_batch",
+    "replay_graph",
+    "set_graph_arg",
+    "destroy_graph",
+    "stream_file",
+    "load_file",
+};
 
 /********************************
  * CLEANUP FUNCTION             *
@@ -62,26 +216,71 @@ static void cleanup(void) {
     //Do cleanup here
     dbg_printf("Closing device...\n");
     delete g_program;
+
+    std::map<std::string, OCLProgram *>::iterator pit;
+    for (pit = g_source_programs.begin(); pit != g_source_programs.end(); ++pit) {
+        delete pit->second;
+    }
+    g_source_programs.clear();
+
+    //Transfers still in flight write into their staging memory. Wait first.
+    for (size_t i=0; i<g_events.size(); ++i) discard_event(g_events.at(i));
+    g_events.clear();
+
+    for (size_t i=0; i<g_graphs.size(); ++i) {
+        if (g_graphs.at(i) == 0) continue;
+        delete g_graphs.at(i)->graph;
+        delete g_graphs.at(i);
+    }
+    g_graphs.clear();
+
+    delete g_profiler;
+    g_profiler = 0;
     
+    for (size_t i=0; i<g_blas.size(); ++i) {
+        delete g_blas[i];
+        g_blas[i] = 0;
+    }
+    g_blas.clear();
+
+    //Staging rings unmap through their queue, so release them first
+    for (size_t i=0; i<g_staging.size(); ++i) {
+        delete g_staging[i];
+        g_staging[i] = 0;
+    }
+    g_staging.clear();
+    g_unified.clear();
+
+    if (g_pool) g_pool->clear_queues();
     for (int i=0; i<g_queues.size(); ++i) {
         delete g_queues[i];
         g_queues[i] = 0;
     }
 
-    for (int i=0; i<g_kernels.size(); ++i) {
-        delete g_kernels[i];
-        g_kernels[i] = 0;        
+    for (size_t i=0; i<g_kernels.size(); ++i) {
+        if (g_kernels.at(i) == 0) continue;
+        delete g_kernels.at(i)->kernel;
+        delete g_kernels.at(i);
+    }
+
+    for (size_t i=0; i<g_buffers.size(); ++i) {
+        delete g_buffers.at(i);
     }
 
-    for (int i=0; i<g_buffers.size(); ++i) {
-        delete g_buffers[i];
-        g_buffers[i] = 0;        
+    //Only once the buffers over them are gone
+    std::map<OCLBuffer *, OCLMappedFile *>::iterator mit;
+    for (mit = g_mapped_files.begin(); mit != g_mapped_files.end(); ++mit) {
+        delete mit->second;
     }
+    g_mapped_files.clear();
+
+    delete g_pool;
+    delete g_tuner;
 
     g_kernels.clear();
+    g_kernel_cache.clear();
     g_queues.clear();
     g_buffers.clear();
-    g_free_buffer_pool.clear();
 
     delete g_context;
     delete g_platform;
@@ -89,28 +288,62 @@ static void cleanup(void) {
     g_context = 0;
     g_platform = 0;
     g_program = 0;
+    g_pool = 0;
+    g_tuner = 0;
 }
 
 /********************************
  * FUNCTION PROTOTYPES          *
  ********************************/
+static int command_id(const mxArray *arg);
+static void list_commands(mxArray *plhs[]);
 static void fetch_opencl_devices(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
-static void initialize(mxArray *plhs[], const mxArray *platform, const mxArray *devices);
+static void initialize(mxArray *plhs[], const mxArray *platform, const mxArray *devices, const mxArray *profile,
+    const mxArray *out_of_order);
+static void get_profile(int nlhs, mxArray *plhs[]);
+static void write_trace(mxArray *plhs[], const mxArray *filename);
 static void add_file(mxArray *plhs[], const mxArray *filename);
-static void build(mxArray *plhs[]);
+static void add_elementwise(mxArray *plhs[], const mxArray *types);
+static void build(mxArray *plhs[], const mxArray *cache_dir);
 
 static void create_buffer(mxArray *plhs[], const mxArray *mode, const mxArray *sz);
 static void set_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, const mxArray *data);
+static void load_file(mxArray *plhs[], int nrhs, const mxArray *prhs[]);
 static void get_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, 
     const mxArray *num_elements, const mxArray *type);
 static void wait_queue(mxArray *plhs[], const mxArray *deviceNumber);
+static void set_buffer_async(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, const mxArray *data);
+static void get_buffer_async(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, 
+    const mxArray *num_elements, const mxArray *type);
+static void wait_event(mxArray *plhs[], const mxArray *eventNumber);
 static void create_kernels(mxArray *plhs[], const mxArray *local, const mxArray *global, const mxArray *name);
-static void execute_kernel(mxArray *plhs[], const mxArray *device_id, const mxArray *kernel_id);
+static void compile_kernel(mxArray *plhs[], const mxArray *source, const mxArray *name);
+static void execute_kernel(mxArray *plhs[], const mxArray *device_id, const mxArray *kernel_id, const mxArray *num_items);
+static void schedule_kernel(mxArray *plhs[], const mxArray *kernel_id, const mxArray *num_items, const mxArray *tile_size);
+static void stream_file(mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+static void destroy_kernel(mxArray *plhs[], const mxArray *kernel_id);
+static void autotune(mxArray *plhs[], const mxArray *device_id, const mxArray *kernel_id, 
+    const mxArray *num_items, const mxArray *grid_stride);
+static void set_tuning_file(mxArray *plhs[], const mxArray *filename);
+static void vector_width(mxArray *plhs[], const mxArray *device_id, const mxArray *type);
+static void context_devices(mxArray *plhs[]);
+
+static void blas_gemm(mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+static void blas_gemv(mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+static void blas_axpy(mxArray *plhs[], const mxArray *prhs[]);
+static void blas_scal(mxArray *plhs[], const mxArray *prhs[]);
 
 static void set_kernel_args(mxArray *plhs[], const mxArray *kernel_id, 
     const mxArray *arg_num, const mxArray *buffer_id, const mxArray *data, const mxArray *size);
+static void submit_batch(mxArray *plhs[], const mxArray *commands);
+static void record_batch(mxArray *plhs[], const mxArray *commands);
+static void replay_graph(mxArray *plhs[], const mxArray *graph_id);
+static void set_graph_arg(mxArray *plhs[], const mxArray *graph_id, const mxArray *node,
+    const mxArray *arg_num, const mxArray *buffer_id, const mxArray *data, const mxArray *size);
+static void destroy_graph(mxArray *plhs[], const mxArray *graph_id);
 
 void destroy_buffer(mxArray *plhs[], const mxArray *bufferId);
+static void set_pool_limit(mxArray *plhs[], const mxArray *num_bytes);
 
 /********************************
  * MAIN MEX FUNCTION            *
@@ -126,27 +359,65 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         return;
     }
 
-    int nChars = mxGetN(prhs[0])+1;  //Add one extra for the \0
-    std::vector<char> buffer;
-    buffer.resize(nChars);
-    
-    mxGetString(prhs[0], &buffer[0], nChars);
-    
-    buffer[nChars-1] = 0;
-    if (strcmp(&buffer[0], "initialize") == 0) {
+    int cmd = command_id(prhs[0]);
+
+    //Host time spent in this call, recorded when profiling is enabled
+    cl_ulong t_enter = OCLProfiler::host_time();
+
+    switch (cmd) {
+    case CMD_INITIALIZE:
         //openclcmd('initialize', platform, devices) 
+        //openclcmd('initialize', platform, devices, profile) 
+        //openclcmd('initialize', platform, devices, profile, out_of_order) 
         //  platform: single integer representing the index of platform to use
         //  (zero-centered)
         //  devices: array of integers representing index of devices to use
         //  (zero-centered)
+        //  profile: (optional) if true, queues are created with profiling 
+        //  enabled and every kernel launch and transfer is recorded for
+        //  get_profile. Default is false.
+        //  out_of_order: (optional) if true, queues of devices that support
+        //  it run commands out of order. Kernels and transfers wait for the
+        //  earlier commands on the same buffers, so independent ones can 
+        //  overlap. Default is false.
         //
         //Returns true if success, false otherwise.
         if (nrhs < 3)  
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
-        initialize(plhs, prhs[1], prhs[2]);
+        initialize(plhs, prhs[1], prhs[2], (nrhs > 3) ? prhs[3] : 0, (nrhs > 4) ? prhs[4] : 0);
+        break;
+
+    case CMD_GET_PROFILE:
+        //openclcmd('get_profile')
+        //  Waits for the recorded commands and returns them as a struct 
+        //  array with fields
+        //    name:   kernel function name, 'upload' or 'download'
+        //    device: one-based index of the device
+        //    bytes:  bytes moved between host and device (0 for kernels)
+        //    queued, submit, start, end: device timestamps in nanoseconds
+        //  The records are cleared. A second output returns the number of
+        //  commands that were not recorded because the record limit was hit.
+        //  Requires initialize with profile enabled.
+        get_profile(nlhs, plhs);
+        break;
+
+    case CMD_WRITE_TRACE:
+        //openclcmd('write_trace', filename)
+        //  Writes the recorded commands to filename as a Chrome trace (JSON
+        //  Trace Event Format; open in chrome://tracing or Perfetto). There
+        //  is one track per device queue, with kernels, reads, writes and
+        //  copies as spans, and one track for the host time spent in each
+        //  openclcmd call. Device times are aligned to the host clock.
+        //  Unlike get_profile, the records are not cleared.
+        //  Requires initialize with profile enabled.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        write_trace(plhs, prhs[1]);
+        break;
 
-    } else if (strcmp(&buffer[0], "addfile") == 0) {
+    case CMD_ADDFILE:
         //openclcmd('addfile', filenames) 
         //  filenames: a cell array of strings containing the filenames of the
         //  OpenCL files to load
@@ -156,27 +427,54 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
         add_file(plhs, prhs[1]);
+        break;
+
+    case CMD_ADD_ELEMENTWISE:
+        //openclcmd('add_elementwise')
+        //openclcmd('add_elementwise', types)
+        //  Adds the generated elementwise kernels used by clobject (see 
+        //  OCLKernelGenerator.h) to the program, in place of 
+        //  cl/matlab_kernels_float.cl and cl/matlab_kernels_double.cl.
+        //  types: (optional) cell array of class names (e.g. {'single', 
+        //  'int32'}) to generate kernels for. Default is all numeric classes.
+        //
+        //Returns true if success, false otherwise.
+        add_elementwise(plhs, (nrhs > 1) ? prhs[1] : 0);
+        break;
 
-    } else if (strcmp(&buffer[0], "build") == 0) {
+    case CMD_BUILD:
         //openclcmd('build')
+        //openclcmd('build', cache_dir)
         //  Compiles and builds the the program. 
+        //  cache_dir: (optional) existing directory used to cache the compiled
+        //      program binaries. If a binary for the same sources, build
+        //      options, device and driver version exists, it is loaded 
+        //      instead of invoking the compiler. 
         //
         //  Returns true if success, false otherwise
-        build(plhs);
-    } else if (strcmp(&buffer[0], "create_buffer") == 0) {
+        build(plhs, (nrhs > 1) ? prhs[1] : 0);
+        break;
+
+    case CMD_CREATE_BUFFER:
         //openclcmd('create_buffer', mode, size)
         //  Create a buffer of a given mode type and size   
         //      mode: 2-character string that is 'rw', 'ro', 'wo', for
-        //          read-write, read-only, and write-only 
+        //          read-write, read-only, and write-only. Append 'h' (e.g.
+        //          'rwh') to allocate the buffer in host-accessible memory;
+        //          set_buffer/get_buffer then map it instead of copying,
+        //          which is zero-copy on CPU and integrated devices.
         //      size: positive integer specifying size of buffer
         //      
-        //  Returns -1 if failed, or a number indicating the ID (index value)
-        //  of the buffer
+        //  Returns -1 if failed, or a number indicating the ID of the buffer.
+        //  IDs are handles, not indices: an ID stays invalid once its buffer
+        //  is destroyed, even if a new buffer reuses the slot.
         if (nrhs < 3)
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
         create_buffer(plhs, prhs[1], prhs[2]);   
-    } else if (strcmp(&buffer[0], "destroy_buffer") == 0) {
+        break;
+
+    case CMD_DESTROY_BUFFER:
         //openclcmd('destroy_buffer', buffer_id)
         //  Destroy the buffer with buffer_id and free up any allocated resources   
         //      buffer_id: integer greater than or equal to 0 specifying the index
@@ -187,8 +485,23 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
         destroy_buffer(plhs, prhs[1]);   
+        break;
+
+    case CMD_SET_POOL_LIMIT:
+        //openclcmd('set_pool_limit', num_bytes)
+        //  Released buffers are kept in a pool and reused by later calls to
+        //  create_buffer with the same mode and a similar size. num_bytes is
+        //  the maximum number of bytes kept by idle buffers in the pool 
+        //  (0 disables pooling). Default is 256 MB.
+        //
+        //  Returns true if success
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
-    } else if (strcmp(&buffer[0], "set_buffer") == 0 ) {
+        set_pool_limit(plhs, prhs[1]);
+        break;
+
+    case CMD_SET_BUFFER:
         //openclcmd('set_buffer', device_idx, buffer_idx, data)
         //    device_idx:  zero-based index containing index of device in
         //      context to use  (e.g. 0 for first device)
@@ -201,8 +514,34 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
         set_buffer(plhs, prhs[1], prhs[2], prhs[3]);
+        break;
+
+    case CMD_LOAD_FILE:
+        //openclcmd('load_file', path, offset, nBytes, buffer_idx)
+        //openclcmd('load_file', path, offset, nBytes, buffer_idx, device_idx)
+        //
+        //Copies nBytes of a binary file, starting at byte offset, into a 
+        //buffer without going through MATLAB: the file is memory-mapped 
+        //and its pages are copied to the device directly. nBytes must be
+        //positive and the range must lie within the file.
+        //
+        //    buffer_idx: buffer to copy into (from its first byte), or -1 
+        //      to create a read-write buffer of nBytes. On devices sharing
+        //      host memory (CPUs, integrated GPUs) the new buffer uses the
+        //      mapped pages themselves and nothing is copied; writes to it
+        //      do not reach the file. The file stays mapped until the 
+        //      buffer is destroyed.
+        //    device_idx: (optional) device whose queue copies the data 
+        //      (default 0)
+        //
+        //Returns the buffer index.
+        if (nrhs < 5)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        load_file(plhs, nrhs, prhs);
+        break;
 
-    } else if (strcmp(&buffer[0], "get_buffer") == 0 ) {
+    case CMD_GET_BUFFER:
         //openclcmd('get_buffer', device_idx, buffer_idx, nElems, type)
         //
         //    device_idx: zero-based index containing index of device in
@@ -223,7 +562,47 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
         get_buffer(plhs, prhs[1], prhs[2], prhs[3], prhs[4]);
         
-    } else if (strcmp(&buffer[0], "create_kernel") == 0 ) {
+        break;
+
+    case CMD_SET_BUFFER_ASYNC:
+        //openclcmd('set_buffer_async', device_idx, buffer_idx, data)
+        //    Same as set_buffer, but returns without waiting for the copy to
+        //    complete. data is staged, so it may be modified or cleared
+        //    right away.
+        //
+        //Returns an event id (>= 0) to pass to wait_event.
+        if (nrhs < 4)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        set_buffer_async(plhs, prhs[1], prhs[2], prhs[3]);
+        break;
+
+    case CMD_GET_BUFFER_ASYNC:
+        //openclcmd('get_buffer_async', device_idx, buffer_idx, nElems, type)
+        //    Same as get_buffer, but returns without waiting for the copy to
+        //    complete. The data is returned by wait_event.
+        //
+        //Returns an event id (>= 0) to pass to wait_event.
+        if (nrhs < 5)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        get_buffer_async(plhs, prhs[1], prhs[2], prhs[3], prhs[4]);
+        break;
+
+    case CMD_WAIT_EVENT:
+        //openclcmd('wait_event', event_id)
+        //    Waits for the transfer associated with event_id to complete 
+        //    and frees the event. Only the given transfer is waited on, not
+        //    the whole queue.
+        //
+        //Returns the data for events from get_buffer_async, true otherwise.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        wait_event(plhs, prhs[1]);
+        break;
+
+    case CMD_CREATE_KERNEL:
         //openclcmd('create_kernel', local_dims, global_dims, kernel_name)
         //
         // Create a kernel given the local dimensions, global dimensions, and 
@@ -234,6 +613,13 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         // global_dims must be a uint32 1x3 matrix containing the number of 
         //    units to divide the task into
         //
+        // If global_dims is all zeros, the launch geometry is picked by
+        // execute_kernel from the device and the number of items.
+        //
+        // Kernels with the same name and dimensions share one kernel object;
+        // repeated calls add a reference to it instead of creating a new
+        // one. Release each reference with destroy_kernel.
+        //
         // Returns an index number (>= 0) containing the ID of the kernel.
         //  -1 if failed.
         
@@ -241,8 +627,37 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
         create_kernels(plhs, prhs[1], prhs[2], prhs[3]);
+        break;
+
+    case CMD_COMPILE_KERNEL:
+        //openclcmd('compile_kernel', source, kernel_name)
+        //  Build a separate program from the OpenCL source text and create
+        //  the kernel kernel_name from it. Programs are kept per source and
+        //  use the binary cache directory passed to build, so compiling the
+        //  same source again is cheap. The work size of the kernel is picked
+        //  at launch, as for create_kernel with zero global dims.
+        //
+        //  Returns -1 if failed, or a kernel id (see create_kernel)
+        if (nrhs < 3)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        compile_kernel(plhs, prhs[1], prhs[2]);
+        break;
+
+    case CMD_DESTROY_KERNEL:
+        //openclcmd('destroy_kernel', kernel_id)
+        //
+        // Release a reference to the kernel returned by create_kernel. The 
+        // kernel is freed when its last reference is released. 
+        //
+        // Returns true if the kernel was freed
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        destroy_kernel(plhs, prhs[1]);
+        break;
 
-    } else if (strcmp(&buffer[0], "set_kernel_args") == 0) {
+    case CMD_SET_KERNEL_ARGS:
         //Setting kernel argument to buffer:
         //  openclcmd('set_kernel_args',  kernel_id, arg_num, buffer_id, [], 0 ) 
         //
@@ -256,9 +671,91 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         if (nrhs < 6)
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
         set_kernel_args(plhs, prhs[1], prhs[2], prhs[3], prhs[4], prhs[5]);
+        break;
+
+    case CMD_SUBMIT_BATCH:
+        //openclcmd('submit_batch', commands)
+        //
+        //Runs a list of commands in one call, saving the MEX call overhead 
+        //of issuing them one by one. commands is a cell array; each cell
+        //is itself a cell array holding one command:
+        //
+        //  {'arg', kernel_id, arg_num, buffer_id, data, nBytes}
+        //      Same as set_kernel_args
+        //  {'launch', device_id, kernel_id, num_items}
+        //      Same as execute_kernel (num_items is optional)
+        //  {'copy', device_id, src_buffer_id, dst_buffer_id, nBytes}
+        //      Copies nBytes between two buffers on the device queue
+        //
+        //Commands are enqueued in order and do not wait for completion.
+        //All commands are checked before any is run; if one fails to 
+        //enqueue, the ones after it are not run.
+        //
+        // returns true if success.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        submit_batch(plhs, prhs[1]);
+        break;
+
+    case CMD_RECORD_BATCH:
+        //openclcmd('record_batch', commands)
+        //
+        //Records a list of commands in the format of submit_batch into a
+        //command graph instead of running them, and returns the graph id.
+        //'arg' commands are applied right away; the launches and copies
+        //are recorded with the kernel arguments and work sizes they would
+        //have run with. All of them must be on the same device.
+        //
+        //The recorded launches and copies are the nodes of the graph, 
+        //numbered from 0 in order. See replay_graph and set_graph_arg.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        record_batch(plhs, prhs[1]);
+        break;
+
+    case CMD_REPLAY_GRAPH:
+        //openclcmd('replay_graph', graph_id)
+        //
+        //Enqueues all commands of a graph recorded by record_batch on the 
+        //queue of its device, with no per-command argument setting or 
+        //checks. Does not wait for completion.
+        //
+        // returns true if success.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        replay_graph(plhs, prhs[1]);
+        break;
+
+    case CMD_SET_GRAPH_ARG:
+        //openclcmd('set_graph_arg', graph_id, node, arg_num, buffer_id, data, nBytes)
+        //
+        //Changes an argument of a recorded launch for the next replays, 
+        //with the arguments of set_kernel_args. node is the number of the
+        //launch in the graph.
+        //
+        // returns true if success.
+        if (nrhs < 7)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        set_graph_arg(plhs, prhs[1], prhs[2], prhs[3], prhs[4], prhs[5], prhs[6]);
+        break;
+
+    case CMD_DESTROY_GRAPH:
+        //openclcmd('destroy_graph', graph_id)
+        //
+        // returns true if the graph existed.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        destroy_graph(plhs, prhs[1]);
+        break;
 
-    } else if (strcmp(&buffer[0], "execute_kernel") == 0 ) {
+    case CMD_EXECUTE_KERNEL:
         //openclcmd('execute_kernel', device_id, kernel_id)
+        //openclcmd('execute_kernel', device_id, kernel_id, num_items)
         //
         //Execute a kernel given the device and the kernel 
         //
@@ -266,15 +763,185 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         //  devices in the context (if only 1 device in context, this is 0)
         //kernel_id : zero-based index of the kernel number returned from
         //  create_kernel call
+        //num_items : (optional) number of work-items the kernel should 
+        //  cover. Only used by kernels created with zero global dims.
         //
         // returns true if success, false if failed.
          
         if (nrhs < 3)
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
-        execute_kernel(plhs, prhs[1], prhs[2]);
+        execute_kernel(plhs, prhs[1], prhs[2], (nrhs > 3) ? prhs[3] : 0);
+        break;
+
+    case CMD_SCHEDULE_KERNEL:
+        //openclcmd('schedule_kernel', kernel_id, num_items)
+        //openclcmd('schedule_kernel', kernel_id, num_items, tile_size)
+        //
+        //Run a kernel over num_items work-items split into tiles of 
+        //tile_size work-items (default 65536) that are handed out to all 
+        //devices of the context as they finish earlier tiles, so faster 
+        //devices run more of them. Blocks until all tiles are done.
+        //
+        //The kernel must index its data with get_global_id(0) and skip ids
+        //past the end; grid-stride kernels are not suitable. Its buffer 
+        //arguments are shared by all devices.
+        //
+        //Returns the number of tiles each device ran.
+        if (nrhs < 3)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        schedule_kernel(plhs, prhs[1], prhs[2], (nrhs > 3) ? prhs[3] : 0);
+        break;
+
+    case CMD_STREAM_FILE:
+        //openclcmd('stream_file', device_id, kernel_id, src_file, src_offset, 
+        //          dst_file, dst_offset, num_items, item_sizes, arg_nums)
+        //openclcmd('stream_file', ..., arg_nums, tile_items)
+        //
+        //Run a kernel over num_items items of a binary file too large for
+        //device memory. The file is memory-mapped and streamed through a
+        //few device buffers tile by tile; uploads, launches and downloads
+        //of consecutive tiles overlap. The results are written to dst_file
+        //(created or grown as needed), or dropped if dst_file is ''.
+        //Blocks until the last tile is done.
+        //
+        //src_offset, dst_offset : byte offsets of the first item in the files
+        //item_sizes : [input_bytes output_bytes] per item. With 
+        //  output_bytes = 0 the kernel works in place on its input tile.
+        //arg_nums : [input_arg output_arg count_arg], the zero-based kernel
+        //  arguments of the input tile, the output tile and the number of 
+        //  items in the tile (an int; -1 to omit it). Items are numbered 
+        //  from 0 in every tile; the kernel must skip ids past the count.
+        //tile_items : (optional) items per tile (default 1048576, at most
+        //  what one device allocation can hold)
+        //
+        // returns true if success.
+        if (nrhs < 10)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        stream_file(plhs, nrhs, prhs);
+        break;
+
+    case CMD_AUTOTUNE:
+        //openclcmd('autotune', device_id, kernel_id, num_items, grid_stride)
+        //
+        //Time the kernel over a sweep of work-group sizes on the device, 
+        //with the arguments currently set, and remember the fastest for 
+        //this kernel, device and problem size. Later launches of kernels
+        //created with automatic work sizes use the result. The kernel is
+        //run several times, so its output must not depend on its previous
+        //output.
+        //
+        //num_items : number of work-items the kernel covers
+        //grid_stride : true if the kernel loops over its range (like the
+        //  kernels in matlab_kernels_float.cl). Smaller global sizes are 
+        //  then tried too.
+        //
+        //Returns [local_size, global_size] of the fastest configuration.
+        //A global_size of 0 means the range covers num_items.
+        if (nrhs < 5)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        autotune(plhs, prhs[1], prhs[2], prhs[3], prhs[4]);
+        break;
+
+    case CMD_SET_TUNING_FILE:
+        //openclcmd('set_tuning_file', filename)
+        //
+        //Load tuned launch geometries from filename and save new results 
+        //from autotune to it. Pass '' to keep results in memory only.
+        //
+        //Returns true if success
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        set_tuning_file(plhs, prhs[1]);
+        break;
+
+    case CMD_VECTOR_WIDTH:
+        //openclcmd('vector_width', device_idx)
+        //openclcmd('vector_width', device_idx, type)
+        //    device_idx: zero-based index containing index of device in
+        //      context to use  (e.g. 0 for first device)
+        //    type: numeric class name, 'single' (default), 'double', 
+        //      'int8', ... 'uint64'
+        //
+        //Returns the preferred vector width of the device for the type, used
+        //to pick the _v4/_v8 variants of the elementwise kernels. The width
+        //for double is 0 if the device has no double precision support.
+        if (nrhs < 2)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        vector_width(plhs, prhs[1], (nrhs > 2) ? prhs[2] : 0);
+        break;
+
+    case CMD_CONTEXT_DEVICES:
+        //openclcmd('context_devices')
+        //
+        //Returns a struct array with one element per device passed to 
+        //initialize, in the same order, with fields
+        //    name:            device name
+        //    compute_units:   number of compute units
+        //    clock_frequency: maximum clock frequency in MHz
+        //    global_mem_size: bytes of global memory
+        //    unified_memory:  true if the device shares host memory
+        //    extensions:      space separated OpenCL extensions (e.g. 
+        //                     cl_khr_fp64 for double precision)
+        //Used by cldist to split data between the devices.
+        context_devices(plhs);
+        break;
+
+    case CMD_BLAS_GEMM:
+        //openclcmd('blas_gemm', device_idx, A_id, B_id, C_id, M, N, K)
+        //openclcmd('blas_gemm', device_idx, A_id, B_id, C_id, M, N, K, alpha, beta)
+        //    C = alpha*A*B + beta*C for single precision buffers in column-major
+        //    order. A is M x K, B is K x N and C is M x N. alpha defaults to
+        //    1 and beta to 0. The BLAS kernels are built for the device on 
+        //    first use.
+        //
+        //Returns true if success
+        if (nrhs < 8)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        blas_gemm(plhs, nrhs, prhs);
+        break;
+
+    case CMD_BLAS_GEMV:
+        //openclcmd('blas_gemv', device_idx, A_id, x_id, y_id, M, N)
+        //openclcmd('blas_gemv', device_idx, A_id, x_id, y_id, M, N, alpha, beta)
+        //    y = alpha*A*x + beta*y, A is M x N. See blas_gemm.
+        //
+        //Returns true if success
+        if (nrhs < 7)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        blas_gemv(plhs, nrhs, prhs);
+        break;
+
+    case CMD_BLAS_AXPY:
+        //openclcmd('blas_axpy', device_idx, n, alpha, x_id, y_id)
+        //    y = alpha*x + y over the first n elements. See blas_gemm.
+        //
+        //Returns true if success
+        if (nrhs < 6)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        blas_axpy(plhs, prhs);
+        break;
+
+    case CMD_BLAS_SCAL:
+        //openclcmd('blas_scal', device_idx, n, alpha, x_id)
+        //    x = alpha*x over the first n elements. See blas_gemm.
+        //
+        //Returns true if success
+        if (nrhs < 5)
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
+
+        blas_scal(plhs, prhs);
+        break;
 
-    } else if (strcmp(&buffer[0], "wait_queue") == 0) {
+    case CMD_WAIT_QUEUE:
         //openclcmd('wait_queue', device_idx)
         //    device_idx = zero-based index containing index of device in
         //      context to use  (e.g. 0 for first device)
@@ -284,19 +951,86 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
             mexErrMsgIdAndTxt("MATLAB:openclcmd:nInput", "Not enough input arguments");
 
         wait_queue(plhs, prhs[1]);
+        break;
 
-    } else if (strcmp(&buffer[0], "cleanup") == 0) {
+    case CMD_CLEANUP:
         //openclcmd('cleanup'): Perform cleanup
         //
         cleanup();
-    } else {
+        break;
+
+    case CMD_COMMANDS:
+        //openclcmd('commands')
+        //  Returns a struct with one field per command, holding the number
+        //  of the command. Passing the number instead of the name, e.g.
+        //  openclcmd(ids.execute_kernel, ...), skips the name lookup.
+        //  Numbers only change when openclcmd is rebuilt.
+        list_commands(plhs);
+        break;
+
+    default:
         mexErrMsgIdAndTxt("MATLAB:openclcmd:command", "Invalid command");
     }
+
+    if (g_profiler != 0)
+        g_profiler->record_host(g_command_names[cmd], t_enter, OCLProfiler::host_time());
 }
 
 /********************************
  * HELPER SUBROUTINES           *
  ********************************/
+
+//Number of the command named by the first argument of openclcmd, which is 
+//either the command name or its number (see list_commands)
+static int command_id(const mxArray *arg) {
+    if (!mxIsChar(arg)) {
+        double id = (mxIsNumeric(arg) && !mxIsEmpty(arg)) ? mxGetScalar(arg) : -1;
+        if ((id < 0) || (id >= NUM_COMMANDS) || (id != (double) (int) id))
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:command", "Invalid command");
+        return (int) id;
+    }
+
+    static std::map<std::string, int> ids;
+    if (ids.empty()) {
+        for (int i=0; i<NUM_COMMANDS; ++i) ids[g_command_names[i]] = i;
+    }
+
+    //Names longer than the buffer are not commands
+    char name[32];
+    if (mxGetString(arg, name, sizeof(name)) == 0) {
+        std::map<std::string, int>::const_iterator it = ids.find(name);
+        if (it != ids.end()) return it->second;
+    }
+
+    mexErrMsgIdAndTxt("MATLAB:openclcmd:command", "Invalid command");
+    return -1;
+}
+
+//Validated lookups of the objects passed to openclcmd. Handles that are 
+//invalid or were released throw instead of reaching a freed or reused slot.
+static OCLBuffer *lookup_buffer(double handle) {
+    OCLBuffer *b = (handle >= 0) ? g_buffers.get((unsigned int) handle) : 0;
+    if (b == 0) throw OCLError(CL_INVALID_MEM_OBJECT, "Invalid or released buffer id");
+    return b;
+}
+
+static OCLKernel *lookup_kernel(double handle) {
+    KernelEntry *entry = (handle >= 0) ? g_kernels.get((unsigned int) handle) : 0;
+    if (entry == 0) throw OCLError(CL_INVALID_KERNEL, "Invalid or released kernel id");
+    return entry->kernel;
+}
+
+static OCLCommandQueue *lookup_queue(size_t dev_idx) {
+    if (dev_idx >= g_queues.size()) throw OCLError(CL_INVALID_DEVICE, "Invalid device index");
+    return g_queues[dev_idx];
+}
+
+static void list_commands(mxArray *plhs[]) {
+    plhs[0] = mxCreateStructMatrix(1, 1, NUM_COMMANDS, g_command_names);
+    for (int i=0; i<NUM_COMMANDS; ++i) {
+        mxSetFieldByNumber(plhs[0], 0, i, mxCreateDoubleScalar(i));
+    }
+}
 static void fetch_opencl_devices(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {    
     
@@ -356,6 +1090,7 @@ static void fetch_opencl_devices(int nlhs, mxArray *plhs[], int nrhs, const mxAr
         "error_correction_support",
         "profiling_timer_resolution",
         "endian_little",
+        "host_unified_memory",
         "available",
         "compiler_available",
         "platform"
@@ -415,6 +1150,7 @@ static void fetch_opencl_devices(int nlhs, mxArray *plhs[], int nrhs, const mxAr
         DEV_FIELD_ERROR_CORRECTION_SUPPORT,
         DEV_FIELD_PROFILING_TIMER_RESOLUTION,
         DEV_FIELD_ENDIAN_LITTLE,
+        DEV_FIELD_HOST_UNIFIED_MEMORY,
         DEV_FIELD_AVAILABLE,
         DEV_FIELD_COMPILER_AVAILABLE,
         DEV_NUM_FIELDS
@@ -592,6 +1328,9 @@ static void fetch_opencl_devices(int nlhs, mxArray *plhs[], int nrhs, const mxAr
                 arr = mxCreateDoubleScalar(d.m_properties.endian_little);
                     mxSetField(dev_arr, j, device_field_names[DEV_FIELD_ENDIAN_LITTLE], arr);
 
+                arr = mxCreateDoubleScalar(d.m_properties.host_unified_memory);
+                    mxSetField(dev_arr, j, device_field_names[DEV_FIELD_HOST_UNIFIED_MEMORY], arr);
+
                 arr = mxCreateDoubleScalar(d.m_properties.available);
                     mxSetField(dev_arr, j, device_field_names[DEV_FIELD_AVAILABLE], arr);
 
@@ -611,8 +1350,11 @@ static void fetch_opencl_devices(int nlhs, mxArray *plhs[], int nrhs, const mxAr
 	}        
 }
 
-static void initialize(mxArray *plhs[], const mxArray *platform, const mxArray *devices) {
+static void initialize(mxArray *plhs[], const mxArray *platform, const mxArray *devices, const mxArray *profile,
+    const mxArray *out_of_order) {
     int platform_idx = static_cast<int>(mxGetScalar(platform) );
+    bool bProfile = (profile != 0) && !mxIsEmpty(profile) && (mxGetScalar(profile) != 0);
+    bool bOutOfOrder = (out_of_order != 0) && !mxIsEmpty(out_of_order) && (mxGetScalar(out_of_order) != 0);
     int len = 0;
     unsigned int *p_data_uint32 = 0;
 
@@ -648,11 +1390,42 @@ static void initialize(mxArray *plhs[], const mxArray *platform, const mxArray *
 
         dbg_printf("Creating program object: \n");
         g_program = new OCLProgram(*g_context);
+        g_pool = new OCLBufferPool(*g_context);
+        g_tuner = new OCLAutotuner(*g_context);
+        if (bProfile) g_profiler = new OCLProfiler();
 
         g_queues.resize(len);
         for (size_t j=0; j<len; ++j) {
             device_idx = p_data_uint32[j];
-            g_queues[j] = new OCLCommandQueue(*g_context, available_devices[device_idx]);
+            cl_command_queue_properties props = bProfile ? CL_QUEUE_PROFILING_ENABLE : 0;
+
+            //Devices without out-of-order execution keep an in-order queue
+            if (bOutOfOrder) {
+                OCLDevice d(available_devices[device_idx]);
+                props |= (d.m_properties.queue_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+            }
+            g_queues[j] = new OCLCommandQueue(*g_context, available_devices[device_idx], props);
+            g_pool->add_queue(g_queues[j]);
+        }
+
+        g_blas.resize(len, 0);
+        g_staging.resize(len, 0);
+        g_unified.resize(len, false);
+        for (size_t j=0; j<len; ++j) {
+            device_idx = p_data_uint32[j];
+            OCLDevice d(available_devices[device_idx]);
+            g_unified[j] = (d.m_properties.host_unified_memory != CL_FALSE);
+
+            //Devices sharing host memory gain nothing from a staging copy
+            if (g_unified[j]) continue;
+
+            try {
+                g_staging[j] = new OCLStagingRing(g_context, g_queues[j]);
+                g_staging[j]->set_profiler(g_profiler, j);
+            } catch (OCLError err) {
+                dbg_printf("No pinned staging for device %d (%d)\n", j, err.m_code);
+                g_staging[j] = 0;
+            }
         }
 
         return_value = 1;
@@ -694,9 +1467,55 @@ void add_file(mxArray *plhs[], const mxArray *filename) {
     plhs[0] = mxCreateLogicalScalar(return_value);
 }
 
-void build(mxArray *plhs[]) {
+static void add_elementwise(mxArray *plhs[], const mxArray *types) {
+    std::vector<std::string> type_names;
+    if ((types != 0) && !mxIsEmpty(types)) {
+        if (!mxIsCell(types))
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:add_elementwise", "types must be a cell array of class names");
+
+        for (size_t i=0; i<mxGetNumberOfElements(types); ++i) {
+            const mxArray *name = mxGetCell(types, i);
+            if ((name == 0) || !mxIsChar(name))
+                mexErrMsgIdAndTxt("MATLAB:openclcmd:add_elementwise", "types must be a cell array of class names");
+
+            int len = mxGetNumberOfElements(name);
+            std::vector<char> buf(len+1);
+            mxGetString(name, &buf[0], len+1);
+            type_names.push_back(std::string(&buf[0]));
+        }
+    }
+
+    int return_value = 0;
+    try {
+        g_program->add_source(OCLKernelGenerator::elementwise(type_names));
+        return_value = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "add_elementwise: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch (...) {
+        dbg_printf("FAIL\n");
+        std::cout << "add_elementwise: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_value);
+}
+
+void build(mxArray *plhs[], const mxArray *cache_dir) {
     int return_value = 0;
     try {
+        std::vector<char> dir(1, 0);
+        if ((cache_dir != 0) && !mxIsEmpty(cache_dir)) {
+            int len = mxGetNumberOfElements(cache_dir);
+            dir.resize(len+1);
+            mxGetString(cache_dir, &dir[0], len+1);
+        }
+        g_program->set_cache_dir(&dir[0]);
+
+        //Kernels created from the previous build are not shared with new
+        //create_kernel calls. They stay valid until destroyed.
+        g_kernel_cache.clear();
+
         g_program->create();
         g_program->build();
 
@@ -739,7 +1558,7 @@ static void create_buffer(mxArray *plhs[], const mxArray *mode, const mxArray *s
     std::vector<char> buf;
     buf.resize(len+1);
     mxGetString(mode, &buf[0], len+1);
-    int flags;
+    int flags = MEM_FLAGS_READ_WRITE;
     int nSz;
 
     nSz = static_cast<int>(mxGetScalar(sz));
@@ -760,22 +1579,15 @@ static void create_buffer(mxArray *plhs[], const mxArray *mode, const mxArray *s
         }
     } 
 
-    len = -1;
+    if ((len > 2) && (buf[2] == 'h')) {
+        flags |= MEM_FLAGS_ALLOC_HOST_PTR;
+    }
+
+    double handle = -1;
     try {        
-        len = g_buffers.size();
-        dbg_printf("Size of buffer = %d\n", len);
-       
-        OCLBuffer *b = new OCLBuffer(*g_context, flags, nSz);
-
-	    //Check to see if we have a free buffer index first:
-	    if (g_free_buffer_pool.empty()) {
-             g_buffers.push_back(b);
-	    } else {
-	        unsigned int freeidx = g_free_buffer_pool[g_free_buffer_pool.size()-1];
-	        g_free_buffer_pool.pop_back();
-	        g_buffers[freeidx] = b;
-	        len = static_cast<int>(freeidx);
-        } 
+        OCLBuffer *b = g_pool->acquire(flags, nSz);
+        handle = g_buffers.add(b);
+        dbg_printf("Buffer handle = %u\n", (unsigned int) handle);
     } catch (OCLError err) {
         dbg_printf("FAIL\n");
         std::cout << "create_buffer: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
@@ -785,33 +1597,32 @@ static void create_buffer(mxArray *plhs[], const mxArray *mode, const mxArray *s
         std::cout << "create_buffer: Unknown error occurred!" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
     }
-    plhs[0] = mxCreateDoubleScalar(len);
+    plhs[0] = mxCreateDoubleScalar(handle);
 }
 
 void destroy_buffer(mxArray *plhs[], const mxArray *buffer_id) {
-    unsigned int idx = static_cast<int>(mxGetScalar(buffer_id) );
+    double handle = mxGetScalar(buffer_id);
 
     int returnval = 0;
     try {
-	    if ((idx < 0) || (idx >= g_buffers.size())) {
-	        //throw idx;
-	        return;  //Already de-allocated
-	    }
-
-	    if (g_buffers[idx] == 0) return;  //Already de-allocated. 
-	
-	    delete g_buffers[idx];
-	    g_buffers[idx] = 0;
-	    g_free_buffer_pool.push_back(idx);
-	    returnval = 1;
+        //Already de-allocated (e.g. after re-initialization) if not found
+        OCLBuffer *b = (handle >= 0) ? g_buffers.remove((unsigned int) handle) : 0;
+        std::map<OCLBuffer *, OCLMappedFile *>::iterator it = g_mapped_files.find(b);
+        if ((b != 0) && (it != g_mapped_files.end())) {
+            //Wait for the commands still using the file's pages
+            for (size_t i=0; i<g_queues.size(); ++i) g_queues[i]->finish();
+            delete b;
+            delete it->second;
+            g_mapped_files.erase(it);
+            returnval = 1;
+        } else if (b != 0) {
+            g_pool->release(b);
+            returnval = 1;
+        }
     } catch (OCLError err) {
         dbg_printf("FAIL\n");
         std::cout << "destroy_buffer: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
-    } catch (unsigned int i) {
-	    std::cout << "Invalid buffer id value " << i << std::endl;
-	    std::cout << "Current buffer size " << g_buffers.size() << std::endl;
-        mexErrMsgTxt("Runtime error! (See error message above)");        
     } catch (...) {
         dbg_printf("FAIL\n");
         std::cout << "destroy_buffer: Unknown error occurred!" << std::endl;
@@ -820,8 +1631,58 @@ void destroy_buffer(mxArray *plhs[], const mxArray *buffer_id) {
     plhs[0] = mxCreateLogicalScalar(returnval);
 }
 
-static void set_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, const mxArray *data) {
-    int sz = mxGetNumberOfElements(data);
+//Blocking copy from host memory to a buffer. Buffers in host memory are 
+//mapped, large copies to discrete devices go through the pinned staging ring.
+static void upload_buffer(size_t dev_idx, OCLBuffer &dst, const void *src, size_t sz) {
+    OCLCommandQueue *q = lookup_queue(dev_idx);
+    OCLEvent evt;
+
+    if (sz == 0) {
+        q->finish();
+    } else if (dst.m_flags & CL_MEM_ALLOC_HOST_PTR) {
+        void *p = q->enqueue_map_buffer(dst, CL_MAP_WRITE, sz);
+        memcpy(p, src, sz);
+        q->enqueue_unmap(dst, p, 0, NULL, g_profiler ? &evt : NULL);
+        if (g_profiler) g_profiler->record("upload", dev_idx, sz, evt);
+        q->finish();
+    } else if ((g_staging[dev_idx] != 0) && (sz >= STAGING_MIN_BYTES)) {
+        //Chunks are copied from the ring's own buffers, which out-of-order
+        //queues do not order against the commands on dst
+        if (q->out_of_order()) dst.wait_access(true);
+        g_staging[dev_idx]->upload(dst, src, sz);
+        g_staging[dev_idx]->finish();
+    } else {
+        q->enqueue_buffer_copy(dst, src, sz, 0, CL_FALSE, 0, NULL, g_profiler ? &evt : NULL);
+        if (g_profiler) g_profiler->record("upload", dev_idx, sz, evt);
+        q->finish();
+    }
+}
+
+//Blocking copy from a buffer to host memory (see upload_buffer)
+static void download_buffer(size_t dev_idx, void *dst, OCLBuffer &src, size_t sz) {
+    OCLCommandQueue *q = lookup_queue(dev_idx);
+    OCLEvent evt;
+
+    if (sz == 0) {
+        q->finish();
+    } else if (src.m_flags & CL_MEM_ALLOC_HOST_PTR) {
+        void *p = q->enqueue_map_buffer(src, CL_MAP_READ, sz, 0, CL_TRUE, 0, NULL, g_profiler ? &evt : NULL);
+        if (g_profiler) g_profiler->record("download", dev_idx, sz, evt);
+        memcpy(dst, p, sz);
+        q->enqueue_unmap(src, p);
+        q->finish();
+    } else if ((g_staging[dev_idx] != 0) && (sz >= STAGING_MIN_BYTES)) {
+        if (q->out_of_order()) src.wait_access(false);
+        g_staging[dev_idx]->download(dst, src, sz);
+    } else {
+        q->enqueue_buffer_copy(dst, src, sz, 0, CL_FALSE, 0, NULL, g_profiler ? &evt : NULL);
+        if (g_profiler) g_profiler->record("download", dev_idx, sz, evt);
+        q->finish(); //When a copy occurs, need to wait before returning.. otherwise, crash will happen
+    }
+}
+
+static size_t array_num_bytes(const mxArray *data) {
+    size_t sz = mxGetNumberOfElements(data);
     if (mxIsDouble(data)) {
         sz *= 8;
     } else if (mxIsSingle(data)) {
@@ -835,37 +1696,186 @@ static void set_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArr
     } else if (mxIsInt64(data) || mxIsUint64(data)) {
         sz *= 8;
     }
-    void *pData = mxGetData(data);
-    size_t buf_idx = (size_t) mxGetScalar(bufferNumber);
-    size_t dev_idx = (size_t) mxGetScalar(deviceNumber);
+    return sz;
+}
+
+//Size in bytes of one element of the given type name. 0 if unsupported.
+static size_t type_num_bytes(const char *type) {
+    if ((strcmp(type, "int8") == 0) || (strcmp(type, "uint8") == 0))   return 1;
+    if ((strcmp(type, "int16") == 0) || (strcmp(type, "uint16") == 0)) return 2;
+    if ((strcmp(type, "int32") == 0) || (strcmp(type, "uint32") == 0)) return 4;
+    if ((strcmp(type, "int64") == 0) || (strcmp(type, "uint64") == 0)) return 8;
+    if (strcmp(type, "single") == 0) return 4;
+    if (strcmp(type, "double") == 0) return 8;
+    if ((strcmp(type, "char") == 0) || (strcmp(type, "logical") == 0)) return 1;
+    return 0;
+}
+
+//Create a 1 x nElems array of the given type name. Returns 0 if the type is
+//not supported.
+static mxArray *create_typed_array(const char *type, size_t nElems) {
+    mxArray *arr = 0;
+    size_t mrows = 1;
+
+    if (strcmp(type, "int8") == 0) {                
+         arr = mxCreateNumericMatrix(mrows,nElems, mxINT8_CLASS, mxREAL);
+    } else if (strcmp(type, "int16") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxINT16_CLASS, mxREAL);                                
+    } else if (strcmp(type, "int32") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxINT32_CLASS, mxREAL);
+    } else if (strcmp(type, "int64") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxINT64_CLASS, mxREAL);
+    } else if (strcmp(type, "uint8") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT8_CLASS, mxREAL);
+    } else if (strcmp(type, "uint16") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT16_CLASS, mxREAL);
+    } else if (strcmp(type, "uint32") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT32_CLASS, mxREAL);                
+    } else if (strcmp(type, "uint64") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT64_CLASS, mxREAL);
+    } else if (strcmp(type, "single") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxSINGLE_CLASS, mxREAL);
+    } else if (strcmp(type, "double") == 0) {
+         arr = mxCreateNumericMatrix(mrows,nElems, mxDOUBLE_CLASS, mxREAL);                
+    } else if (strcmp(type, "char") == 0) {
+         mwSize dims[2] = {mrows, nElems};                
+         arr = mxCreateCharArray(2, dims);
+    } else if (strcmp(type, "logical") == 0) {
+         mwSize dims[2] = {mrows, nElems};                
+         arr = mxCreateLogicalArray(2, dims);                
+    }
+
+    return arr;
+}
+
+//Store a pending transfer and return its event id
+static double add_event(PendingTransfer *t) {
+    return g_events.add(t);
+}
 
+static void set_pool_limit(mxArray *plhs[], const mxArray *num_bytes) {
     int return_val = 0;
     try {
-        g_queues[dev_idx]->enqueue_buffer_copy(*g_buffers[buf_idx], pData, sz);
-        g_queues[dev_idx]->finish();
+        g_pool->set_high_water((size_t) mxGetScalar(num_bytes));
         return_val = 1;
     } catch(OCLError err) {
         dbg_printf("FAIL\n");
-        std::cout << "set_buffer: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        std::cout << "set_pool_limit: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
     } catch(...) {
         dbg_printf("FAIL\n");
-        std::cout << "set_buffer: Unknown error occurred!" << std::endl;
+        std::cout << "set_pool_limit: Unknown error occurred!" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
     }
     plhs[0] = mxCreateLogicalScalar(return_val);
 }
 
-static void wait_queue(mxArray *plhs[], const mxArray *deviceNumber) {
+static void set_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, const mxArray *data) {
+    size_t sz = array_num_bytes(data);
+    void *pData = mxGetData(data);
+    double buf_idx = mxGetScalar(bufferNumber);
     size_t dev_idx = (size_t) mxGetScalar(deviceNumber);
-    int return_val = 0;
 
-    try{
-        g_queues[dev_idx]->finish();
+    int return_val = 0;
+    try {
+        upload_buffer(dev_idx, *lookup_buffer(buf_idx), pData, sz);
         return_val = 1;
     } catch(OCLError err) {
         dbg_printf("FAIL\n");
-        std::cout << "wait_queue: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        std::cout << "set_buffer: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "set_buffer: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+//Throw unless file holds sz bytes from byte offset
+static void check_file_range(const OCLMappedFile &file, cl_ulong offset, size_t sz) {
+    if ((offset > file.size()) || (sz > file.size() - offset))
+        throw OCLError(CL_INVALID_VALUE, "load_file: range past the end of the file");
+}
+
+static void load_file(mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    double offset_arg = mxGetScalar(prhs[2]);
+    double sz_arg = mxGetScalar(prhs[3]);
+    double buf_idx = mxGetScalar(prhs[4]);
+    size_t dev_idx = (nrhs > 5) ? (size_t) mxGetScalar(prhs[5]) : 0;
+
+    if (!mxIsChar(prhs[1]))
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:load_file", "File name must be a string");
+
+    //A size of 0 would map the whole rest of the file
+    if (!(offset_arg >= 0) || !(sz_arg >= 1))
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:load_file", "Offset must be non-negative and nBytes positive");
+
+    cl_ulong offset = (cl_ulong) offset_arg;
+    size_t sz = (size_t) sz_arg;
+
+    std::vector<char> path;
+    int len = mxGetNumberOfElements(prhs[1]);
+    path.resize(len+1);
+    mxGetString(prhs[1], &path[0], len+1);
+
+    double handle = -1;
+    OCLMappedFile *file = 0;
+    OCLBuffer *b = 0;
+    try {
+        lookup_queue(dev_idx);
+        if (buf_idx >= 0) {
+            b = lookup_buffer(buf_idx);
+            if (sz > b->m_size) throw OCLError(CL_INVALID_VALUE, "load_file: more bytes than the buffer holds");
+
+            OCLMappedFile src(&path[0]);
+            check_file_range(src, offset, sz);
+            upload_buffer(dev_idx, *b, src.map(offset, sz), sz);
+            handle = buf_idx;
+        } else if (g_unified[dev_idx]) {
+            //Private mapping: kernels writing the buffer must not change the file
+            file = new OCLMappedFile(&path[0], OCLMappedFile::COPY_ON_WRITE);
+            check_file_range(*file, offset, sz);
+            b = new OCLBuffer(g_context->id(), MEM_FLAGS_READ_WRITE | CL_MEM_USE_HOST_PTR, sz, file->map(offset, sz));
+            handle = g_buffers.add(b);
+            g_mapped_files[b] = file;
+        } else {
+            OCLMappedFile src(&path[0]);
+            check_file_range(src, offset, sz);
+            const void *p = src.map(offset, sz);
+            b = g_pool->acquire(MEM_FLAGS_READ_WRITE, sz);
+            upload_buffer(dev_idx, *b, p, sz);
+            handle = g_buffers.add(b);
+        }
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        //A buffer created here was not added to g_buffers yet
+        if ((buf_idx < 0) && (file != 0)) {
+            delete b;
+            delete file;
+        } else if ((buf_idx < 0) && (b != 0)) {
+            g_pool->release(b);
+        }
+        std::cout << "load_file: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "load_file: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateDoubleScalar(handle);
+}
+
+static void wait_queue(mxArray *plhs[], const mxArray *deviceNumber) {
+    size_t dev_idx = (size_t) mxGetScalar(deviceNumber);
+    int return_val = 0;
+
+    try{
+        lookup_queue(dev_idx)->finish();
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "wait_queue: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
     } catch(...) {
         dbg_printf("FAIL\n");
@@ -879,9 +1889,9 @@ static void wait_queue(mxArray *plhs[], const mxArray *deviceNumber) {
 static void get_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, 
     const mxArray *num_elements, const mxArray *type) {
     size_t dev_idx = (size_t) mxGetScalar(deviceNumber);
-    size_t buf_idx = (size_t) mxGetScalar(bufferNumber);
+    double buf_idx = mxGetScalar(bufferNumber);
    
-    size_t sz = (size_t) mxGetScalar(num_elements);
+    size_t nElems = (size_t) mxGetScalar(num_elements);
 
     int len = mxGetNumberOfElements(type);
 
@@ -889,48 +1899,8 @@ static void get_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArr
     type_str.resize(len+1);
     mxGetString(type, &type_str[0], len+1);
 
-    mxArray *arr = 0;
-
-    size_t mrows = 1;
-    size_t nElems = sz;
-
-    if (strcmp(&type_str[0], "int8") == 0) {                
-         arr = mxCreateNumericMatrix(mrows,nElems, mxINT8_CLASS, mxREAL);
-         sz *= 1;
-    } else if (strcmp(&type_str[0], "int16") == 0) {
-         sz *= 2;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxINT16_CLASS, mxREAL);                                
-    } else if (strcmp(&type_str[0], "int32") == 0) {
-         sz *= 4;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxINT32_CLASS, mxREAL);
-    } else if (strcmp(&type_str[0], "int64") == 0) {
-         sz *= 8;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxINT64_CLASS, mxREAL);
-    } else if (strcmp(&type_str[0], "uint8") == 0) {
-         sz *= 1;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT8_CLASS, mxREAL);
-    } else if (strcmp(&type_str[0], "uint16") == 0) {
-         sz *= 2;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT16_CLASS, mxREAL);
-    } else if (strcmp(&type_str[0], "uint32") == 0) {
-         sz *= 4;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT32_CLASS, mxREAL);                
-    } else if (strcmp(&type_str[0], "uint64") == 0) {
-         sz *= 8;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxUINT64_CLASS, mxREAL);
-    } else if (strcmp(&type_str[0], "single") == 0) {
-         sz *= 4;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxSINGLE_CLASS, mxREAL);
-    } else if (strcmp(&type_str[0], "double") == 0) {
-         sz *= 8;
-         arr = mxCreateNumericMatrix(mrows,nElems, mxDOUBLE_CLASS, mxREAL);                
-    } else if (strcmp(&type_str[0], "char") == 0) {
-         mwSize dims[2] = {mrows, nElems};                
-         arr = mxCreateCharArray(2, dims);
-    } else if (strcmp(&type_str[0], "logical") == 0) {
-         mwSize dims[2] = {mrows, nElems};                
-         arr = mxCreateLogicalArray(2, dims);                
-    } else {
+    mxArray *arr = create_typed_array(&type_str[0], nElems);
+    if (arr == 0) {
         dbg_printf("FAIL\n");
         std::cout << "get_buffer: Unsupported data type!" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
@@ -938,10 +1908,11 @@ static void get_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArr
         return;
     }
 
+    size_t sz = nElems * type_num_bytes(&type_str[0]);
+
     try {
         void *dst = mxGetData(arr); 
-        g_queues[dev_idx]->enqueue_buffer_copy(dst, *g_buffers[buf_idx], sz, 0, CL_FALSE);
-        g_queues[dev_idx]->finish(); //When a copy occurs, need to wait before returning.. otherwise, crash will happen
+        download_buffer(dev_idx, dst, *lookup_buffer(buf_idx), sz);
         plhs[0] = arr;
     } catch(OCLError err) {
         dbg_printf("FAIL\n");
@@ -954,6 +1925,132 @@ static void get_buffer(mxArray *plhs[], const mxArray *deviceNumber, const mxArr
     }
 }
 
+static void set_buffer_async(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, const mxArray *data) {
+    size_t sz = array_num_bytes(data);
+    double buf_idx = mxGetScalar(bufferNumber);
+    size_t dev_idx = (size_t) mxGetScalar(deviceNumber);
+
+    double event_idx = -1;
+    PendingTransfer *t = 0;
+    try {
+        t = new PendingTransfer;
+        t->num_elems = 0;
+        t->host.resize(sz);
+        if (sz > 0) memcpy(&t->host[0], mxGetData(data), sz);
+
+        lookup_queue(dev_idx)->enqueue_buffer_copy(*lookup_buffer(buf_idx), (sz > 0) ? &t->host[0] : 0, sz, 0, CL_FALSE, 0, NULL, &t->event);
+        if (g_profiler) g_profiler->record("upload", dev_idx, sz, t->event);
+        lookup_queue(dev_idx)->flush();
+        event_idx = add_event(t);
+    } catch(OCLError err) {
+        discard_event(t);
+        dbg_printf("FAIL\n");
+        std::cout << "set_buffer_async: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        discard_event(t);
+        dbg_printf("FAIL\n");
+        std::cout << "set_buffer_async: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateDoubleScalar(event_idx);
+}
+
+static void get_buffer_async(mxArray *plhs[], const mxArray *deviceNumber, const mxArray *bufferNumber, 
+    const mxArray *num_elements, const mxArray *type) {
+    size_t dev_idx = (size_t) mxGetScalar(deviceNumber);
+    double buf_idx = mxGetScalar(bufferNumber);
+    size_t nElems = (size_t) mxGetScalar(num_elements);
+
+    int len = mxGetNumberOfElements(type);
+
+    std::vector<char> type_str;
+    type_str.resize(len+1);
+    mxGetString(type, &type_str[0], len+1);
+
+    size_t sz = nElems * type_num_bytes(&type_str[0]);
+    if (type_num_bytes(&type_str[0]) == 0) {
+        dbg_printf("FAIL\n");
+        std::cout << "get_buffer_async: Unsupported data type!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+        return;
+    }
+
+    double event_idx = -1;
+    PendingTransfer *t = 0;
+    try {
+        t = new PendingTransfer;
+        t->type = &type_str[0];
+        t->num_elems = nElems;
+        t->host.resize(sz);
+
+        lookup_queue(dev_idx)->enqueue_buffer_copy((sz > 0) ? &t->host[0] : 0, *lookup_buffer(buf_idx), sz, 0, CL_FALSE, 0, NULL, &t->event);
+        if (g_profiler) g_profiler->record("download", dev_idx, sz, t->event);
+        lookup_queue(dev_idx)->flush();
+        event_idx = add_event(t);
+    } catch(OCLError err) {
+        discard_event(t);
+        dbg_printf("FAIL\n");
+        std::cout << "get_buffer_async: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        discard_event(t);
+        dbg_printf("FAIL\n");
+        std::cout << "get_buffer_async: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateDoubleScalar(event_idx);
+}
+
+static void wait_event(mxArray *plhs[], const mxArray *eventNumber) {
+    double handle = mxGetScalar(eventNumber);
+
+    PendingTransfer *t = (handle >= 0) ? g_events.remove((unsigned int) handle) : 0;
+    if (t == 0) {
+        std::cout << "wait_event: Invalid or already waited event id " << handle << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+        return;
+    }
+
+    mxArray *arr = 0;
+    try {
+        t->event.wait();
+
+        if (t->type.empty()) {
+            arr = mxCreateLogicalScalar(1);
+        } else {
+            arr = create_typed_array(t->type.c_str(), t->num_elems);
+            if (!t->host.empty()) memcpy(mxGetData(arr), &t->host[0], t->host.size());
+        }
+        delete t;
+        t = 0;
+    } catch(OCLError err) {
+        discard_event(t);
+        dbg_printf("FAIL\n");
+        std::cout << "wait_event: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        discard_event(t);
+        dbg_printf("FAIL\n");
+        std::cout << "wait_event: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = arr;
+}
+
+//Store kernel in g_kernels with one reference, shared by later requests 
+//for key. Returns the kernel id.
+static unsigned int add_kernel(OCLKernel *kernel, const std::string &key) {
+    KernelEntry *entry = new KernelEntry;
+    entry->kernel = kernel;
+    entry->key = key;
+    entry->refs = 1;
+
+    unsigned int handle = g_kernels.add(entry);
+    g_kernel_cache[key] = handle;
+    return handle;
+}
+
 static void create_kernels(mxArray *plhs[], const mxArray *local, const mxArray *global, const mxArray *name) {
     //Require local and global to be cast to uint32!
 
@@ -981,15 +2078,27 @@ static void create_kernels(mxArray *plhs[], const mxArray *local, const mxArray
     int ndims = 0;
     for (ndims =0; (ndims < 3) && (global_size[ndims] > 0) ; ++ndims) {}
 
+    std::ostringstream key;
+    key << &kernel_name[0] << ":" << ndims 
+        << ":" << local_size[0] << "," << local_size[1] << "," << local_size[2] 
+        << ":" << global_size[0] << "," << global_size[1] << "," << global_size[2];
+
+    std::map<std::string, unsigned int>::iterator it = g_kernel_cache.find(key.str());
+    if (it != g_kernel_cache.end()) {
+        g_kernels.get(it->second)->refs++;
+        plhs[0] = mxCreateDoubleScalar(it->second);
+        return;
+    }
+
     try {
         OCLKernel *kernel = new OCLKernel(*g_program, &kernel_name[0]);
 		kernel->set_global_offset(0,0,0);
 		kernel->set_ndims(ndims);
+		kernel->set_auto_size(ndims == 0);
 		kernel->set_local_size(local_size[0],local_size[1],local_size[2]);
         kernel->set_global_size(global_size[0],global_size[1],global_size[2]);
-        len = g_kernels.size();
-        g_kernels.resize(len+1);
-        g_kernels[len] = kernel;
+
+        len = add_kernel(kernel, key.str());
     } catch(OCLError err) {
         dbg_printf("FAIL\n");
         std::cout << "create_kernels: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
@@ -1005,13 +2114,143 @@ static void create_kernels(mxArray *plhs[], const mxArray *local, const mxArray
     plhs[0] = mxCreateDoubleScalar(len);
 }
 
-void execute_kernel(mxArray *plhs[], const mxArray *device_id, const mxArray *kernel_id) {
+static void compile_kernel(mxArray *plhs[], const mxArray *source, const mxArray *name) {
+    int len = mxGetNumberOfElements(source);
+    std::vector<char> text;
+    text.resize(len+1);
+    mxGetString(source, &text[0], len+1);
+
+    std::vector<char> kernel_name;
+    len = mxGetNumberOfElements(name);
+    kernel_name.resize(len+1);
+    mxGetString(name, &kernel_name[0], len+1);
+
+    //Source text is part of the key, so equal names in different sources 
+    //are not confused with each other or with create_kernel kernels
+    std::string key = std::string(&kernel_name[0]) + ":source:" + &text[0];
+
+    std::map<std::string, unsigned int>::iterator it = g_kernel_cache.find(key);
+    if (it != g_kernel_cache.end()) {
+        g_kernels.get(it->second)->refs++;
+        plhs[0] = mxCreateDoubleScalar(it->second);
+        return;
+    }
+
+    int idx = -1;
+    try {
+        OCLProgram *program = 0;
+        std::map<std::string, OCLProgram *>::iterator pit = g_source_programs.find(&text[0]);
+        if (pit != g_source_programs.end()) {
+            program = pit->second;
+        } else {
+            program = new OCLProgram(*g_context);
+            program->add_source(std::string(&text[0]));
+            program->set_cache_dir(g_program->m_cache_dir.c_str());
+            program->build();
+
+            std::string err_msg;
+            for (int i=0; i < program->m_build_status.size(); ++i) {
+                if (program->m_build_status[i].status == CL_BUILD_ERROR) {
+                    err_msg += "Error: \n";
+                    err_msg += program->m_build_status[i].log;
+                    err_msg += "\n";
+                }
+            }
+
+            if (!err_msg.empty()) {
+                delete program;
+                throw OCLError(CL_BUILD_ERROR, err_msg.c_str());
+            }
+            g_source_programs[&text[0]] = program;
+        }
+
+        OCLKernel *kernel = new OCLKernel(*program, &kernel_name[0]);
+		kernel->set_global_offset(0,0,0);
+		kernel->set_ndims(0);
+		kernel->set_auto_size(true);
+
+        idx = add_kernel(kernel, key);
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "compile_kernel: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "compile_kernel: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+
+    plhs[0] = mxCreateDoubleScalar(idx);
+}
+
+static void destroy_kernel(mxArray *plhs[], const mxArray *kernel_id) {
+    double handle = mxGetScalar(kernel_id);
+
+    int returnval = 0;
+    KernelEntry *entry = (handle >= 0) ? g_kernels.get((unsigned int) handle) : 0;
+    if (entry == 0) {
+        //Already de-allocated (e.g. after re-initialization)
+        plhs[0] = mxCreateLogicalScalar(returnval);
+        return;
+    }
+
+    try {
+        if (--entry->refs == 0) {
+            std::map<std::string, unsigned int>::iterator it = g_kernel_cache.find(entry->key);
+            if ((it != g_kernel_cache.end()) && (it->second == (unsigned int) handle)) g_kernel_cache.erase(it);
+            g_kernels.remove((unsigned int) handle);
+            delete entry->kernel;
+            delete entry;
+            returnval = 1;
+        }
+    } catch (OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "destroy_kernel: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch (...) {
+        dbg_printf("FAIL\n");
+        std::cout << "destroy_kernel: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(returnval);
+}
+
+//Set argument arg_idx of a kernel to a buffer (buf_idx >= 0), to the 
+//constant in data, or to a local variable of sz bytes (data empty)
+static void set_kernel_arg(double kernel_idx, size_t arg_idx, double buf_idx, const mxArray *data, size_t sz) {
+    if (buf_idx >= 0) {
+        (*lookup_kernel(kernel_idx))[arg_idx] = *lookup_buffer(buf_idx);
+    } else if ((data != 0) && !mxIsEmpty(data)) {
+        (*lookup_kernel(kernel_idx))(arg_idx, array_num_bytes(data)) = mxGetData(data);
+    } else {
+        (*lookup_kernel(kernel_idx))(arg_idx, sz) = 0;
+    }
+}
+
+//Enqueue a kernel. nItems sizes kernels created with zero global dims.
+static void launch_kernel(size_t dev_idx, double kernel_idx, size_t nItems) {
+    OCLKernel *kernel = lookup_kernel(kernel_idx);
+    OCLCommandQueue *q = lookup_queue(dev_idx);
+    if (kernel->m_auto_size && !g_tuner->apply(*kernel, q->m_device, nItems)) {
+        kernel->auto_size(q->m_device, nItems);
+    }
+    if (g_profiler && !q->recording()) {
+        OCLEvent evt;
+        q->enqueue_ndrange_kernel(kernel, &evt);
+        g_profiler->record(kernel->m_function_name, dev_idx, 0, evt);
+    } else {
+        q->enqueue_ndrange_kernel(kernel);
+    }
+}
+
+void execute_kernel(mxArray *plhs[], const mxArray *device_id, const mxArray *kernel_id, const mxArray *num_items) {
     size_t dev_idx = (size_t) mxGetScalar(device_id);
-    size_t kernel_idx = (size_t) mxGetScalar(kernel_id);
+    double kernel_idx = mxGetScalar(kernel_id);
+    size_t nItems = (num_items != 0) ? (size_t) mxGetScalar(num_items) : 0;
    
     int return_val = 0;
     try {
-        g_queues[dev_idx]->enqueue_ndrange_kernel(g_kernels[kernel_idx]);
+        launch_kernel(dev_idx, kernel_idx, nItems);
         return_val = 1;
     } catch(OCLError err) {
         dbg_printf("FAIL\n");
@@ -1025,6 +2264,354 @@ void execute_kernel(mxArray *plhs[], const mxArray *device_id, const mxArray *ke
     plhs[0] = mxCreateLogicalScalar(return_val);
 }
 
+static void schedule_kernel(mxArray *plhs[], const mxArray *kernel_id, const mxArray *num_items, const mxArray *tile_size) {
+    double kernel_idx = mxGetScalar(kernel_id);
+    size_t nItems = (size_t) mxGetScalar(num_items);
+    size_t tile = (tile_size != 0) ? (size_t) mxGetScalar(tile_size) : 65536;
+
+    try {
+        OCLKernel *kernel = lookup_kernel(kernel_idx);
+        if (g_queues.empty()) throw OCLError(CL_INVALID_DEVICE, "schedule_kernel: no devices (see initialize)");
+
+        OCLScheduler scheduler(g_queues, tile);
+        scheduler.run(*kernel, nItems);
+
+        plhs[0] = mxCreateDoubleMatrix(1, g_queues.size(), mxREAL);
+        double *tiles = mxGetPr(plhs[0]);
+        for (size_t i=0; i<g_queues.size(); ++i) tiles[i] = (double) scheduler.m_tiles_done[i];
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "schedule_kernel: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "schedule_kernel: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+}
+
+static void autotune(mxArray *plhs[], const mxArray *device_id, const mxArray *kernel_id, 
+    const mxArray *num_items, const mxArray *grid_stride) {
+    size_t dev_idx = (size_t) mxGetScalar(device_id);
+    double kernel_idx = mxGetScalar(kernel_id);
+    size_t nItems = (size_t) mxGetScalar(num_items);
+    bool bGridStride = (mxGetScalar(grid_stride) != 0);
+
+    OCLAutotuneEntry best;
+    best.local_size = 0;
+    best.global_size = 0;
+    try {
+        //Inputs may still be uploading on the device queue
+        lookup_queue(dev_idx)->finish();
+
+        best = g_tuner->tune(*lookup_kernel(kernel_idx), lookup_queue(dev_idx)->m_device, nItems, bGridStride);
+        g_tuner->save();
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "autotune: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "autotune: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+
+    plhs[0] = mxCreateDoubleMatrix(1, 2, mxREAL);
+    double *pr = mxGetPr(plhs[0]);
+    pr[0] = (double) best.local_size;
+    pr[1] = (double) best.global_size;
+}
+
+static void set_tuning_file(mxArray *plhs[], const mxArray *filename) {
+    int len = mxGetNumberOfElements(filename);
+    std::vector<char> path;
+    path.resize(len+1);
+    mxGetString(filename, &path[0], len+1);
+
+    int return_val = 0;
+    try {
+        g_tuner->set_file(&path[0]);
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "set_tuning_file: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "set_tuning_file: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void vector_width(mxArray *plhs[], const mxArray *device_id, const mxArray *type) {
+    size_t dev_idx = (size_t) mxGetScalar(device_id);
+    std::string type_name("single");
+    if (type != 0) {
+        int len = mxGetNumberOfElements(type);
+        std::vector<char> type_str(len+1);
+        mxGetString(type, &type_str[0], len+1);
+        type_name = &type_str[0];
+    }
+
+    const OCLElementType *elem = OCLKernelGenerator::find_type(type_name);
+    if (elem == 0)
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:vector_width", "Type must be a numeric class (e.g. 'single', 'int32')");
+
+    cl_uint width = 1;
+    try {
+        OCLDevice d(lookup_queue(dev_idx)->m_device);
+        std::string cl_type = elem->cl_type;
+        if (cl_type[0] == 'u') cl_type.erase(0, 1);
+
+        if (cl_type == "char")          width = d.m_properties.preferred_vector_width_char;
+        else if (cl_type == "short")    width = d.m_properties.preferred_vector_width_short;
+        else if (cl_type == "int")      width = d.m_properties.preferred_vector_width_int;
+        else if (cl_type == "long")     width = d.m_properties.preferred_vector_width_long;
+        else if (cl_type == "double")   width = d.m_properties.preferred_vector_width_double;
+        else                            width = d.m_properties.preferred_vector_width_float;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "vector_width: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "vector_width: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateDoubleScalar(width);
+}
+
+static void context_devices(mxArray *plhs[]) {
+    const char *field_names[] = {"name", "compute_units", "clock_frequency", "global_mem_size", "unified_memory", "extensions"};
+    const int num_fields = sizeof(field_names) / sizeof(field_names[0]);
+
+    try {
+        plhs[0] = mxCreateStructMatrix(1, g_queues.size(), num_fields, field_names);
+
+        for (size_t i=0; i<g_queues.size(); ++i) {
+            OCLDevice d(g_queues[i]->m_device);
+            mxSetField(plhs[0], i, "name", mxCreateString(d.m_properties.name.c_str()));
+            mxSetField(plhs[0], i, "compute_units", mxCreateDoubleScalar(d.m_properties.max_compute_units));
+            mxSetField(plhs[0], i, "clock_frequency", mxCreateDoubleScalar(d.m_properties.max_clock_frequency));
+            mxSetField(plhs[0], i, "global_mem_size", mxCreateDoubleScalar((double) d.m_properties.global_mem_size));
+            mxSetField(plhs[0], i, "unified_memory", mxCreateLogicalScalar(g_unified[i]));
+            mxSetField(plhs[0], i, "extensions", mxCreateString(d.m_properties.extensions.c_str()));
+        }
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "context_devices: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "context_devices: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+}
+
+static void get_profile(int nlhs, mxArray *plhs[]) {
+    const char *field_names[] = {"name", "device", "bytes", "queued", "submit", "start", "end"};
+    const int num_fields = sizeof(field_names) / sizeof(field_names[0]);
+
+    if (g_profiler == 0)
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:get_profile", "Profiling is not enabled (see initialize)");
+
+    size_t dropped = g_profiler->m_dropped;
+    try {
+        size_t num_records = g_profiler->size();
+        plhs[0] = mxCreateStructMatrix(1, num_records, num_fields, field_names);
+
+        for (size_t i=0; i<num_records; ++i) {
+            OCLProfileRecord *r = g_profiler->m_records[i];
+            OCLEventProfile t = g_profiler->times(i);
+
+            mxSetField(plhs[0], i, "name", mxCreateString(r->name.c_str()));
+            mxSetField(plhs[0], i, "device", mxCreateDoubleScalar(r->device + 1));
+            mxSetField(plhs[0], i, "bytes", mxCreateDoubleScalar((double) r->bytes));
+            mxSetField(plhs[0], i, "queued", mxCreateDoubleScalar((double) t.time_queued));
+            mxSetField(plhs[0], i, "submit", mxCreateDoubleScalar((double) t.time_submit));
+            mxSetField(plhs[0], i, "start", mxCreateDoubleScalar((double) t.time_start));
+            mxSetField(plhs[0], i, "end", mxCreateDoubleScalar((double) t.time_end));
+        }
+        g_profiler->clear();
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "get_profile: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "get_profile: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+
+    if (nlhs > 1) plhs[1] = mxCreateDoubleScalar((double) dropped);
+}
+
+static void write_trace(mxArray *plhs[], const mxArray *filename) {
+    if (g_profiler == 0)
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:write_trace", "Profiling is not enabled (see initialize)");
+
+    if (!mxIsChar(filename))
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:write_trace", "Filename must be a string");
+
+    int nChars = mxGetN(filename)+1;
+    std::vector<char> path;
+    path.resize(nChars);
+    mxGetString(filename, &path[0], nChars);
+
+    bool success = false;
+    try {
+        success = g_profiler->write_trace(&path[0]);
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "write_trace: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "write_trace: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+
+    if (!success)
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:write_trace", "Could not write trace file %s", &path[0]);
+
+    plhs[0] = mxCreateLogicalScalar(true);
+}
+
+//BLAS kernels of the device of queue dev_idx, built on first use. They are
+//not built in initialize since most sessions never use them.
+static OCLBlas *get_blas(size_t dev_idx) {
+    OCLCommandQueue *q = lookup_queue(dev_idx);
+    if (g_blas[dev_idx] == 0) {
+        g_blas[dev_idx] = new OCLBlas(*g_context, q->m_device, g_program->m_cache_dir.c_str());
+    }
+    return g_blas[dev_idx];
+}
+
+//Dimension argument of a BLAS command; it must be an integer that fits a cl_int
+static cl_int blas_dim(const mxArray *arg) {
+    double d = mxGetScalar(arg);
+    if (!(d >= 0) || (d > 2147483647.0) || (d != (double) (cl_int) d))
+        throw OCLError(CL_INVALID_VALUE, "BLAS dimensions must be non-negative integers");
+    return (cl_int) d;
+}
+
+//Buffer of a rows x cols single precision BLAS operand. The kernels read
+//and write it packed from offset 0, so it must hold rows*cols floats.
+static cl_mem blas_operand(double handle, cl_int rows, cl_int cols, const char *notes) {
+    OCLBuffer *b = lookup_buffer(handle);
+    if ((double) rows * (double) cols * sizeof(cl_float) > (double) b->m_size)
+        throw OCLError(CL_INVALID_BUFFER_SIZE, notes);
+    return b->id();
+}
+
+static void blas_gemm(mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    size_t dev_idx = (size_t) mxGetScalar(prhs[1]);
+    double a_idx = mxGetScalar(prhs[2]);
+    double b_idx = mxGetScalar(prhs[3]);
+    double c_idx = mxGetScalar(prhs[4]);
+    cl_float alpha = (nrhs > 8) ? (cl_float) mxGetScalar(prhs[8]) : 1.0f;
+    cl_float beta = (nrhs > 9) ? (cl_float) mxGetScalar(prhs[9]) : 0.0f;
+
+    int return_val = 0;
+    try {
+        cl_int M = blas_dim(prhs[5]);
+        cl_int N = blas_dim(prhs[6]);
+        cl_int K = blas_dim(prhs[7]);
+        cl_mem A = blas_operand(a_idx, M, K, "A is smaller than M x K");
+        cl_mem B = blas_operand(b_idx, K, N, "B is smaller than K x N");
+        cl_mem C = blas_operand(c_idx, M, N, "C is smaller than M x N");
+        get_blas(dev_idx)->gemm(*lookup_queue(dev_idx), A, B, C, M, N, K, alpha, beta);
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_gemm: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_gemm: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void blas_gemv(mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    size_t dev_idx = (size_t) mxGetScalar(prhs[1]);
+    double a_idx = mxGetScalar(prhs[2]);
+    double x_idx = mxGetScalar(prhs[3]);
+    double y_idx = mxGetScalar(prhs[4]);
+    cl_float alpha = (nrhs > 7) ? (cl_float) mxGetScalar(prhs[7]) : 1.0f;
+    cl_float beta = (nrhs > 8) ? (cl_float) mxGetScalar(prhs[8]) : 0.0f;
+
+    int return_val = 0;
+    try {
+        cl_int M = blas_dim(prhs[5]);
+        cl_int N = blas_dim(prhs[6]);
+        cl_mem A = blas_operand(a_idx, M, N, "A is smaller than M x N");
+        cl_mem x = blas_operand(x_idx, N, 1, "x is shorter than N");
+        cl_mem y = blas_operand(y_idx, M, 1, "y is shorter than M");
+        get_blas(dev_idx)->gemv(*lookup_queue(dev_idx), A, x, y, M, N, alpha, beta);
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_gemv: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_gemv: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void blas_axpy(mxArray *plhs[], const mxArray *prhs[]) {
+    size_t dev_idx = (size_t) mxGetScalar(prhs[1]);
+    cl_float alpha = (cl_float) mxGetScalar(prhs[3]);
+    double x_idx = mxGetScalar(prhs[4]);
+    double y_idx = mxGetScalar(prhs[5]);
+
+    int return_val = 0;
+    try {
+        cl_int n = blas_dim(prhs[2]);
+        cl_mem x = blas_operand(x_idx, n, 1, "x is shorter than n");
+        cl_mem y = blas_operand(y_idx, n, 1, "y is shorter than n");
+        get_blas(dev_idx)->axpy(*lookup_queue(dev_idx), n, alpha, x, y);
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_axpy: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_axpy: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void blas_scal(mxArray *plhs[], const mxArray *prhs[]) {
+    size_t dev_idx = (size_t) mxGetScalar(prhs[1]);
+    cl_float alpha = (cl_float) mxGetScalar(prhs[3]);
+    double x_idx = mxGetScalar(prhs[4]);
+
+    int return_val = 0;
+    try {
+        cl_int n = blas_dim(prhs[2]);
+        cl_mem x = blas_operand(x_idx, n, 1, "x is shorter than n");
+        get_blas(dev_idx)->scal(*lookup_queue(dev_idx), n, alpha, x);
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_scal: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "blas_scal: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
 //set_kernel_args( kernel_id, arg_num, buffer_id, [], 0 )    arg: buffer
 //set_kernel_args( kernel_id, arg_num, -1, data, 0 )         arg: constant data
 //set_kernel_args( kernel_id, arg_num, -1, [], nBytes )      arg: local variable
@@ -1032,54 +2619,317 @@ void execute_kernel(mxArray *plhs[], const mxArray *device_id, const mxArray *ke
 static void set_kernel_args(mxArray *plhs[], const mxArray *kernel_id, 
     const mxArray *arg_num, const mxArray *buffer_id, const mxArray *data, const mxArray *size) {
 
-    size_t kernel_idx = (size_t) mxGetScalar(kernel_id);
+    double kernel_idx = mxGetScalar(kernel_id);
     size_t arg_idx = (size_t) mxGetScalar(arg_num);
-    int buf_idx = (int) mxGetScalar(buffer_id);
-    void *pdata = 0;
-    int sz = 0;
-
-
-    if (!mxIsEmpty(data)) {
-        //Local type. Compute size
-        pdata = mxGetData(data);
-
-        sz = mxGetNumberOfElements(data);
-        if (mxIsDouble(data)) {
-            sz *= 8;
-        } else if (mxIsSingle(data)) {
-            sz *= 4;
-        } else if (mxIsInt8(data) || mxIsUint8(data)) {
-            sz *= 1;
-        } else if (mxIsInt16(data) || mxIsUint16(data)) {
-            sz *= 2;
-        } else if (mxIsInt32(data) || mxIsUint32(data)) {
-            sz *= 4;
-        } else if (mxIsInt64(data) || mxIsUint64(data)) {
-            sz *= 8;
-        }
+    double buf_idx = mxGetScalar(buffer_id);
+
+    //Local variable types need an explicit size
+    size_t sz = mxIsEmpty(data) ? (size_t) mxGetScalar(size) : 0;
+
+    int return_val = 0;
+    try {
+        set_kernel_arg(kernel_idx, arg_idx, buf_idx, data, sz);
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "set_kernel_args: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "set_kernel_args: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+//Element i of a batch command as a scalar, 0 if missing or empty
+static double batch_scalar(const mxArray *cmd, size_t i) {
+    const mxArray *v = (i < mxGetNumberOfElements(cmd)) ? mxGetCell(cmd, i) : 0;
+    return ((v != 0) && !mxIsEmpty(v)) ? mxGetScalar(v) : 0;
+}
+
+//Check the commands of a batch (see submit_batch) and return the first letter
+//of each: 'a'rg, 'l'aunch or 'c'opy
+static std::vector<char> check_batch(const mxArray *commands, const char *err_id) {
+    if (!mxIsCell(commands))
+        mexErrMsgIdAndTxt(err_id, "Commands must be a cell array");
+
+    size_t num_commands = mxGetNumberOfElements(commands);
+    std::vector<char> ops(num_commands);
+
+    for (size_t i=0; i<num_commands; ++i) {
+        const mxArray *cmd = mxGetCell(commands, i);
+        char op[8];
+        if ((cmd == 0) || !mxIsCell(cmd) || (mxGetNumberOfElements(cmd) < 1) ||
+            (mxGetCell(cmd, 0) == 0) || (mxGetString(mxGetCell(cmd, 0), op, sizeof(op)) != 0))
+            mexErrMsgIdAndTxt(err_id, "Command %d must be a cell array starting with 'arg', 'launch' or 'copy'", (int) i+1);
+
+        size_t min_args = 0;
+        if (strcmp(op, "arg") == 0)          min_args = 6;
+        else if (strcmp(op, "launch") == 0)  min_args = 3;
+        else if (strcmp(op, "copy") == 0)    min_args = 5;
+        else
+            mexErrMsgIdAndTxt(err_id, "Command %d: invalid command '%s'", (int) i+1, op);
+
+        if (mxGetNumberOfElements(cmd) < min_args)
+            mexErrMsgIdAndTxt(err_id, "Command %d: not enough arguments", (int) i+1);
+        ops[i] = op[0];
+    }
+    return ops;
+}
+
+//Run one checked batch command
+static void run_batch_command(const mxArray *cmd, char op) {
+    if (op == 'a') {
+        const mxArray *data = mxGetCell(cmd, 4);
+        size_t sz = ((data == 0) || mxIsEmpty(data)) ? (size_t) batch_scalar(cmd, 5) : 0;
+        set_kernel_arg(batch_scalar(cmd, 1), (size_t) batch_scalar(cmd, 2), 
+            batch_scalar(cmd, 3), data, sz);
+
+    } else if (op == 'l') {
+        launch_kernel((size_t) batch_scalar(cmd, 1), batch_scalar(cmd, 2), 
+            (size_t) batch_scalar(cmd, 3));
 
     } else {
-        //Local type. Needs an explicit size:
-        sz = (int) mxGetScalar(size);
+        size_t dev_idx = (size_t) batch_scalar(cmd, 1);
+        double src_idx = batch_scalar(cmd, 2);
+        double dst_idx = batch_scalar(cmd, 3);
+        size_t sz = (size_t) batch_scalar(cmd, 4);
+
+        OCLCommandQueue *q = lookup_queue(dev_idx);
+        bool profile = (g_profiler != 0) && !q->recording();
+        OCLEvent evt;
+        q->enqueue_buffer_copy(*lookup_buffer(dst_idx), *lookup_buffer(src_idx), sz, 
+            0, 0, 0, NULL, profile ? &evt : NULL);
+        if (profile) g_profiler->record("copy", dev_idx, sz, evt);
     }
+}
+
+static void submit_batch(mxArray *plhs[], const mxArray *commands) {
+    //Check all commands before enqueueing any of them
+    std::vector<char> ops = check_batch(commands, "MATLAB:openclcmd:submit_batch");
+    size_t num_commands = ops.size();
 
     int return_val = 0;
+    size_t i = 0;
     try {
+        for (i=0; i<num_commands; ++i) {
+            run_batch_command(mxGetCell(commands, i), ops[i]);
+        }
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "submit_batch: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" 
+                  << " in command " << (i+1) << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "submit_batch: Unknown error occurred in command " << (i+1) << "!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void record_batch(mxArray *plhs[], const mxArray *commands) {
+    std::vector<char> ops = check_batch(commands, "MATLAB:openclcmd:record_batch");
+    size_t num_commands = ops.size();
+
+    //The graph belongs to the queue of the device of the first launch or copy
+    size_t dev_idx = 0;
+    bool has_device = false;
+    for (size_t i=0; i<num_commands; ++i) {
+        if (ops[i] == 'a') continue;
+        size_t d = (size_t) batch_scalar(mxGetCell(commands, i), 1);
+        if (has_device && (d != dev_idx))
+            mexErrMsgIdAndTxt("MATLAB:openclcmd:record_batch", "Command %d: all launches and copies must be on one device", (int) i+1);
+        dev_idx = d;
+        has_device = true;
+    }
+
+    double handle = -1;
+    size_t i = 0;
+    OCLCommandQueue *q = 0;
+    OCLCommandGraph *graph = new OCLCommandGraph();
+    try {
+        q = lookup_queue(dev_idx);
+        q->begin_recording(graph);
+        for (i=0; i<num_commands; ++i) {
+            run_batch_command(mxGetCell(commands, i), ops[i]);
+        }
+        q->end_recording();
+
+        GraphEntry *entry = new GraphEntry;
+        entry->graph = graph;
+        entry->dev_idx = dev_idx;
+        handle = g_graphs.add(entry);
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        if (q) q->end_recording();
+        delete graph;
+        std::cout << "record_batch: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" 
+                  << " in command " << (i+1) << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        if (q) q->end_recording();
+        delete graph;
+        std::cout << "record_batch: Unknown error occurred in command " << (i+1) << "!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateDoubleScalar(handle);
+}
+
+static GraphEntry *lookup_graph(double handle) {
+    GraphEntry *entry = (handle >= 0) ? g_graphs.get((unsigned int) handle) : 0;
+    if (entry == 0) throw OCLError(CL_INVALID_VALUE, "Invalid or released graph id");
+    return entry;
+}
+
+static void replay_graph(mxArray *plhs[], const mxArray *graph_id) {
+    double handle = mxGetScalar(graph_id);
+
+    int return_val = 0;
+    try {
+        GraphEntry *entry = lookup_graph(handle);
+        entry->graph->replay(*lookup_queue(entry->dev_idx));
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "replay_graph: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "replay_graph: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void set_graph_arg(mxArray *plhs[], const mxArray *graph_id, const mxArray *node,
+    const mxArray *arg_num, const mxArray *buffer_id, const mxArray *data, const mxArray *size) {
+
+    double handle = mxGetScalar(graph_id);
+    size_t node_idx = (size_t) mxGetScalar(node);
+    cl_uint arg_idx = (cl_uint) mxGetScalar(arg_num);
+    double buf_idx = mxGetScalar(buffer_id);
+
+    int return_val = 0;
+    try {
+        OCLCommandGraph *graph = lookup_graph(handle)->graph;
         if (buf_idx >= 0) {
-            (*(g_kernels[kernel_idx]))[arg_idx] = *g_buffers[buf_idx];
+            graph->set_arg(node_idx, arg_idx, *lookup_buffer(buf_idx));
+        } else if (!mxIsEmpty(data)) {
+            graph->set_arg(node_idx, arg_idx, array_num_bytes(data), mxGetData(data));
         } else {
-            (*(g_kernels[kernel_idx]))(arg_idx, sz ) = pdata;
+            graph->set_arg(node_idx, arg_idx, (size_t) mxGetScalar(size), NULL);
         }
         return_val = 1;
     } catch(OCLError err) {
         dbg_printf("FAIL\n");
-        std::cout << "set_kernel_args: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        std::cout << "set_graph_arg: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
     } catch(...) {
         dbg_printf("FAIL\n");
-        std::cout << "set_kernel_args: Unknown error occurred!" << std::endl;
+        std::cout << "set_graph_arg: Unknown error occurred!" << std::endl;
         mexErrMsgTxt("Runtime error! (See error message above)");        
     }
     plhs[0] = mxCreateLogicalScalar(return_val);
 }
 
+static void destroy_graph(mxArray *plhs[], const mxArray *graph_id) {
+    double handle = mxGetScalar(graph_id);
+
+    int return_val = 0;
+    try {
+        GraphEntry *entry = (handle >= 0) ? g_graphs.remove((unsigned int) handle) : 0;
+        if (entry != 0) {
+            delete entry->graph;
+            delete entry;
+            return_val = 1;
+        }
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "destroy_graph: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "destroy_graph: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
+
+static void stream_file(mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    size_t dev_idx = (size_t) mxGetScalar(prhs[1]);
+    double kernel_idx = mxGetScalar(prhs[2]);
+    cl_ulong src_offset = (cl_ulong) mxGetScalar(prhs[4]);
+    cl_ulong dst_offset = (cl_ulong) mxGetScalar(prhs[6]);
+    size_t nItems = (size_t) mxGetScalar(prhs[7]);
+    size_t tile = (nrhs > 10) ? (size_t) mxGetScalar(prhs[10]) : 1048576;
+
+    if (!mxIsChar(prhs[3]) || !mxIsChar(prhs[5]))
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:stream_file", "File names must be strings");
+    if (!mxIsDouble(prhs[8]) || (mxGetNumberOfElements(prhs[8]) < 2))
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:stream_file", "item_sizes must be [input_bytes output_bytes]");
+    if (!mxIsDouble(prhs[9]) || (mxGetNumberOfElements(prhs[9]) < 3))
+        mexErrMsgIdAndTxt("MATLAB:openclcmd:stream_file", "arg_nums must be [input_arg output_arg count_arg]");
+
+    std::vector<char> src_path;
+    int len = mxGetNumberOfElements(prhs[3]);
+    src_path.resize(len+1);
+    mxGetString(prhs[3], &src_path[0], len+1);
+
+    std::vector<char> dst_path;
+    len = mxGetNumberOfElements(prhs[5]);
+    dst_path.resize(len+1);
+    mxGetString(prhs[5], &dst_path[0], len+1);
+
+    const double *sizes = mxGetPr(prhs[8]);
+    size_t in_size = (size_t) sizes[0];
+    size_t out_size = (size_t) sizes[1];
+    const double *args = mxGetPr(prhs[9]);
+
+    int return_val = 0;
+    try {
+        OCLKernel *kernel = lookup_kernel(kernel_idx);
+        OCLCommandQueue *q = lookup_queue(dev_idx);
+        if (in_size == 0) throw OCLError(CL_INVALID_VALUE, "stream_file: input item size is 0");
+
+        //Nothing to stream: map(offset, 0) would map the whole rest of the file
+        if (nItems == 0) {
+            plhs[0] = mxCreateLogicalScalar(1);
+            return;
+        }
+
+        size_t max_tile = OCLStreamer::max_tile_items(q->m_device, in_size, out_size);
+        if (tile > max_tile) tile = max_tile;
+
+        //Transfers get queues of their own, so they overlap the launches on q
+        cl_command_queue_properties props = q->m_properties & CL_QUEUE_PROFILING_ENABLE;
+        OCLCommandQueue upload(q->m_context, q->m_device, props);
+        OCLCommandQueue download(q->m_context, q->m_device, props);
+
+        OCLStreamer streamer(g_context, &upload, q, &download, tile, in_size, out_size);
+        streamer.bind((cl_uint) args[0], (cl_uint) args[1], (cl_int) args[2]);
+        streamer.set_profiler(g_profiler, (cl_uint) dev_idx);
+
+        OCLMappedFile src(&src_path[0]);
+        if (dst_path[0] != 0) {
+            size_t item_out = (out_size > 0) ? out_size : in_size;
+            OCLMappedFile dst(&dst_path[0], OCLMappedFile::READ_WRITE, dst_offset + (cl_ulong) nItems * item_out);
+            streamer.run(*kernel, src, dst, nItems, src_offset, dst_offset);
+        } else {
+            streamer.run(*kernel, src.map(src_offset, nItems * in_size), 0, nItems);
+        }
+        return_val = 1;
+    } catch(OCLError err) {
+        dbg_printf("FAIL\n");
+        std::cout << "stream_file: Error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    } catch(...) {
+        dbg_printf("FAIL\n");
+        std::cout << "stream_file: Unknown error occurred!" << std::endl;
+        mexErrMsgTxt("Runtime error! (See error message above)");        
+    }
+    plhs[0] = mxCreateLogicalScalar(return_val);
+}
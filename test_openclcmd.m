@@ -33,3 +33,87 @@ openclcmd('execute_kernel', 0, kid);
 openclcmd('wait_queue', 0);
 rC = openclcmd('get_buffer', 0, buffC, 9, 'single')
 
+
+% Same kernel with the arguments swapped, then a copy, in one call:
+buffD = openclcmd('create_buffer', 'rw', uint32(4*9));
+openclcmd('submit_batch', { ...
+    {'arg', kid, 0, buffC, [], 0}, ...
+    {'arg', kid, 1, buffA, [], 0}, ...
+    {'arg', kid, 2, buffB, [], 0}, ...
+    {'arg', kid, 3, -1, int32(9), 0}, ...
+    {'launch', 0, kid}, ...
+    {'copy', 0, buffB, buffD, 4*9}});
+openclcmd('wait_queue', 0);
+rD = openclcmd('get_buffer', 0, buffD, 9, 'single')
+
+% Commands by number:
+ids = openclcmd('commands');
+openclcmd(ids.wait_queue, 0);
+rD2 = openclcmd(ids.get_buffer, 0, buffD, 9, 'single');
+assert(isequal(rD, rD2));
+
+% A destroyed buffer id stays invalid, even once its slot is reused:
+openclcmd('destroy_buffer', buffD);
+buffE = openclcmd('create_buffer', 'rw', uint32(4*9));
+stale = false;
+try
+    openclcmd('get_buffer', 0, buffD, 9, 'single');
+catch
+    stale = true;
+end
+assert(stale && buffE ~= buffD);
+
+% Tiles of a kernel spread over all devices of the context:
+src = ['__kernel void tile_add(__global const float *x, __global const float *y, ', ...
+       '__global float *z, int N) { int i = get_global_id(0); if (i < N) z[i] = x[i] + y[i]; }'];
+kid2 = openclcmd('compile_kernel', src, 'tile_add');
+openclcmd('submit_batch', { ...
+    {'arg', kid2, 0, buffA, [], 0}, ...
+    {'arg', kid2, 1, buffB, [], 0}, ...
+    {'arg', kid2, 2, buffE, [], 0}, ...
+    {'arg', kid2, 3, -1, int32(9), 0}});
+tiles = openclcmd('schedule_kernel', kid2, 9, 4);
+assert(sum(tiles) == 3);
+rE = openclcmd('get_buffer', 0, buffE, 9, 'single');
+assert(isequal(rE, rC));
+
+% Record the tile_add launch once, replay it, then point it at buffE:
+buffF = openclcmd('create_buffer', 'rw', uint32(4*9));
+gid = openclcmd('record_batch', { ...
+    {'arg', kid2, 2, buffF, [], 0}, ...
+    {'launch', 0, kid2, 9}});
+openclcmd('replay_graph', gid);
+openclcmd('wait_queue', 0);
+rF = openclcmd('get_buffer', 0, buffF, 9, 'single');
+assert(isequal(rF, rC));
+openclcmd('set_graph_arg', gid, 0, 2, buffE, [], 0);
+openclcmd('replay_graph', gid);
+openclcmd('destroy_graph', gid);
+
+% Stream a file through tile_add in tiles of 4 items; y stays buffB, so
+% every tile adds [1 2 3 4]:
+src = [tempname '.bin'];
+dst = [tempname '.bin'];
+fid = fopen(src, 'w');
+fwrite(fid, single(1:20), 'single');
+fclose(fid);
+openclcmd('stream_file', 0, kid2, src, 0, dst, 0, 20, [4 4], [0 2 3], 4);
+fid = fopen(dst, 'r');
+rS = fread(fid, 20, 'single=>single')';
+fclose(fid);
+delete(src);
+delete(dst);
+assert(isequal(rS, single(1:20) + single(repmat(1:4, 1, 5))));
+
+% Load part of a file into a buffer, skipping a 16 byte header:
+fid = fopen(src, 'w');
+fwrite(fid, zeros(1, 16, 'uint8'), 'uint8');
+fwrite(fid, single(1:9), 'single');
+fclose(fid);
+openclcmd('load_file', src, 16, 4*9, buffF);
+rL = openclcmd('get_buffer', 0, buffF, 9, 'single');
+buffL = openclcmd('load_file', src, 16, 4*9, -1);
+rL2 = openclcmd('get_buffer', 0, buffL, 9, 'single');
+openclcmd('destroy_buffer', buffL);
+delete(src);
+assert(isequal(rL, single(1:9)) && isequal(rL2, single(1:9)));
@@ -4,6 +4,9 @@ function test_operations()
     ocl = opencl();
     ocl.initialize(1,1);
     ocl.addfile('cl/matlab_kernels_float.cl');
+    ocl.addfile('cl/matlab_reduce_float.cl');
+    ocl.addfile('cl/matlab_kernels_double.cl');
+    ocl.add_elementwise({'int16', 'uint8', 'int32', 'int64'});
     ocl.build();
 
     A = 1:10;
@@ -28,6 +31,109 @@ function test_operations()
     c = 3.*a; test_near(3.*A, c.get(), tol, '3*A');
         
     c = exp(a); test_near(exp(A), c.get(), 1e-2, 'exp(A)');    
+
+    % Fused expressions
+    c = (clexpr(a).*b + a)./b - 1; test_near((A.*B + A)./B - 1, c.get(), tol, 'fused (A*B+A)/B-1');
+    c = exp(clexpr(a)./b); test_near(exp(A./B), c.get(), tol, 'fused exp(A/B)');
+
+    clobject.lazy(true);
+    c = 2.*a - b; test_near(2.*A - B, c.get(), tol, 'lazy 2*A-B');
+    clobject.lazy(false);
+
+    % Reductions
+    test_near(sum(A), sum(a), tol, 'sum(A)');
+    test_eq(max(A), max(a), 'max(A)');
+    test_eq(min(A), min(a), 'min(A)');
+    test_near(dot(A,B), dot(a,b), 1e-3, 'dot(A,B)');
+    test_near(norm(A), norm(a), tol, 'norm(A)');
+
+    R = single(rand(1, 100000));
+    r = clfloat(R);
+    test_near(sum(R), sum(r), 1e-1, 'sum(R) two-pass');
+    test_eq(max(R), max(r), 'max(R) two-pass');
+    c = sum(r, 'device'); test_near(sum(R), c.get(), 1e-1, 'sum(R) on device');
+
+    % BLAS
+    P = single(rand(37, 53));
+    Q = single(rand(53, 29));
+    V = single(rand(53, 1));
+    p = clfloat(P);
+    q = clfloat(Q);
+    v = clfloat(V);
+    c = p*q; test_near(P*Q, c.get(), 1e-3, 'P*Q');
+    c = p*v; test_near(P*V, c.get(), 1e-3, 'P*V');
+    c = clfloat(Q); c.axpy(2, q); test_near(3*Q, c.get(), tol, 'axpy');
+    c.scal(0.5); test_near(1.5*Q, c.get(), tol, 'scal');
+
+    % Split into two slices (both on device 1 here)
+    X = single(reshape(1:1000, 40, 25));
+    Y = single(reshape(1000:-1:1, 40, 25));
+    x = cldist(X, [1 1], [1 3]);
+    y = cldist(Y, [1 1], [1 3]);
+    test_eq([248, 752], x.counts, 'cldist counts');
+    test_eq(X, x.get(), 'cldist get');
+    c = x.*y + 2; test_near(X.*Y + 2, c.get(), tol, 'cldist X.*Y+2');
+    test_near(sum(X(:)), x.sum(), 1, 'cldist sum');
+    test_eq(max(X(:)), x.max(), 'cldist max');
+
+    % Double precision, on devices with cl_khr_fp64
+    info = openclcmd('context_devices');
+    if ~isempty(strfind(info(1).extensions, 'cl_khr_fp64')),
+        D = (1:1000) / 7;
+        E = (1000:-1:1) / 3;
+        d = clobject(D);
+        e = clobject(E);
+        c = d.*e + 1; test_near(D.*E + 1, c.get(), 1e-9, 'double D.*E+1');
+        c = 1 - d./e; test_near(1 - D./E, c.get(), 1e-12, 'double 1-D./E');
+        c = exp(d./100); test_near(exp(D./100), c.get(), 1e-12, 'double exp(D./100)');
+    else
+        fprintf(1, 'double : [SKIPPED] (no cl_khr_fp64)\n');
+    end
+
+    % Generated integer kernels saturate and round like MATLAB
+    I = int16([-30000, -7, 0, 5, 29000]);
+    J = int16([-5000, 2, 3, -2, 9000]);
+    i16 = clobject(I);
+    j16 = clobject(J);
+    c = i16 + j16; test_eq(I + J, c.get(), 'int16 I+J');
+    c = i16 - j16; test_eq(I - J, c.get(), 'int16 I-J');
+    c = i16 .* j16; test_eq(I .* J, c.get(), 'int16 I.*J');
+    c = i16 ./ j16; test_eq(I ./ J, c.get(), 'int16 I./J');
+    c = 3 - i16; test_eq(3 - I, c.get(), 'int16 3-I');
+    U = uint8(1:200);
+    u = clobject(U);
+    c = u .* 2; test_eq(U .* 2, c.get(), 'uint8 U.*2');
+    c = u - 100; test_eq(U - 100, c.get(), 'uint8 U-100');
+
+    % Non-integral scalars are not rounded before the operation
+    c = i16 .* 2.5; test_eq(I .* 2.5, c.get(), 'int16 I.*2.5');
+    c = 0.5 + i16; test_eq(0.5 + I, c.get(), 'int16 0.5+I');
+    c = u ./ 0.5; test_eq(U ./ 0.5, c.get(), 'uint8 U./0.5');
+    c = 7.5 ./ u; test_eq(7.5 ./ U, c.get(), 'uint8 7.5./U');
+
+    % 32 and 64 bit products and quotients are exact
+    K = int32([2^31-1, -2^31, 123456789, -7, 0]);
+    L = int32([3, 2, -987, 2, 0]);
+    k32 = clobject(K);
+    l32 = clobject(L);
+    c = k32 .* l32; test_eq(K .* L, c.get(), 'int32 K.*L');
+    c = k32 ./ l32; test_eq(K ./ L, c.get(), 'int32 K./L');
+    if ~isempty(strfind(info(1).extensions, 'cl_khr_fp64')),
+        c = k32 .* 0.3; test_eq(K .* 0.3, c.get(), 'int32 K.*0.3');
+    end
+    M = int64(2)^53 .* int64([1, -1, 1000, 0, 0]) + int64([1, -3, 0, -5, 7]);
+    N = int64([3, 2, 2, -2, 0]);
+    m64 = clobject(M);
+    n64 = clobject(N);
+    c = m64 .* n64; test_eq(M .* N, c.get(), 'int64 M.*N');
+    c = m64 ./ n64; test_eq(M ./ N, c.get(), 'int64 M./N');
+    c = m64 + 1; test_eq(M + 1, c.get(), 'int64 M+1');
+    try
+        c = m64 .* 2.5;
+        fprintf(1, 'int64 M.*2.5 : [FAILED!] (no error)\n');
+    catch
+        fprintf(1, 'int64 M.*2.5 : [SUCCESS] (rejected)\n');
+    end
     
 end
 
@@ -0,0 +1,78 @@
+#ifndef _MEX_SHIM_MATRIX_H_
+#define _MEX_SHIM_MATRIX_H_
+
+/*
+ * Minimal stand-in for MATLAB's matrix.h
+ *
+ * Implements the part of the mx* API used by src/openclcmd.cpp, so the MEX
+ * dispatcher can be built into a plain executable and driven from C++ tests
+ * (see tests/test_openclcmd.cpp). Arrays are real and column-major; cell
+ * and struct arrays own their elements.
+ */
+
+#include <stddef.h>
+
+typedef struct mxArray_tag mxArray;
+typedef size_t mwSize;
+typedef size_t mwIndex;
+
+typedef enum {
+	mxUNKNOWN_CLASS, mxCELL_CLASS, mxSTRUCT_CLASS, mxLOGICAL_CLASS, mxCHAR_CLASS, mxVOID_CLASS,
+	mxDOUBLE_CLASS, mxSINGLE_CLASS, mxINT8_CLASS, mxUINT8_CLASS, mxINT16_CLASS, mxUINT16_CLASS,
+	mxINT32_CLASS, mxUINT32_CLASS, mxINT64_CLASS, mxUINT64_CLASS
+} mxClassID;
+
+typedef enum { mxREAL, mxCOMPLEX } mxComplexity;
+typedef bool mxLogical;
+typedef unsigned short mxChar;
+
+mxArray *mxCreateDoubleScalar(double value);
+mxArray *mxCreateLogicalScalar(mxLogical value);
+mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity flag);
+mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID class_id, mxComplexity flag);
+mxArray *mxCreateNumericArray(mwSize ndim, const mwSize *dims, mxClassID class_id, mxComplexity flag);
+mxArray *mxCreateLogicalArray(mwSize ndim, const mwSize *dims);
+mxArray *mxCreateCharArray(mwSize ndim, const mwSize *dims);
+mxArray *mxCreateString(const char *str);
+mxArray *mxCreateCellMatrix(mwSize m, mwSize n);
+mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int nfields, const char **field_names);
+mxArray *mxCreateStructArray(mwSize ndim, const mwSize *dims, int nfields, const char **field_names);
+void mxDestroyArray(mxArray *arr);
+
+mxClassID mxGetClassID(const mxArray *arr);
+size_t mxGetM(const mxArray *arr);
+size_t mxGetN(const mxArray *arr);
+size_t mxGetNumberOfElements(const mxArray *arr);
+size_t mxGetElementSize(const mxArray *arr);
+void *mxGetData(const mxArray *arr);
+double *mxGetPr(const mxArray *arr);
+double mxGetScalar(const mxArray *arr);
+int mxGetString(const mxArray *arr, char *buf, mwSize buflen);
+
+bool mxIsEmpty(const mxArray *arr);
+bool mxIsChar(const mxArray *arr);
+bool mxIsCell(const mxArray *arr);
+bool mxIsStruct(const mxArray *arr);
+bool mxIsNumeric(const mxArray *arr);
+bool mxIsLogical(const mxArray *arr);
+bool mxIsDouble(const mxArray *arr);
+bool mxIsSingle(const mxArray *arr);
+bool mxIsInt8(const mxArray *arr);
+bool mxIsUint8(const mxArray *arr);
+bool mxIsInt16(const mxArray *arr);
+bool mxIsUint16(const mxArray *arr);
+bool mxIsInt32(const mxArray *arr);
+bool mxIsUint32(const mxArray *arr);
+bool mxIsInt64(const mxArray *arr);
+bool mxIsUint64(const mxArray *arr);
+
+mxArray *mxGetCell(const mxArray *arr, mwIndex idx);
+void mxSetCell(mxArray *arr, mwIndex idx, mxArray *value);
+int mxGetNumberOfFields(const mxArray *arr);
+int mxGetFieldNumber(const mxArray *arr, const char *name);
+mxArray *mxGetField(const mxArray *arr, mwIndex idx, const char *name);
+mxArray *mxGetFieldByNumber(const mxArray *arr, mwIndex idx, int field);
+void mxSetField(mxArray *arr, mwIndex idx, const char *name, mxArray *value);
+void mxSetFieldByNumber(mxArray *arr, mwIndex idx, int field, mxArray *value);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _MEX_SHIM_MEX_H_
+#define _MEX_SHIM_MEX_H_
+
+/*
+ * Minimal stand-in for MATLAB's mex.h (see matrix.h)
+ *
+ * mexErrMsgTxt and mexErrMsgIdAndTxt throw MexError instead of returning
+ * to MATLAB. mex_shim_exit() runs the function registered with mexAtExit,
+ * as MATLAB does when the MEX file is cleared.
+ */
+
+#include "matrix.h"
+
+#include <stdexcept>
+#include <string>
+
+class MexError : public std::runtime_error {
+public:
+	std::string m_id;
+
+	MexError(const std::string &id, const std::string &message) : std::runtime_error(message), m_id(id) { }
+	~MexError() throw() { }
+};
+
+extern "C" void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+
+int mexAtExit(void (*exit_fcn)(void));
+void mexErrMsgTxt(const char *message);
+void mexErrMsgIdAndTxt(const char *id, const char *format, ...);
+void mexWarnMsgTxt(const char *message);
+int mexPrintf(const char *format, ...);
+
+void mex_shim_exit();
+
+#endif
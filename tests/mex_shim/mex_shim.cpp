@@ -0,0 +1,287 @@
+/*
+ * Implementation of the mex.h / matrix.h stand-in used by the C++ tests
+ */
+#include "mex.h"
+#include "matrix.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+struct mxArray_tag {
+	mxClassID					class_id;
+	std::vector<size_t>			dims;
+	std::vector<char>			data;		//Numeric, logical and char elements
+	std::vector<mxArray *>		elements;	//Cells, or struct fields (field + idx*nfields)
+	std::vector<std::string>	fields;
+};
+
+static void (*g_exit_fcn)(void) = 0;
+
+static size_t class_size(mxClassID id) {
+	switch (id) {
+		case mxLOGICAL_CLASS:	return sizeof(mxLogical);
+		case mxCHAR_CLASS:		return sizeof(mxChar);
+		case mxDOUBLE_CLASS:	return sizeof(double);
+		case mxSINGLE_CLASS:	return sizeof(float);
+		case mxINT8_CLASS:
+		case mxUINT8_CLASS:		return 1;
+		case mxINT16_CLASS:
+		case mxUINT16_CLASS:	return 2;
+		case mxINT32_CLASS:
+		case mxUINT32_CLASS:	return 4;
+		case mxINT64_CLASS:
+		case mxUINT64_CLASS:	return 8;
+		case mxCELL_CLASS:
+		case mxSTRUCT_CLASS:	return sizeof(mxArray *);
+		default:				return 0;
+	}
+}
+
+static mxArray *create(mxClassID id, mwSize ndim, const mwSize *dims) {
+	mxArray *arr = new mxArray;
+	arr->class_id = id;
+	arr->dims.assign(dims, dims + ndim);
+	while (arr->dims.size() < 2) arr->dims.push_back(1);
+
+	size_t n = mxGetNumberOfElements(arr);
+	if (id == mxCELL_CLASS) {
+		arr->elements.assign(n, (mxArray *) 0);
+	} else if (id != mxSTRUCT_CLASS) {
+		arr->data.assign(n * class_size(id), 0);
+	}
+	return arr;
+}
+
+static mxArray *create(mxClassID id, mwSize m, mwSize n) {
+	mwSize dims[2] = {m, n};
+	return create(id, 2, dims);
+}
+
+/********************************
+ * CREATION                     *
+ ********************************/
+mxArray *mxCreateDoubleScalar(double value) {
+	mxArray *arr = create(mxDOUBLE_CLASS, 1, 1);
+	*mxGetPr(arr) = value;
+	return arr;
+}
+
+mxArray *mxCreateLogicalScalar(mxLogical value) {
+	mxArray *arr = create(mxLOGICAL_CLASS, 1, 1);
+	*static_cast<mxLogical *>(mxGetData(arr)) = value;
+	return arr;
+}
+
+mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity) {
+	return create(mxDOUBLE_CLASS, m, n);
+}
+
+mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID class_id, mxComplexity) {
+	return create(class_id, m, n);
+}
+
+mxArray *mxCreateNumericArray(mwSize ndim, const mwSize *dims, mxClassID class_id, mxComplexity) {
+	return create(class_id, ndim, dims);
+}
+
+mxArray *mxCreateLogicalArray(mwSize ndim, const mwSize *dims) {
+	return create(mxLOGICAL_CLASS, ndim, dims);
+}
+
+mxArray *mxCreateCharArray(mwSize ndim, const mwSize *dims) {
+	return create(mxCHAR_CLASS, ndim, dims);
+}
+
+mxArray *mxCreateString(const char *str) {
+	size_t len = strlen(str);
+	mxArray *arr = create(mxCHAR_CLASS, (len > 0) ? 1 : 0, len);
+	mxChar *chars = static_cast<mxChar *>(mxGetData(arr));
+	for (size_t i=0; i<len; ++i) chars[i] = (unsigned char) str[i];
+	return arr;
+}
+
+mxArray *mxCreateCellMatrix(mwSize m, mwSize n) {
+	return create(mxCELL_CLASS, m, n);
+}
+
+mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int nfields, const char **field_names) {
+	mwSize dims[2] = {m, n};
+	return mxCreateStructArray(2, dims, nfields, field_names);
+}
+
+mxArray *mxCreateStructArray(mwSize ndim, const mwSize *dims, int nfields, const char **field_names) {
+	mxArray *arr = create(mxSTRUCT_CLASS, ndim, dims);
+	for (int f=0; f<nfields; ++f) arr->fields.push_back(field_names[f]);
+	arr->elements.assign(mxGetNumberOfElements(arr) * nfields, (mxArray *) 0);
+	return arr;
+}
+
+void mxDestroyArray(mxArray *arr) {
+	if (arr == 0) return;
+	for (size_t i=0; i<arr->elements.size(); ++i) mxDestroyArray(arr->elements[i]);
+	delete arr;
+}
+
+/********************************
+ * ACCESS                       *
+ ********************************/
+mxClassID mxGetClassID(const mxArray *arr) { return arr->class_id; }
+size_t mxGetM(const mxArray *arr) { return arr->dims[0]; }
+
+size_t mxGetN(const mxArray *arr) {
+	size_t n = 1;
+	for (size_t i=1; i<arr->dims.size(); ++i) n *= arr->dims[i];
+	return n;
+}
+
+size_t mxGetNumberOfElements(const mxArray *arr) {
+	return arr->dims[0] * mxGetN(arr);
+}
+
+size_t mxGetElementSize(const mxArray *arr) { return class_size(arr->class_id); }
+
+void *mxGetData(const mxArray *arr) {
+	if (arr->data.empty()) return 0;
+	return const_cast<char *>(&arr->data[0]);
+}
+
+double *mxGetPr(const mxArray *arr) {
+	return static_cast<double *>(mxGetData(arr));
+}
+
+double mxGetScalar(const mxArray *arr) {
+	const void *p = mxGetData(arr);
+	if (p == 0) return 0;
+
+	switch (arr->class_id) {
+		case mxLOGICAL_CLASS:	return *static_cast<const mxLogical *>(p);
+		case mxCHAR_CLASS:		return *static_cast<const mxChar *>(p);
+		case mxDOUBLE_CLASS:	return *static_cast<const double *>(p);
+		case mxSINGLE_CLASS:	return *static_cast<const float *>(p);
+		case mxINT8_CLASS:		return *static_cast<const signed char *>(p);
+		case mxUINT8_CLASS:		return *static_cast<const unsigned char *>(p);
+		case mxINT16_CLASS:		return *static_cast<const short *>(p);
+		case mxUINT16_CLASS:	return *static_cast<const unsigned short *>(p);
+		case mxINT32_CLASS:		return *static_cast<const int *>(p);
+		case mxUINT32_CLASS:	return *static_cast<const unsigned int *>(p);
+		case mxINT64_CLASS:		return (double) *static_cast<const long long *>(p);
+		case mxUINT64_CLASS:	return (double) *static_cast<const unsigned long long *>(p);
+		default:				return 0;
+	}
+}
+
+//Returns 1 (with a truncated string) if buf is too small, as MATLAB does
+int mxGetString(const mxArray *arr, char *buf, mwSize buflen) {
+	if ((arr->class_id != mxCHAR_CLASS) || (buflen == 0)) return 1;
+
+	size_t n = mxGetNumberOfElements(arr);
+	const mxChar *chars = static_cast<const mxChar *>(mxGetData(arr));
+	size_t copied = (n < buflen - 1) ? n : buflen - 1;
+	for (size_t i=0; i<copied; ++i) buf[i] = (char) chars[i];
+	buf[copied] = 0;
+	return (copied < n) ? 1 : 0;
+}
+
+bool mxIsEmpty(const mxArray *arr) { return mxGetNumberOfElements(arr) == 0; }
+bool mxIsChar(const mxArray *arr) { return arr->class_id == mxCHAR_CLASS; }
+bool mxIsCell(const mxArray *arr) { return arr->class_id == mxCELL_CLASS; }
+bool mxIsStruct(const mxArray *arr) { return arr->class_id == mxSTRUCT_CLASS; }
+bool mxIsLogical(const mxArray *arr) { return arr->class_id == mxLOGICAL_CLASS; }
+bool mxIsNumeric(const mxArray *arr) { return arr->class_id >= mxDOUBLE_CLASS; }
+bool mxIsDouble(const mxArray *arr) { return arr->class_id == mxDOUBLE_CLASS; }
+bool mxIsSingle(const mxArray *arr) { return arr->class_id == mxSINGLE_CLASS; }
+bool mxIsInt8(const mxArray *arr) { return arr->class_id == mxINT8_CLASS; }
+bool mxIsUint8(const mxArray *arr) { return arr->class_id == mxUINT8_CLASS; }
+bool mxIsInt16(const mxArray *arr) { return arr->class_id == mxINT16_CLASS; }
+bool mxIsUint16(const mxArray *arr) { return arr->class_id == mxUINT16_CLASS; }
+bool mxIsInt32(const mxArray *arr) { return arr->class_id == mxINT32_CLASS; }
+bool mxIsUint32(const mxArray *arr) { return arr->class_id == mxUINT32_CLASS; }
+bool mxIsInt64(const mxArray *arr) { return arr->class_id == mxINT64_CLASS; }
+bool mxIsUint64(const mxArray *arr) { return arr->class_id == mxUINT64_CLASS; }
+
+mxArray *mxGetCell(const mxArray *arr, mwIndex idx) {
+	if (!mxIsCell(arr) || (idx >= arr->elements.size())) return 0;
+	return arr->elements[idx];
+}
+
+void mxSetCell(mxArray *arr, mwIndex idx, mxArray *value) {
+	if (!mxIsCell(arr) || (idx >= arr->elements.size())) return;
+	mxDestroyArray(arr->elements[idx]);
+	arr->elements[idx] = value;
+}
+
+int mxGetNumberOfFields(const mxArray *arr) {
+	return (int) arr->fields.size();
+}
+
+int mxGetFieldNumber(const mxArray *arr, const char *name) {
+	for (size_t f=0; f<arr->fields.size(); ++f) {
+		if (arr->fields[f] == name) return (int) f;
+	}
+	return -1;
+}
+
+mxArray *mxGetFieldByNumber(const mxArray *arr, mwIndex idx, int field) {
+	if (!mxIsStruct(arr) || (field < 0) || (field >= mxGetNumberOfFields(arr)) ||
+		(idx >= mxGetNumberOfElements(arr))) return 0;
+	return arr->elements[idx * arr->fields.size() + field];
+}
+
+mxArray *mxGetField(const mxArray *arr, mwIndex idx, const char *name) {
+	return mxGetFieldByNumber(arr, idx, mxGetFieldNumber(arr, name));
+}
+
+void mxSetFieldByNumber(mxArray *arr, mwIndex idx, int field, mxArray *value) {
+	if (!mxIsStruct(arr) || (field < 0) || (field >= mxGetNumberOfFields(arr)) ||
+		(idx >= mxGetNumberOfElements(arr))) return;
+
+	mxArray *&slot = arr->elements[idx * arr->fields.size() + field];
+	mxDestroyArray(slot);
+	slot = value;
+}
+
+void mxSetField(mxArray *arr, mwIndex idx, const char *name, mxArray *value) {
+	mxSetFieldByNumber(arr, idx, mxGetFieldNumber(arr, name), value);
+}
+
+/********************************
+ * MEX                          *
+ ********************************/
+int mexAtExit(void (*exit_fcn)(void)) {
+	g_exit_fcn = exit_fcn;
+	return 0;
+}
+
+void mex_shim_exit() {
+	if (g_exit_fcn) g_exit_fcn();
+	g_exit_fcn = 0;
+}
+
+void mexErrMsgTxt(const char *message) {
+	throw MexError("", message);
+}
+
+void mexErrMsgIdAndTxt(const char *id, const char *format, ...) {
+	char message[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	throw MexError(id, message);
+}
+
+void mexWarnMsgTxt(const char *message) {
+	std::cerr << "Warning: " << message << std::endl;
+}
+
+int mexPrintf(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int n = vprintf(format, args);
+	va_end(args);
+	return n;
+}
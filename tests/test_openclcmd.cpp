@@ -0,0 +1,270 @@
+/*
+ * Drives the openclcmd MEX dispatcher (src/openclcmd.cpp) from C++, using
+ * the mex.h / matrix.h stand-in in tests/mex_shim. Follows test_openclcmd.m
+ * and times the per-call cost of the dispatcher.
+ *
+ * Usage: test_openclcmd [source_dir]
+ *   source_dir: folder containing cl/ (default: current folder)
+ *
+ * Uses device 0 of platform 0. Exits with 0 without running anything if no
+ * OpenCL platform is installed.
+ */
+#include <ray/opencl/opencl.h>
+#include "mex.h"
+#include "matrix.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+
+using namespace ray::opencl;
+
+static int g_failures = 0;
+
+static void check(bool ok, const std::string &name) {
+    std::cout << name << " : " << (ok ? "[SUCCESS]" : "[FAILED!]") << std::endl;
+    if (!ok) ++g_failures;
+}
+
+/********************************
+ * ARGUMENT HELPERS             *
+ ********************************/
+
+//Arguments of one openclcmd call. The arrays are freed after the call.
+class Args {
+public:
+    std::vector<mxArray *> m_args;
+
+    Args &operator()(mxArray *arr) { m_args.push_back(arr); return *this; }
+    Args &operator()(const char *str) { return (*this)(mxCreateString(str)); }
+    Args &operator()(double value) { return (*this)(mxCreateDoubleScalar(value)); }
+};
+
+static mxArray *uint32_array(unsigned int a, unsigned int b = 0, unsigned int c = 0, size_t n = 1) {
+    mxArray *arr = mxCreateNumericMatrix(1, n, mxUINT32_CLASS, mxREAL);
+    unsigned int *p = static_cast<unsigned int *>(mxGetData(arr));
+    unsigned int v[3] = {a, b, c};
+    for (size_t i=0; i<n; ++i) p[i] = v[i];
+    return arr;
+}
+
+static mxArray *single_array(const std::vector<float> &values) {
+    mxArray *arr = mxCreateNumericMatrix(1, values.size(), mxSINGLE_CLASS, mxREAL);
+    if (!values.empty()) memcpy(mxGetData(arr), &values[0], values.size() * sizeof(float));
+    return arr;
+}
+
+static mxArray *int32_scalar(int value) {
+    mxArray *arr = mxCreateNumericMatrix(1, 1, mxINT32_CLASS, mxREAL);
+    *static_cast<int *>(mxGetData(arr)) = value;
+    return arr;
+}
+
+static mxArray *cell(const std::vector<mxArray *> &items) {
+    mxArray *arr = mxCreateCellMatrix(1, items.size());
+    for (size_t i=0; i<items.size(); ++i) mxSetCell(arr, i, items[i]);
+    return arr;
+}
+
+static std::vector<float> to_floats(const mxArray *arr) {
+    const float *p = static_cast<const float *>(mxGetData(arr));
+    return std::vector<float>(p, p + mxGetNumberOfElements(arr));
+}
+
+//Call openclcmd and return its first output (caller frees). Errors raised
+//with mexErrMsgTxt are thrown as MexError.
+static mxArray *openclcmd(Args &args, int nlhs = 1) {
+    std::vector<mxArray *> plhs(nlhs + 1, (mxArray *) 0);
+    try {
+        mexFunction(nlhs, &plhs[0], (int) args.m_args.size(), const_cast<const mxArray **>(&args.m_args[0]));
+    } catch (...) {
+        for (size_t i=0; i<args.m_args.size(); ++i) mxDestroyArray(args.m_args[i]);
+        args.m_args.clear();
+        throw;
+    }
+    for (size_t i=0; i<args.m_args.size(); ++i) mxDestroyArray(args.m_args[i]);
+    args.m_args.clear();
+    for (size_t i=1; i<plhs.size(); ++i) mxDestroyArray(plhs[i]);
+    return plhs[0];
+}
+
+static double openclcmd_scalar(Args &args) {
+    mxArray *out = openclcmd(args);
+    double value = (out != 0) ? mxGetScalar(out) : 0;
+    mxDestroyArray(out);
+    return value;
+}
+
+static bool raises(Args &args) {
+    try {
+        mxDestroyArray(openclcmd(args));
+    } catch (const MexError &) {
+        return true;
+    }
+    return false;
+}
+
+/********************************
+ * TESTS                        *
+ ********************************/
+int main(int argc, char *argv[]) {
+    std::string source_dir = (argc > 1) ? argv[1] : ".";
+
+    try {
+        if (OCLPlatform::get_platform_ids().empty()) throw OCLError(CL_INVALID_PLATFORM, "no platforms");
+    } catch (const OCLError &) {
+        std::cout << "No OpenCL platform found, skipped" << std::endl;
+        return 0;
+    }
+
+    try {
+        //Platform listing
+        mxArray *platforms = 0;
+        mexFunction(1, &platforms, 0, 0);
+        check((platforms != 0) && mxIsStruct(platforms) && (mxGetNumberOfElements(platforms) > 0), "platforms");
+        mxDestroyArray(platforms);
+
+        check(openclcmd_scalar(Args()("initialize")(0.0)(uint32_array(0))) != 0, "initialize");
+        std::string file = source_dir + "/cl/simple_add.cl";
+        check(openclcmd_scalar(Args()("addfile")(file.c_str())) != 0, "addfile");
+        check(openclcmd_scalar(Args()("build")) != 0, "build");
+
+        //Buffers and a kernel, as in test_openclcmd.m
+        std::vector<float> a, b;
+        for (int i=1; i<=9; ++i) { a.push_back((float) i); b.push_back((float) (10 * i)); }
+
+        double buffA = openclcmd_scalar(Args()("create_buffer")("ro")(uint32_array(4*9)));
+        double buffB = openclcmd_scalar(Args()("create_buffer")("ro")(uint32_array(4*9)));
+        double buffC = openclcmd_scalar(Args()("create_buffer")("rw")(uint32_array(4*9)));
+
+        openclcmd_scalar(Args()("set_buffer")(0.0)(buffA)(single_array(a)));
+        openclcmd_scalar(Args()("set_buffer")(0.0)(buffB)(single_array(b)));
+
+        mxArray *rA = openclcmd(Args()("get_buffer")(0.0)(buffA)(9.0)("single"));
+        check(to_floats(rA) == a, "set_buffer / get_buffer");
+        mxDestroyArray(rA);
+
+        double kid = openclcmd_scalar(Args()("create_kernel")(uint32_array(9, 0, 0, 3))(uint32_array(9, 0, 0, 3))("add"));
+        openclcmd_scalar(Args()("set_kernel_args")(kid)(0.0)(buffA)(mxCreateDoubleMatrix(0, 0, mxREAL))(0.0));
+        openclcmd_scalar(Args()("set_kernel_args")(kid)(1.0)(buffB)(mxCreateDoubleMatrix(0, 0, mxREAL))(0.0));
+        openclcmd_scalar(Args()("set_kernel_args")(kid)(2.0)(buffC)(mxCreateDoubleMatrix(0, 0, mxREAL))(0.0));
+        openclcmd_scalar(Args()("set_kernel_args")(kid)(3.0)(-1.0)(int32_scalar(9))(0.0));
+        check(openclcmd_scalar(Args()("execute_kernel")(0.0)(kid)) != 0, "execute_kernel");
+        openclcmd_scalar(Args()("wait_queue")(0.0));
+
+        std::vector<float> sum(9);
+        for (int i=0; i<9; ++i) sum[i] = a[i] + b[i];
+        mxArray *rC = openclcmd(Args()("get_buffer")(0.0)(buffC)(9.0)("single"));
+        check(to_floats(rC) == sum, "add kernel");
+        mxDestroyArray(rC);
+
+        //The same launch as one submit_batch call
+        double buffD = openclcmd_scalar(Args()("create_buffer")("rw")(uint32_array(4*9)));
+        std::vector<mxArray *> cmds;
+        std::vector<mxArray *> c;
+        c.push_back(mxCreateString("arg")); c.push_back(mxCreateDoubleScalar(kid)); c.push_back(mxCreateDoubleScalar(2));
+        c.push_back(mxCreateDoubleScalar(buffD)); c.push_back(mxCreateDoubleMatrix(0, 0, mxREAL)); c.push_back(mxCreateDoubleScalar(0));
+        cmds.push_back(cell(c));
+        c.clear();
+        c.push_back(mxCreateString("launch")); c.push_back(mxCreateDoubleScalar(0)); c.push_back(mxCreateDoubleScalar(kid));
+        cmds.push_back(cell(c));
+        openclcmd_scalar(Args()("submit_batch")(cell(cmds)));
+        openclcmd_scalar(Args()("wait_queue")(0.0));
+
+        mxArray *rD = openclcmd(Args()("get_buffer")(0.0)(buffD)(9.0)("single"));
+        check(to_floats(rD) == sum, "submit_batch");
+        mxDestroyArray(rD);
+
+        //The launch recorded once and replayed into another buffer
+        double buffG = openclcmd_scalar(Args()("create_buffer")("rw")(uint32_array(4*9)));
+        cmds.clear();
+        c.clear();
+        c.push_back(mxCreateString("launch")); c.push_back(mxCreateDoubleScalar(0)); c.push_back(mxCreateDoubleScalar(kid));
+        cmds.push_back(cell(c));
+        double gid = openclcmd_scalar(Args()("record_batch")(cell(cmds)));
+        check(gid > 0, "record_batch");
+        openclcmd_scalar(Args()("set_graph_arg")(gid)(0.0)(2.0)(buffG)(mxCreateDoubleMatrix(0, 0, mxREAL))(0.0));
+        check(openclcmd_scalar(Args()("replay_graph")(gid)) != 0, "replay_graph");
+        openclcmd_scalar(Args()("wait_queue")(0.0));
+
+        mxArray *rG = openclcmd(Args()("get_buffer")(0.0)(buffG)(9.0)("single"));
+        check(to_floats(rG) == sum, "set_graph_arg");
+        mxDestroyArray(rG);
+        check(openclcmd_scalar(Args()("destroy_graph")(gid)) != 0, "destroy_graph");
+        check(raises(Args()("replay_graph")(gid)), "stale graph id");
+
+        //Command numbers
+        mxArray *ids = openclcmd(Args()("commands"));
+        mxArray *wait_id = (ids != 0) ? mxGetField(ids, 0, "wait_queue") : 0;
+        check(wait_id != 0, "commands");
+        if (wait_id != 0) {
+            check(openclcmd_scalar(Args()(mxGetScalar(wait_id))(0.0)) != 0, "command by number");
+        }
+        double set_args_id = (ids != 0) ? mxGetScalar(mxGetField(ids, 0, "set_kernel_args")) : -1;
+        mxDestroyArray(ids);
+
+        //Invalid commands and stale handles are reported, not crashed on
+        check(raises(Args()("no_such_command")), "unknown command");
+        check(raises(Args()(1e6)), "command number out of range");
+
+        openclcmd_scalar(Args()("destroy_buffer")(buffD));
+        double buffE = openclcmd_scalar(Args()("create_buffer")("rw")(uint32_array(4*9)));
+        check(raises(Args()("get_buffer")(0.0)(buffD)(9.0)("single")) && (buffE != buffD), "stale buffer id");
+
+        //BLAS operands must fit their buffers (9 floats each)
+        check(raises(Args()("blas_gemm")(0.0)(buffA)(buffB)(buffC)(3.0)(3.0)(4.0)), "blas_gemm: A smaller than M x K");
+        check(raises(Args()("blas_gemv")(0.0)(buffA)(buffB)(buffC)(4.0)(3.0)), "blas_gemv: A smaller than M x N");
+        check(raises(Args()("blas_axpy")(0.0)(10.0)(2.0)(buffA)(buffC)), "blas_axpy: n past the end");
+        check(raises(Args()("blas_scal")(0.0)(-1.0)(2.0)(buffC)), "blas_scal: negative n");
+
+        //File contents straight into buffers, past a 16 byte header
+        const char *path = "test_openclcmd_load_file.bin";
+        FILE *f = fopen(path, "wb");
+        char header[16] = {0};
+        fwrite(header, 1, sizeof(header), f);
+        fwrite(&a[0], sizeof(float), a.size(), f);
+        fclose(f);
+
+        check(openclcmd_scalar(Args()("load_file")(path)(16.0)(4*9.0)(buffE)) == buffE, "load_file");
+        mxArray *rE = openclcmd(Args()("get_buffer")(0.0)(buffE)(9.0)("single"));
+        check(to_floats(rE) == a, "load_file: contents");
+        mxDestroyArray(rE);
+
+        double buffF = openclcmd_scalar(Args()("load_file")(path)(16.0)(4*9.0)(-1.0));
+        mxArray *rF = openclcmd(Args()("get_buffer")(0.0)(buffF)(9.0)("single"));
+        check(to_floats(rF) == a, "load_file: new buffer");
+        mxDestroyArray(rF);
+        check(openclcmd_scalar(Args()("destroy_buffer")(buffF)) != 0, "load_file: destroy new buffer");
+        check(raises(Args()("load_file")(path)(16.0)(4*10.0)(buffE)), "load_file: past the end of the file");
+        check(raises(Args()("load_file")(path)(16.0)(0.0)(buffE)), "load_file: zero bytes");
+        check(raises(Args()("load_file")(path)(64.0)(4.0)(-1.0)), "load_file: offset past the end of the file");
+        remove(path);
+
+        //Dispatcher overhead: one set_kernel_args call, by name and by number
+        const int calls = 10000;
+        cl_ulong t0 = OCLProfiler::host_time();
+        for (int i=0; i<calls; ++i) {
+            openclcmd_scalar(Args()("set_kernel_args")(kid)(3.0)(-1.0)(int32_scalar(9))(0.0));
+        }
+        cl_ulong t1 = OCLProfiler::host_time();
+        for (int i=0; i<calls; ++i) {
+            openclcmd_scalar(Args()(set_args_id)(kid)(3.0)(-1.0)(int32_scalar(9))(0.0));
+        }
+        cl_ulong t2 = OCLProfiler::host_time();
+        std::cout << "set_kernel_args by name:   " << (t1 - t0) / 1000.0 / calls << " us/call" << std::endl;
+        std::cout << "set_kernel_args by number: " << (t2 - t1) / 1000.0 / calls << " us/call" << std::endl;
+
+        openclcmd_scalar(Args()("cleanup"));
+    } catch (const MexError &err) {
+        std::cout << "Unexpected error: " << err.what() << std::endl;
+        ++g_failures;
+    } catch (const OCLError &err) {
+        std::cout << "Unexpected error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        ++g_failures;
+    }
+
+    mex_shim_exit();
+    return (g_failures > 0) ? 1 : 0;
+}
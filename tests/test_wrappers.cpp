@@ -0,0 +1,337 @@
+/*
+ * Tests of the wrapper classes in include/ray/opencl.
+ *
+ * The handle table and the kernel generator are tested without a device.
+ * The program, queue and scheduler tests use device 0 of platform 0 and
+ * are skipped if no OpenCL platform is installed.
+ */
+#include <ray/opencl/opencl.h>
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdio.h>
+
+using namespace ray::opencl;
+
+static int g_failures = 0;
+
+static void check(bool ok, const std::string &name) {
+    std::cout << name << " : " << (ok ? "[SUCCESS]" : "[FAILED!]") << std::endl;
+    if (!ok) ++g_failures;
+}
+
+static bool has(const std::string &text, const std::string &part) {
+    return text.find(part) != std::string::npos;
+}
+
+/********************************
+ * HOST ONLY                    *
+ ********************************/
+static void test_handle_table() {
+    OCLHandleTable<int> table;
+    int a = 1, b = 2, c = 3;
+
+    unsigned int ha = table.add(&a);
+    unsigned int hb = table.add(&b);
+    check((table.get(ha) == &a) && (table.get(hb) == &b), "handle table: add / get");
+    check((ha > 0) && (ha != hb), "handle table: distinct positive handles");
+
+    check(table.remove(ha) == &a, "handle table: remove");
+    check(table.get(ha) == 0, "handle table: removed handle");
+
+    unsigned int hc = table.add(&c);
+    check((table.get(hc) == &c) && (hc != ha) && (table.get(ha) == 0), "handle table: stale handle after reuse");
+    check(table.remove(ha) == 0, "handle table: remove stale handle");
+    check(table.get(0) == 0, "handle table: handle 0");
+
+    table.clear();
+    check((table.get(hb) == 0) && (table.get(hc) == 0), "handle table: clear");
+}
+
+static void test_kernel_generator() {
+    std::string all = OCLKernelGenerator::elementwise();
+    check(has(all, "__kernel void single_add(") && has(all, "__kernel void uint8_scalar_minus_v8(") &&
+        has(all, "__kernel void int64_times_scalar_v4("), "kernel generator: kernel names");
+    check(has(all, "__kernel void double_exponential(") && !has(all, "int32_exponential"),
+        "kernel generator: float only operations");
+
+    std::vector<std::string> types;
+    types.push_back("int16");
+    std::string some = OCLKernelGenerator::elementwise(types);
+    check(has(some, "int16_add") && !has(some, "single_add") && has(some, "add_sat"), "kernel generator: type list");
+
+    //Integer kernels take scalars in the type they compute in
+    check(has(some, "int16_times_scalar(__global short *out, __global const short *x, float w,") &&
+        has(some, "oclgen_divide_short4("), "kernel generator: int16 scalar kernels");
+    check(has(all, "int64_scalar_divide(__global long *out, long w,") &&
+        has(all, "#ifdef OCLGEN_FP64\n__kernel void int32_scalar_add(__global int *out, double w,"),
+        "kernel generator: 32 and 64 bit scalar kernels");
+
+    check((OCLKernelGenerator::find_type("uint32") != 0) && (OCLKernelGenerator::find_type("logical") == 0),
+        "kernel generator: find_type");
+
+    bool thrown = false;
+    types.push_back("complex");
+    try {
+        OCLKernelGenerator::elementwise(types);
+    } catch (const OCLError &) {
+        thrown = true;
+    }
+    check(thrown, "kernel generator: unknown type");
+}
+
+static void test_kernel_args() {
+    //Buffers without a device object, only the argument tracking is used
+    OCLBuffer *a = new OCLBuffer();
+    OCLBuffer b;
+    cl_int n = 9;
+
+    OCLKernelArgs args;
+    ocl_store_arg(&args, 0, sizeof(cl_mem), a->ptr(), a);
+    ocl_store_arg(&args, 1, sizeof(cl_mem), b.ptr(), &b);
+    ocl_store_arg(&args, 2, sizeof(cl_mem), a->ptr(), a);
+    delete a;
+    check((args.buffers[0] == 0) && (args.buffers[1] == &b) && (args.buffers[2] == 0),
+        "kernel args: destroyed buffer cleared");
+
+    ocl_store_arg(&args, 1, sizeof(cl_int), &n, 0);
+    check(b.m_bound.empty(), "kernel args: replaced buffer released");
+
+    {
+        OCLKernelArgs scoped;
+        ocl_store_arg(&scoped, 0, sizeof(cl_mem), b.ptr(), &b);
+    }
+    check(b.m_bound.empty(), "kernel args: destroyed kernel released");
+}
+
+static void test_profiler() {
+    //Host spans past the limit are counted apart from device commands
+    OCLProfiler profiler(2);
+    for (int i=0; i<3; ++i) profiler.record_host("call", 0, 1);
+    check((profiler.m_host_spans.size() == 2) && (profiler.m_dropped_host == 1) && (profiler.m_dropped == 0),
+        "profiler: dropped host spans");
+    profiler.clear();
+    check(profiler.m_dropped_host == 0, "profiler: clear");
+}
+
+static void test_mapped_file() {
+    std::string path = "test_wrappers_mapped_file.bin";
+    {
+        OCLMappedFile out(path.c_str(), OCLMappedFile::READ_WRITE, 10000);
+        check(out.size() == 10000, "mapped file: create");
+        char *p = static_cast<char *>(out.map(0));
+        for (int i=0; i<10000; ++i) p[i] = (char) (i % 251);
+    }
+
+    OCLMappedFile in(path.c_str());
+    const char *p = static_cast<const char *>(in.map(5003, 100));
+    bool same = (p != 0);
+    for (int i=0; same && (i<100); ++i) same = (p[i] == (char) ((5003 + i) % 251));
+    check(same, "mapped file: unaligned window");
+
+    bool thrown = false;
+    try {
+        in.map(9990, 100);
+    } catch (const OCLError &) {
+        thrown = true;
+    }
+    check(thrown, "mapped file: window past the end");
+
+    in.close();
+    remove(path.c_str());
+}
+
+/********************************
+ * DEVICE                       *
+ ********************************/
+static const char *g_scale_source =
+    "__kernel void scale(__global float *x, float a, int N) {\n"
+    "  int i = get_global_id(0);\n"
+    "  if (i < N) x[i] = a * x[i];\n"
+    "}\n";
+
+static const char *g_offset_source =
+    "__kernel void offset(__global float *x, float a, int N) {\n"
+    "  int i = get_global_id(0);\n"
+    "  if (i < N) x[i] = x[i] + a;\n"
+    "}\n";
+
+static void test_device(OCLPlatform &platform) {
+    std::vector<cl_device_id> devices = platform.get_device_ids();
+    if (devices.empty()) {
+        std::cout << "No OpenCL device found, device tests skipped" << std::endl;
+        return;
+    }
+
+    OCLContext context(platform);
+    context += devices[0];
+    context.create();
+
+    OCLCommandQueue queue(context, devices[0]);
+
+    const int n = 1000;
+    std::vector<float> x(n), y(n);
+    for (int i=0; i<n; ++i) x[i] = (float) i;
+
+    //Round trip through a buffer
+    OCLBuffer buf(context, CL_MEM_READ_WRITE, n * sizeof(float));
+    queue.enqueue_buffer_copy(buf, &x[0], n * sizeof(float), 0, CL_TRUE);
+    queue.enqueue_buffer_copy(&y[0], buf, n * sizeof(float), 0, CL_TRUE);
+    check(x == y, "command queue: buffer round trip");
+
+    //Program built from source
+    OCLProgram program(context);
+    program.add_source(std::string(g_scale_source));
+    program.build();
+    bool built = !program.m_build_status.empty();
+    for (size_t i=0; i<program.m_build_status.size(); ++i) {
+        built = built && (program.m_build_status[i].status == CL_BUILD_SUCCESS);
+    }
+    check(built, "program: build");
+
+    //Sources added after a build are part of the next one
+    OCLProgram program2(context);
+    program2.add_source(std::string(g_scale_source));
+    program2.build();
+    program2.add_source(std::string(g_offset_source));
+    program2.build();
+    bool rebuilt = true;
+    try {
+        OCLKernel offset(program2, "offset");
+        OCLKernel scale(program2, "scale");
+    } catch (const OCLError &) {
+        rebuilt = false;
+    }
+    check(rebuilt, "program: rebuild with added source");
+
+    OCLKernel kernel(program, "scale");
+    cl_float a = 2.0f;
+    cl_int count = n;
+    cl_mem mem = buf.id();
+    kernel[0] = &mem;
+    kernel[1] = &a;
+    kernel[2] = &count;
+    kernel.set_auto_size(true);
+
+    //Tiles on one queue, the last one partial
+    std::vector<OCLCommandQueue *> queues(1, &queue);
+    OCLScheduler scheduler(queues, 300);
+    scheduler.run(kernel, n);
+    queue.enqueue_buffer_copy(&y[0], buf, n * sizeof(float), 0, CL_TRUE);
+
+    bool scaled = true;
+    for (int i=0; i<n; ++i) scaled = scaled && (y[i] == 2.0f * x[i]);
+    check((scheduler.m_tiles_done.size() == 1) && (scheduler.m_tiles_done[0] == 4), "scheduler: tiles");
+    check(scaled, "scheduler: results");
+
+    //Streamed in place through 3 slots of 300 items, on three queues
+    OCLCommandQueue upload(context, devices[0]), download(context, devices[0]);
+    OCLStreamer streamer(context, upload, queue, download, 300, sizeof(float));
+    streamer.bind(0, 0, 2);
+    std::vector<float> z(n);
+    streamer.run(kernel, &x[0], &z[0], n);
+
+    bool streamed = true;
+    for (int i=0; i<n; ++i) streamed = streamed && (z[i] == 2.0f * x[i]);
+    check(streamed, "streamer: results");
+    check(kernel.m_args.buffers[0] == 0, "streamer: slot buffers unbound");
+
+    //Generated integer kernels round and saturate like MATLAB
+    std::vector<std::string> int_types;
+    int_types.push_back("int16");
+    int_types.push_back("int64");
+    OCLProgram generated(context);
+    generated.add_source(OCLKernelGenerator::elementwise(int_types));
+    generated.build();
+
+    cl_short s_in[4] = {3, -3, 13107, -32768};
+    cl_short s_out[4] = {0, 0, 0, 0};
+    OCLBuffer s_x(context, CL_MEM_READ_WRITE, sizeof(s_in));
+    OCLBuffer s_y(context, CL_MEM_READ_WRITE, sizeof(s_out));
+    queue.enqueue_buffer_copy(s_x, s_in, sizeof(s_in), 0, CL_TRUE);
+
+    OCLKernel int16_times(generated, "int16_times_scalar");
+    cl_mem s_xm = s_x.id(), s_ym = s_y.id();
+    cl_float w = 2.5f;
+    cl_int four = 4;
+    int16_times[0] = &s_ym;
+    int16_times[1] = &s_xm;
+    int16_times[2] = &w;
+    int16_times[3] = &four;
+    int16_times.auto_size(devices[0], 4);
+    queue.enqueue_ndrange_kernel(int16_times);
+    queue.enqueue_buffer_copy(s_out, s_y, sizeof(s_out), 0, CL_TRUE);
+    check((s_out[0] == 8) && (s_out[1] == -8) && (s_out[2] == 32767) && (s_out[3] == -32768),
+        "generated kernels: int16 times non-integral scalar");
+
+    cl_long l_a[4] = {9007199254740993LL, -7, 5, -9223372036854775807LL - 1};
+    cl_long l_b[4] = {2, 2, 0, -1};
+    cl_long l_out[4] = {0, 0, 0, 0};
+    OCLBuffer l_x(context, CL_MEM_READ_WRITE, sizeof(l_a));
+    OCLBuffer l_y(context, CL_MEM_READ_WRITE, sizeof(l_b));
+    OCLBuffer l_z(context, CL_MEM_READ_WRITE, sizeof(l_out));
+    queue.enqueue_buffer_copy(l_x, l_a, sizeof(l_a), 0, CL_TRUE);
+    queue.enqueue_buffer_copy(l_y, l_b, sizeof(l_b), 0, CL_TRUE);
+
+    OCLKernel int64_divide(generated, "int64_divide");
+    cl_mem l_xm = l_x.id(), l_ym = l_y.id(), l_zm = l_z.id();
+    int64_divide[0] = &l_zm;
+    int64_divide[1] = &l_xm;
+    int64_divide[2] = &l_ym;
+    int64_divide[3] = &four;
+    int64_divide.auto_size(devices[0], 4);
+    queue.enqueue_ndrange_kernel(int64_divide);
+    queue.enqueue_buffer_copy(l_out, l_z, sizeof(l_out), 0, CL_TRUE);
+    check((l_out[0] == 4503599627370497LL) && (l_out[1] == -4) && (l_out[2] == 9223372036854775807LL) &&
+        (l_out[3] == 9223372036854775807LL), "generated kernels: exact int64 quotients");
+
+    //Dependent commands on an out-of-order queue run in order
+    OCLDevice device(devices[0]);
+    if ((device.m_properties.queue_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0) {
+        std::cout << "Device has no out-of-order queues, skipped" << std::endl;
+        return;
+    }
+
+    OCLCommandQueue ooo(context, devices[0], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+    OCLBuffer buf2(context, CL_MEM_READ_WRITE, n * sizeof(float));
+    kernel[0] = buf2;
+    kernel.auto_size(devices[0], n);
+
+    ooo.enqueue_buffer_copy(buf2, &x[0], n * sizeof(float));
+    for (int i=0; i<3; ++i) ooo.enqueue_ndrange_kernel(kernel);
+    ooo.enqueue_buffer_copy(buf, buf2, n * sizeof(float));
+    ooo.enqueue_buffer_copy(&y[0], buf, n * sizeof(float), 0, CL_TRUE);
+
+    bool ordered = true;
+    for (int i=0; i<n; ++i) ordered = ordered && (y[i] == 8.0f * x[i]);
+    check(ordered, "out-of-order queue: dependencies");
+}
+
+int main() {
+    try {
+        test_handle_table();
+        test_kernel_generator();
+        test_kernel_args();
+        test_profiler();
+        test_mapped_file();
+
+        std::vector<cl_platform_id> platforms;
+        try {
+            platforms = OCLPlatform::get_platform_ids();
+        } catch (const OCLError &) {
+        }
+
+        if (platforms.empty()) {
+            std::cout << "No OpenCL platform found, device tests skipped" << std::endl;
+        } else {
+            OCLPlatform platform(platforms[0]);
+            test_device(platform);
+        }
+    } catch (const OCLError &err) {
+        std::cout << "Unexpected error " << err.m_code << ": " << err.m_message << " (" << err.m_notes << ")" << std::endl;
+        ++g_failures;
+    }
+
+    return (g_failures > 0) ? 1 : 0;
+}